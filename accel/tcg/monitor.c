@@ -150,6 +150,7 @@ static void dump_exec_info(GString *buf)
 {
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
+    struct qht_counters hcnt;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
@@ -191,6 +192,10 @@ static void dump_exec_info(GString *buf)
                            qatomic_read(&tb_ctx.tb_flush_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    qht_counters_read(&tb_ctx.htable, &hcnt);
+    g_string_append_printf(buf, "TB hash resizes     %zu (longest chain %zu "
+                           "buckets%s)\n", hcnt.resizes, hcnt.max_chain,
+                           hcnt.migrating ? ", resize in progress" : "");
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
@@ -2760,6 +2760,9 @@ void blk_io_limits_enable(BlockBackend *blk, const char *group)
     GLOBAL_STATE_CODE();
     throttle_group_register_tgm(&blk->public.throttle_group_member,
                                 group, blk_get_aio_context(blk));
+    throttle_group_set_member_params(&blk->public.throttle_group_member,
+                                     blk_name(blk),
+                                     THROTTLE_GROUP_DEFAULT_WEIGHT, 0);
 }
 
 void blk_io_limits_update_group(BlockBackend *blk, const char *group)
@@ -36,6 +36,16 @@
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/*
+ * Adaptive tuning: buffered chunks may grow up to this size, and the
+ * number of workers starts at BLOCK_COPY_ADAPT_START_WORKERS.  Every
+ * BLOCK_COPY_ADAPT_WINDOW_NS the throughput and average request latency
+ * of the finished tasks are compared against the previous window.
+ */
+#define BLOCK_COPY_MAX_ADAPTIVE_BUFFER (16 * MiB)
+#define BLOCK_COPY_ADAPT_START_WORKERS 4
+#define BLOCK_COPY_ADAPT_WINDOW_NS 100000000ULL /* ns */
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -112,6 +122,32 @@ static int64_t task_end(BlockCopyTask *task)
     return task->req.offset + task->req.bytes;
 }
 
+/*
+ * AIMD controller for chunk size and parallelism.
+ *
+ * While throughput keeps improving, the number of workers is doubled (slow
+ * start), and after the first sign of congestion it is increased linearly,
+ * alternating with doubling the chunk size.  When the average request
+ * latency exceeds twice the lowest latency seen for the current chunk size
+ * without any throughput gain, the target is only queueing requests up:
+ * the number of workers is halved, and with a single worker left the chunk
+ * size is halved instead.
+ */
+typedef struct BlockCopyTuning {
+    bool enabled;
+    int64_t chunk; /* atomic for readers outside of the lock */
+    int workers; /* atomic for readers outside of the lock */
+    bool slow_start;
+    bool grow_chunk;
+
+    int64_t window_start;
+    uint64_t window_bytes;
+    uint64_t window_latency;
+    uint64_t window_requests;
+    uint64_t last_throughput;
+    uint64_t min_latency;
+} BlockCopyTuning;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -154,6 +190,7 @@ typedef struct BlockCopyState {
      * block_copy_reset_unallocated() every time it does.
      */
     bool skip_unallocated; /* atomic */
+    BlockCopyTuning tuning;
     /* State fields that use a thread-safe API */
     BdrvDirtyBitmap *copy_bitmap;
     ProgressMeter *progress;
@@ -161,16 +198,18 @@ typedef struct BlockCopyState {
     RateLimit rate_limit;
 } BlockCopyState;
 
-/* Called with lock held */
-static int64_t block_copy_chunk_size(BlockCopyState *s)
+static int64_t block_copy_method_max_chunk(BlockCopyState *s,
+                                           BlockCopyMethod method)
 {
-    switch (s->method) {
+    int64_t buffer = s->tuning.enabled ? BLOCK_COPY_MAX_ADAPTIVE_BUFFER :
+                                         BLOCK_COPY_MAX_BUFFER;
+
+    switch (method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
     case COPY_RANGE_SMALL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
-                   s->max_transfer);
+        return MIN(MAX(s->cluster_size, buffer), s->max_transfer);
     case COPY_RANGE_FULL:
         return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
                    s->max_transfer);
@@ -180,6 +219,101 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     }
 }
 
+/* Called with lock held */
+static int64_t block_copy_chunk_size(BlockCopyState *s)
+{
+    int64_t max_chunk = block_copy_method_max_chunk(s, s->method);
+
+    return s->tuning.enabled ? MIN(s->tuning.chunk, max_chunk) : max_chunk;
+}
+
+/* Called with lock held */
+static int block_copy_max_workers(BlockCopyState *s,
+                                  BlockCopyCallState *call_state)
+{
+    if (!s->tuning.enabled) {
+        return call_state->max_workers;
+    }
+    return MIN(s->tuning.workers, call_state->max_workers);
+}
+
+/*
+ * Account a successfully finished task of @bytes that took @latency_ns and
+ * adjust chunk size and number of workers at the end of each window.  Once
+ * the number of workers reaches the limit of @call_state, only the chunk
+ * size can grow any more.
+ *
+ * Called with lock held.
+ */
+static void block_copy_tuning_update(BlockCopyState *s,
+                                     BlockCopyCallState *call_state,
+                                     int64_t bytes, uint64_t latency_ns)
+{
+    BlockCopyTuning *t = &s->tuning;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t max_chunk, chunk = t->chunk;
+    int max_workers, workers = t->workers;
+    uint64_t throughput, latency;
+    bool congested;
+
+    t->window_bytes += bytes;
+    t->window_latency += latency_ns;
+    t->window_requests++;
+
+    if (now - t->window_start < BLOCK_COPY_ADAPT_WINDOW_NS) {
+        return;
+    }
+
+    throughput = muldiv64(t->window_bytes, NANOSECONDS_PER_SECOND,
+                          now - t->window_start);
+    latency = t->window_latency / t->window_requests;
+    congested = t->min_latency && latency > 2 * t->min_latency;
+    t->min_latency = t->min_latency ? MIN(t->min_latency, latency) : latency;
+
+    max_chunk = MIN_NON_ZERO(block_copy_method_max_chunk(s, s->method),
+                             call_state->max_chunk);
+    max_workers = MIN(call_state->max_workers, BLOCK_COPY_MAX_WORKERS);
+    workers = MIN(workers, max_workers);
+
+    if (congested && throughput <= t->last_throughput) {
+        t->slow_start = false;
+        if (workers > 1) {
+            workers /= 2;
+        } else if (chunk > s->cluster_size) {
+            chunk = MAX(QEMU_ALIGN_DOWN(chunk / 2, s->cluster_size),
+                        s->cluster_size);
+        }
+    } else if (throughput > t->last_throughput + t->last_throughput / 16) {
+        if (t->slow_start && workers < max_workers) {
+            workers = MIN(workers * 2, max_workers);
+        } else if (chunk < max_chunk &&
+                   (t->grow_chunk || workers >= max_workers)) {
+            chunk = MIN(chunk * 2, max_chunk);
+        } else if (workers < max_workers) {
+            workers++;
+        }
+        t->grow_chunk = !t->grow_chunk;
+    } else {
+        /* No gain from the last step, continue with linear increase */
+        t->slow_start = false;
+    }
+
+    if (chunk != t->chunk) {
+        /* Latency of differently sized requests is not comparable */
+        t->min_latency = 0;
+    }
+
+    trace_block_copy_tuning(s, throughput, latency, chunk, workers);
+
+    qatomic_set(&t->chunk, chunk);
+    qatomic_set(&t->workers, workers);
+    t->last_throughput = throughput;
+    t->window_start = now;
+    t->window_bytes = 0;
+    t->window_latency = 0;
+    t->window_requests = 0;
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -564,6 +698,7 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -576,6 +711,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             s->method = method;
         }
 
+        /* Zero writes say nothing about the data path, don't account them */
+        if (ret >= 0 && s->tuning.enabled && t->method != COPY_WRITE_ZEROES) {
+            block_copy_tuning_update(s, t->call_state, t->req.bytes,
+                                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                     start_ns);
+        }
+
         if (ret < 0) {
             if (!t->call_state->ret) {
                 t->call_state->ret = ret;
@@ -796,6 +938,12 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
+        if (aio && s->tuning.enabled) {
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                aio_task_pool_set_max_busy_tasks(
+                    aio, block_copy_max_workers(s, call_state));
+            }
+        }
 
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
@@ -1034,6 +1182,43 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
     qatomic_set(&s->skip_unallocated, skip);
 }
 
+/*
+ * Let block-copy adapt chunk size and number of workers to the throughput
+ * it observes.  The per-call max_workers and max_chunk remain upper limits.
+ *
+ * Only set before running the job, no need for locking.
+ */
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive)
+{
+    s->tuning = (BlockCopyTuning) {
+        .enabled = adaptive,
+        .chunk = MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
+                     MAX(s->max_transfer, s->cluster_size)),
+        .workers = BLOCK_COPY_ADAPT_START_WORKERS,
+        .slow_start = true,
+        .window_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+    };
+}
+
+/*
+ * Report the chunk size and number of workers currently used, and whether
+ * copy offloading is in effect.  A @max_workers of 0 means the limit of
+ * each call applies as is.
+ */
+void block_copy_get_tuning(BlockCopyState *s, int64_t *chunk_size,
+                           int *max_workers, bool *copy_offload)
+{
+    BlockCopyMethod method = qatomic_read(&s->method);
+
+    *chunk_size = block_copy_method_max_chunk(s, method);
+    *max_workers = 0;
+    if (s->tuning.enabled) {
+        *chunk_size = MIN(*chunk_size, qatomic_read(&s->tuning.chunk));
+        *max_workers = qatomic_read(&s->tuning.workers);
+    }
+    *copy_offload = method == COPY_RANGE_FULL;
+}
+
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     ratelimit_set_speed(&s->rate_limit, speed, BLOCK_COPY_SLICE_TIME);
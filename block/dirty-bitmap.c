@@ -96,10 +96,11 @@ BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
 }
 
 /* Called with BQL taken.  */
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
-                                          uint32_t granularity,
-                                          const char *name,
-                                          Error **errp)
+static BdrvDirtyBitmap *bdrv_do_create_dirty_bitmap(BlockDriverState *bs,
+                                                    uint32_t granularity,
+                                                    const char *name,
+                                                    bool compressed,
+                                                    Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
@@ -124,7 +125,9 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
     bitmap->bs = bs;
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ctz32(granularity));
+    bitmap->bitmap = compressed ?
+        hbitmap_alloc_compressed(bitmap_size, ctz32(granularity)) :
+        hbitmap_alloc(bitmap_size, ctz32(granularity));
     bitmap->size = bitmap_size;
     bitmap->name = g_strdup(name);
     bitmap->disabled = false;
@@ -134,6 +137,26 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     return bitmap;
 }
 
+/* Called with BQL taken.  */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          uint32_t granularity,
+                                          const char *name,
+                                          Error **errp)
+{
+    return bdrv_do_create_dirty_bitmap(bs, granularity, name, false, errp);
+}
+
+/* Allocate an empty HBitmap like the one of @bitmap.  */
+static HBitmap *bdrv_dirty_bitmap_alloc_hbitmap(BdrvDirtyBitmap *bitmap)
+{
+    int granularity = hbitmap_granularity(bitmap->bitmap);
+
+    if (hbitmap_is_compressed(bitmap->bitmap)) {
+        return hbitmap_alloc_compressed(bitmap->size, granularity);
+    }
+    return hbitmap_alloc(bitmap->size, granularity);
+}
+
 int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
 {
     return bitmap->size;
@@ -224,7 +247,9 @@ int bdrv_dirty_bitmap_create_successor(BdrvDirtyBitmap *bitmap, Error **errp)
 
     /* Create an anonymous successor */
     granularity = bdrv_dirty_bitmap_granularity(bitmap);
-    child = bdrv_create_dirty_bitmap(bitmap->bs, granularity, NULL, errp);
+    child = bdrv_do_create_dirty_bitmap(bitmap->bs, granularity, NULL,
+                                        bdrv_dirty_bitmap_compressed(bitmap),
+                                        errp);
     if (!child) {
         return -1;
     }
@@ -467,6 +492,8 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->persistent = bm->persistent;
         info->has_inconsistent = bm->inconsistent;
         info->inconsistent = bm->inconsistent;
+        info->has_compressed = true;
+        info->compressed = hbitmap_is_compressed(bm->bitmap);
         QAPI_LIST_APPEND(tail, info);
     }
     bdrv_dirty_bitmaps_unlock(bs);
@@ -580,8 +607,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bitmap->bitmap = bdrv_dirty_bitmap_alloc_hbitmap(bitmap);
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -760,6 +786,19 @@ bool bdrv_dirty_bitmap_inconsistent(const BdrvDirtyBitmap *bitmap)
     return bitmap->inconsistent;
 }
 
+/* Called with BQL taken. */
+void bdrv_dirty_bitmap_set_compressed(BdrvDirtyBitmap *bitmap, bool compressed)
+{
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    hbitmap_set_compressed(bitmap->bitmap, compressed);
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
+bool bdrv_dirty_bitmap_compressed(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_is_compressed(bitmap->bitmap);
+}
+
 BdrvDirtyBitmap *bdrv_dirty_bitmap_first(BlockDriverState *bs)
 {
     return QLIST_FIRST(&bs->dirty_bitmaps);
@@ -875,7 +914,7 @@ void bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        dest->bitmap = bdrv_dirty_bitmap_alloc_hbitmap(dest);
         hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
@@ -29,6 +29,7 @@
 #include "qapi/qapi-commands-block.h"
 #include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -44,15 +45,39 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Largest payload buffer a queue keeps around between requests */
+#define FUSE_MAX_SPARE_BYTES (1 * 1024 * 1024)
 
-typedef struct FuseExport {
+typedef struct FuseExport FuseExport;
+
+/*
+ * Requests are read from the FUSE session fd in every queue's AioContext.
+ * The fd is non-blocking and shared by all queues, so whichever thread gets
+ * to a request first handles it.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    AioContext *ctx;
+    IOThread *iothread; /* NULL for the export's own AioContext */
+
+    struct fuse_buf fuse_buf;
+    bool fuse_buf_busy;
+
+    /* Aligned payload buffer kept from the last request */
+    void *spare_buf;
+    size_t spare_size;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    FuseQueue *queues;
+    size_t num_queues;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -62,7 +87,7 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -74,19 +99,31 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
+static int fuse_export_init_queues(FuseExport *exp, strList *iothreads,
+                                   Error **errp);
 static void read_from_fuse_export(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        aio_set_fd_handler(exp->queues[i].ctx,
+                           fuse_session_fd(exp->fuse_session),
+                           enable ? read_from_fuse_export : NULL,
+                           NULL, NULL, NULL, &exp->queues[i]);
+    }
+    exp->fd_handler_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -95,11 +132,9 @@ static void fuse_export_drained_end(void *opaque)
 
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
+    exp->queues[0].ctx = exp->common.ctx;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -179,6 +214,11 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
 
+    ret = fuse_export_init_queues(exp, args->iothreads, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* set default */
     if (!args->has_allow_other) {
         args->allow_other = FUSE_EXPORT_ALLOW_OTHER_AUTO;
@@ -213,6 +253,101 @@ fail:
     return ret;
 }
 
+/**
+ * Create one queue for the export's AioContext and one for each IOThread
+ * in @iothreads.
+ */
+static int fuse_export_init_queues(FuseExport *exp, strList *iothreads,
+                                   Error **errp)
+{
+    strList *e;
+    size_t i;
+
+    exp->num_queues = 1;
+    for (e = iothreads; e; e = e->next) {
+        exp->num_queues++;
+    }
+    exp->queues = g_new0(FuseQueue, exp->num_queues);
+
+    exp->queues[0] = (FuseQueue) {
+        .exp = exp,
+        .ctx = exp->common.ctx,
+    };
+
+    for (e = iothreads, i = 1; e; e = e->next, i++) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", e->value);
+            exp->num_queues = i;
+            return -EINVAL;
+        }
+
+        object_ref(OBJECT(iothread));
+        exp->queues[i] = (FuseQueue) {
+            .exp = exp,
+            .ctx = iothread_get_aio_context(iothread),
+            .iothread = iothread,
+        };
+    }
+
+    return 0;
+}
+
+/**
+ * Return the queue of the AioContext that the calling request handler
+ * runs in.
+ */
+static FuseQueue *fuse_current_queue(FuseExport *exp)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        if (exp->queues[i].ctx == ctx) {
+            return &exp->queues[i];
+        }
+    }
+
+    return &exp->queues[0];
+}
+
+/**
+ * Get an aligned payload buffer of at least @size bytes, reusing the one
+ * kept by the current queue if it is large enough.  Nested requests (the
+ * block layer polls while handling a request) simply allocate a new one.
+ */
+static void *fuse_get_payload_buf(FuseExport *exp, size_t size)
+{
+    FuseQueue *q = fuse_current_queue(exp);
+    void *buf;
+
+    if (q->spare_buf && q->spare_size >= size) {
+        buf = q->spare_buf;
+        q->spare_buf = NULL;
+        return buf;
+    }
+
+    return qemu_try_blockalign(blk_bs(exp->common.blk), MAX(size, 1));
+}
+
+static void fuse_put_payload_buf(FuseExport *exp, void *buf, size_t size)
+{
+    FuseQueue *q = fuse_current_queue(exp);
+
+    if (!q->spare_buf && size <= FUSE_MAX_SPARE_BYTES) {
+        q->spare_buf = buf;
+        q->spare_size = size;
+    } else if (q->spare_buf && size > q->spare_size &&
+               size <= FUSE_MAX_SPARE_BYTES) {
+        qemu_vfree(q->spare_buf);
+        q->spare_buf = buf;
+        q->spare_size = size;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
 /**
  * Allocates the global @exports hash table.
  */
@@ -269,10 +404,19 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /*
+     * Several threads wait for the fd to become readable, but only one of
+     * them will get the request; the others must not block in read().
+     */
+    if (!g_unix_set_fd_nonblocking(fuse_session_fd(exp->fuse_session), true,
+                                   NULL)) {
+        error_setg_errno(errp, errno, "Failed to set FUSE session fd "
+                         "non-blocking");
+        ret = -errno;
+        goto fail;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 
     return 0;
 
@@ -287,23 +431,40 @@ fail:
  */
 static void read_from_fuse_export(void *opaque)
 {
-    FuseExport *exp = opaque;
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    struct fuse_buf local_buf = {};
+    struct fuse_buf *buf;
     int ret;
 
     blk_exp_ref(&exp->common);
 
     qatomic_inc(&exp->in_flight);
 
+    /*
+     * While a request is processed, the block layer may poll and thus
+     * call us again; the outer request may still use q->fuse_buf then.
+     */
+    buf = q->fuse_buf_busy ? &local_buf : &q->fuse_buf;
+    q->fuse_buf_busy = true;
+
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
+    if (ret <= 0) {
+        /* -EAGAIN: another queue got the request first */
         goto out;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
+    fuse_session_process_buf(exp->fuse_session, buf);
 
 out:
+    if (buf == &local_buf) {
+        free(local_buf.mem);
+    } else {
+        q->fuse_buf_busy = false;
+    }
+
     if (qatomic_fetch_dec(&exp->in_flight) == 1) {
         aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
     }
@@ -319,10 +480,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+            fuse_export_set_fd_handlers(exp, false);
         }
     }
 
@@ -338,6 +496,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -347,7 +506,14 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    for (i = 0; i < exp->num_queues; i++) {
+        free(exp->queues[i].fuse_buf.mem);
+        qemu_vfree(exp->queues[i].spare_buf);
+        if (exp->queues[i].iothread) {
+            object_unref(OBJECT(exp->queues[i].iothread));
+        }
+    }
+    g_free(exp->queues);
     g_free(exp->mountpoint);
 }
 
@@ -389,6 +555,15 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /*
+     * Have write payloads spliced into a pipe instead of being copied into
+     * the request buffer; fuse_write_buf() then moves them straight into an
+     * aligned buffer suitable for the block layer.
+     */
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
 }
 
 /**
@@ -601,7 +776,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
-    buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
+    buf = fuse_get_payload_buf(exp, size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
         return;
@@ -614,17 +789,28 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         fuse_reply_err(req, -ret);
     }
 
-    qemu_vfree(buf);
+    fuse_put_payload_buf(exp, buf, size);
 }
 
 /**
  * Handle client writes to the exported image.
+ *
+ * With FUSE_CAP_SPLICE_READ, the payload may still sit in a pipe, in which
+ * case it is copied into an aligned buffer that can be passed down as-is
+ * (without another bounce buffer for O_DIRECT).  Small payloads arrive in
+ * memory and are used in place.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void fuse_write_buf(fuse_req_t req, fuse_ino_t inode,
+                           struct fuse_bufvec *bufv, off_t offset,
+                           struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    size_t size = fuse_buf_size(bufv);
+    size_t payload_size = size;
+    void *payload = NULL;
+    const void *buf;
     int64_t length;
+    ssize_t copied;
     int ret;
 
     /* Limited by max_write, should not happen */
@@ -638,6 +824,33 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         return;
     }
 
+    /*
+     * Fetch the payload before anything below can poll: a nested request
+     * on this thread would reuse the pipe and the request buffer.
+     */
+    if (bufv->count - bufv->idx == 1 &&
+        !(bufv->buf[bufv->idx].flags & FUSE_BUF_IS_FD))
+    {
+        buf = (const char *)bufv->buf[bufv->idx].mem + bufv->off;
+    } else {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+        payload = fuse_get_payload_buf(exp, size);
+        if (!payload) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+
+        dst.buf[0].mem = payload;
+        copied = fuse_buf_copy(&dst, bufv, 0);
+        if (copied < 0) {
+            fuse_reply_err(req, -copied);
+            goto out;
+        }
+        size = copied;
+        buf = payload;
+    }
+
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
@@ -645,7 +858,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
-        return;
+        goto out;
     }
 
     if (offset + size > length) {
@@ -653,7 +866,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
             ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
-                return;
+                goto out;
             }
         } else {
             size = length - offset;
@@ -666,6 +879,11 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     } else {
         fuse_reply_err(req, -ret);
     }
+
+out:
+    if (payload) {
+        fuse_put_payload_buf(exp, payload, payload_size);
+    }
 }
 
 /**
@@ -873,7 +1091,7 @@ static const struct fuse_lowlevel_ops fuse_ops = {
     .setattr    = fuse_setattr,
     .open       = fuse_open,
     .read       = fuse_read,
-    .write      = fuse_write,
+    .write_buf  = fuse_write_buf,
     .fallocate  = fuse_fallocate,
     .flush      = fuse_flush,
     .fsync      = fuse_fsync,
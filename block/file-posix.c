@@ -36,6 +36,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "exec/memory.h" /* for ram_block_discard_disable() */
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 
@@ -77,6 +78,10 @@
 #include <linux/hdreg.h>
 #include <linux/magic.h>
 #include <scsi/sg.h>
+#ifdef HAVE_NVME_URING_CMD
+#include <linux/nvme_ioctl.h>
+#include "block/nvme.h"
+#endif
 #ifdef __s390__
 #include <asm/dasd.h>
 #endif
@@ -152,6 +157,12 @@ typedef struct BDRVRawState {
 
     uint64_t aio_max_batch;
 
+    /* NVMe namespace accessed through io_uring passthrough */
+    uint32_t nvme_nsid;
+    unsigned nvme_lba_shift;
+    uint64_t nvme_size;
+    uint32_t nvme_max_transfer;
+
     int perm_change_fd;
     int perm_change_flags;
     BDRVReopenState *reopen_state;
@@ -160,6 +171,8 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_fixed_buffers:1;
+    bool use_nvme_passthru:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -398,6 +411,16 @@ static void raw_probe_alignment(BlockDriverState *bs, int fd, Error **errp)
     size_t max_align = MAX(MAX_BLOCKSIZE, qemu_real_host_page_size());
     size_t alignments[] = {1, 512, 1024, 2048, 4096};
 
+    /*
+     * NVMe passthrough always transfers whole LBAs.  NVMe needs dword aligned
+     * buffers, the kernel bounces anything else.
+     */
+    if (s->use_nvme_passthru) {
+        bs->bl.request_alignment = 1 << s->nvme_lba_shift;
+        s->buf_align = sizeof(uint32_t);
+        return;
+    }
+
     /* For SCSI generic devices the alignment is not really used.
        With buffered I/O, we don't have any restrictions. */
     if (bdrv_is_sg(bs) || !s->needs_alignment) {
@@ -560,6 +583,11 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register I/O buffers with io_uring (default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -588,6 +616,24 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/* Let io_uring requests refer to s->fd through the registered file table */
+static void raw_register_fd(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        luring_register_file(s->fd);
+    }
+#endif
+}
+
+/* Must be called before s->fd is closed */
+static void raw_unregister_fd(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    luring_unregister_file(s->fd);
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -640,6 +686,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
+    s->use_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -736,6 +783,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_IO_URING) */
 
+    if (s->use_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers=on requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     s->has_discard = true;
     s->has_write_zeroes = true;
 
@@ -805,6 +858,20 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    /*
+     * Registered buffers stay pinned, so the guest must not discard the
+     * memory behind them.
+     */
+    if (s->use_fixed_buffers) {
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+    }
+    raw_register_fd(s);
+
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1485,6 +1552,10 @@ static void raw_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.min_mem_alignment = s->buf_align;
     bs->bl.opt_mem_alignment = MAX(s->buf_align, qemu_real_host_page_size());
 
+    if (s->use_nvme_passthru) {
+        bs->bl.max_transfer = s->nvme_max_transfer;
+    }
+
     /*
      * Maximum transfers are best effort, so it is okay to ignore any
      * errors.  That said, based on the man page errors in fstat would be
@@ -2473,6 +2544,25 @@ static inline bool raw_check_linux_aio(BDRVRawState *s)
 }
 #endif
 
+#ifdef HAVE_NVME_URING_CMD
+static int coroutine_fn raw_co_nvme_passthru(BlockDriverState *bs,
+                                             uint64_t offset,
+                                             QEMUIOVector *qiov, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    Error *local_err = NULL;
+
+    /* The device doesn't support anything else, so there is no fallback */
+    if (unlikely(!aio_setup_linux_io_uring_cmd(ctx, &local_err))) {
+        error_reportf_err(local_err, "Unable to use NVMe passthrough: ");
+        return -EIO;
+    }
+    return luring_co_submit_nvme(bs, s->fd, s->nvme_nsid, s->nvme_lba_shift,
+                                 offset, qiov, type);
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2494,6 +2584,14 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
     }
 #endif
 
+#ifdef HAVE_NVME_URING_CMD
+    if (s->use_nvme_passthru) {
+        assert(qiov->size == bytes);
+        ret = raw_co_nvme_passthru(bs, offset, qiov, type);
+        goto out;
+    }
+#endif
+
     /*
      * When using O_DIRECT, the request must be aligned to be able to use
      * either libaio or io_uring interface. If not fail back to regular thread
@@ -2595,6 +2693,11 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
         .aio_type       = QEMU_AIO_FLUSH,
     };
 
+#ifdef HAVE_NVME_URING_CMD
+    if (s->use_nvme_passthru) {
+        return raw_co_nvme_passthru(bs, 0, NULL, QEMU_AIO_FLUSH);
+    }
+#endif
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
         return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
@@ -2611,10 +2714,36 @@ static void raw_close(BlockDriverState *bs)
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
 #endif
+        raw_unregister_fd(s);
         qemu_close(s->fd);
         s->fd = -1;
     }
+    if (s->use_fixed_buffers) {
+        ram_block_discard_disable(false);
+    }
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->use_fixed_buffers) {
+        return true;
+    }
+    return luring_register_buf(host, size, errp);
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_fixed_buffers) {
+        luring_unregister_buf(host, size);
+    }
 }
+#endif
 
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
@@ -2844,6 +2973,10 @@ static int64_t raw_getlength(BlockDriverState *bs)
         return ret;
     }
 
+    if (s->use_nvme_passthru) {
+        return s->nvme_size;
+    }
+
     size = lseek(s->fd, 0, SEEK_END);
     if (size < 0) {
         return -errno;
@@ -3802,9 +3935,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_unregister_fd(s);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_register_fd(s);
     }
     s->perm_change_fd = 0;
 
@@ -3909,6 +4044,10 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4091,6 +4230,106 @@ static bool hdev_is_sg(BlockDriverState *bs)
     return false;
 }
 
+#ifdef HAVE_NVME_URING_CMD
+/*
+ * Stay below the kernel's limit for passthrough requests, which isn't
+ * exported for NVMe generic character devices
+ */
+#define HDEV_NVME_MAX_TRANSFER (1 * MiB)
+
+static int hdev_nvme_identify(int fd, uint32_t nsid, uint32_t cns, void *buf)
+{
+    struct nvme_admin_cmd cmd = {
+        .opcode     = NVME_ADM_CMD_IDENTIFY,
+        .nsid       = nsid,
+        .addr       = (uintptr_t)buf,
+        .data_len   = NVME_IDENTIFY_DATA_SIZE,
+        .cdw10      = cns,
+    };
+    int ret;
+
+    ret = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+    if (ret < 0) {
+        return -errno;
+    }
+    /* Positive values are NVMe status codes */
+    return ret ? -EIO : 0;
+}
+
+/*
+ * NVMe generic character devices (/dev/ngXnY) don't support read() and
+ * write(), but accept NVMe commands through io_uring passthrough.  This
+ * reaches the device without the kernel's block layer in between, while
+ * the device stays bound to the kernel driver.
+ */
+static int hdev_probe_nvme_passthru(BlockDriverState *bs, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    g_autofree NvmeIdCtrl *id_ctrl = g_new0(NvmeIdCtrl, 1);
+    g_autofree NvmeIdNs *id_ns = g_new0(NvmeIdNs, 1);
+    NvmeLBAF *lbaf;
+    struct stat st;
+    int nsid;
+    int ret;
+
+    if (fstat(s->fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+        return 0;
+    }
+    nsid = ioctl(s->fd, NVME_IOCTL_ID);
+    if (nsid <= 0) {
+        return 0;
+    }
+
+    if (!s->use_linux_io_uring) {
+        error_setg(errp, "NVMe generic character devices require aio=io_uring");
+        return -EINVAL;
+    }
+
+    /* Identify doesn't need CAP_SYS_ADMIN on the namespace's device */
+    ret = hdev_nvme_identify(s->fd, nsid, NVME_ID_CNS_NS, id_ns);
+    if (ret == 0) {
+        ret = hdev_nvme_identify(s->fd, 0, NVME_ID_CNS_CTRL, id_ctrl);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to identify NVMe namespace");
+        return ret;
+    }
+
+    lbaf = &id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(id_ns->flbas)];
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not yet supported");
+        return -ENOTSUP;
+    }
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > 12) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        return -ENOTSUP;
+    }
+
+    /* Set up the ring now so that a kernel without support fails early */
+    if (!aio_setup_linux_io_uring_cmd(qemu_get_current_aio_context(), errp)) {
+        error_prepend(errp, "NVMe passthrough is not available: ");
+        return -ENOTSUP;
+    }
+
+    s->use_nvme_passthru = true;
+    s->nvme_nsid = nsid;
+    s->nvme_lba_shift = lbaf->ds;
+    s->nvme_size = le64_to_cpu(id_ns->nsze) << lbaf->ds;
+    /* MDTS is in units of the minimum page size, which is at least 4k */
+    s->nvme_max_transfer = HDEV_NVME_MAX_TRANSFER;
+    if (id_ctrl->mdts && id_ctrl->mdts < 20) {
+        s->nvme_max_transfer = MIN(4 * KiB << id_ctrl->mdts,
+                                   HDEV_NVME_MAX_TRANSFER);
+    }
+
+    /* The NVMe commands for these aren't wired up yet */
+    s->has_discard = false;
+    s->has_write_zeroes = false;
+    return 0;
+}
+#endif
+
 static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -4173,6 +4412,14 @@ hdev_open_Mac_error:
         return ret;
     }
 
+#ifdef HAVE_NVME_URING_CMD
+    ret = hdev_probe_nvme_passthru(bs, errp);
+    if (ret < 0) {
+        raw_close(bs);
+        return ret;
+    }
+#endif
+
     /* Since this does ioctl the device must be already opened */
     bs->sg = hdev_is_sg(bs);
 
@@ -4278,6 +4525,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
 
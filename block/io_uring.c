@@ -10,14 +10,22 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#ifdef HAVE_NVME_URING_CMD
+#include <linux/nvme_ioctl.h>
+#endif
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
+#ifdef HAVE_NVME_URING_CMD
+#include "block/nvme.h"
+#endif
 #include "trace.h"
 
 /* Only used for assertions.  */
@@ -26,9 +34,20 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered buffer and file tables of each ring */
+#define MAX_FIXED_BUFS 1024
+#define MAX_FIXED_FILES 256
+
+/* The kernel refuses to register larger buffers */
+#define MAX_FIXED_BUF_SIZE (1ULL << 30)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
-    struct io_uring_sqe sqeq;
+    union {
+        struct io_uring_sqe sqeq;
+        /* Rings for NVMe passthrough use 128 byte SQEs */
+        uint8_t sqe128[128];
+    };
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
@@ -40,6 +59,10 @@ typedef struct LuringAIOCB {
      */
     int total_read;
     QEMUIOVector resubmit_qiov;
+
+    /* Completion of requests on a ring shared with the AioContext */
+    AioUringRequest req;
+    LuringState *s;
 } LuringAIOCB;
 
 typedef struct LuringQueue {
@@ -52,14 +75,287 @@ typedef struct LuringQueue {
 struct LuringState {
     AioContext *aio_context;
 
-    struct io_uring ring;
+    /*
+     * Either own_ring, or the ring that ring_owner uses to monitor file
+     * descriptors.  Requests on a shared ring are submitted and completed by
+     * aio_poll() instead of a fd handler of our own.
+     */
+    struct io_uring *ring;
+    struct io_uring own_ring;
+    AioContext *ring_owner;
 
     /* No locking required, only accessed from AioContext home thread */
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * Copy of the luring_fixed tables as they are registered with this
+     * ring.  Only accessed from the AioContext home thread, which is also
+     * the only thread that updates the kernel's tables, so a lookup here
+     * always matches what the kernel will use.
+     */
+    bool fixed_supported;
+    unsigned fixed_generation;
+    struct iovec fixed_bufs[MAX_FIXED_BUFS];
+    unsigned nr_fixed_bufs;
+    int fixed_files[MAX_FIXED_FILES];
+    unsigned nr_fixed_files;
+    QEMUBH *fixed_bh;
+    QLIST_ENTRY(LuringState) next;
 };
 
+/*
+ * Buffers and files registered with luring_register_buf() and
+ * luring_register_file().  They are shared by all rings, and each ring
+ * brings its own kernel tables up to date from its home thread before the
+ * next submission, or from fixed_bh when a registration goes away so that
+ * pinned memory and file references are dropped promptly.
+ */
+static struct {
+    QemuMutex lock;
+    unsigned generation;
+    struct iovec bufs[MAX_FIXED_BUFS];
+    unsigned buf_refs[MAX_FIXED_BUFS];
+    int files[MAX_FIXED_FILES];
+    QLIST_HEAD(, LuringState) rings;
+} luring_fixed;
+
+static void __attribute__((constructor)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed.lock);
+    for (int i = 0; i < MAX_FIXED_FILES; i++) {
+        luring_fixed.files[i] = -1;
+    }
+    QLIST_INIT(&luring_fixed.rings);
+}
+
+/* Called with luring_fixed.lock held */
+static void luring_fixed_changed(bool kick)
+{
+    LuringState *s;
+
+    qatomic_store_release(&luring_fixed.generation,
+                          luring_fixed.generation + 1);
+    if (kick) {
+        QLIST_FOREACH(s, &luring_fixed.rings, next) {
+            qemu_bh_schedule(s->fixed_bh);
+        }
+    }
+}
+
+/**
+ * luring_fixed_sync:
+ *
+ * Bring the registered buffer and file tables of the ring up to date.  Slots
+ * that the kernel refuses to register, for example because of
+ * RLIMIT_MEMLOCK, stay empty and requests fall back to unregistered I/O.
+ */
+static void luring_fixed_sync(LuringState *s)
+{
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    unsigned i;
+    int ret;
+
+    if (!s->fixed_supported ||
+        qatomic_load_acquire(&luring_fixed.generation) == s->fixed_generation) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    s->nr_fixed_bufs = 0;
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        struct iovec *iov = &luring_fixed.bufs[i];
+
+        if (iov->iov_base != s->fixed_bufs[i].iov_base ||
+            iov->iov_len != s->fixed_bufs[i].iov_len) {
+            ret = io_uring_register_buffers_update_tag(s->ring, i, iov,
+                                                       NULL, 1);
+            trace_luring_fixed_buf_update(s, i, iov->iov_base, iov->iov_len,
+                                          ret);
+            if (ret < 0) {
+                /* Make sure the slot doesn't keep an older buffer pinned */
+                s->fixed_bufs[i] = (struct iovec) {};
+                io_uring_register_buffers_update_tag(s->ring, i,
+                                                     &s->fixed_bufs[i],
+                                                     NULL, 1);
+            } else {
+                s->fixed_bufs[i] = *iov;
+            }
+        }
+        if (s->fixed_bufs[i].iov_len) {
+            s->nr_fixed_bufs = i + 1;
+        }
+    }
+
+    s->nr_fixed_files = 0;
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        int fd = luring_fixed.files[i];
+
+        if (fd != s->fixed_files[i]) {
+            ret = io_uring_register_files_update(s->ring, i, &fd, 1);
+            trace_luring_fixed_file_update(s, i, fd, ret);
+            if (ret < 0) {
+                fd = -1;
+                io_uring_register_files_update(s->ring, i, &fd, 1);
+            }
+            s->fixed_files[i] = fd;
+        }
+        if (s->fixed_files[i] >= 0) {
+            s->nr_fixed_files = i + 1;
+        }
+    }
+
+    s->fixed_generation = luring_fixed.generation;
+#endif
+}
+
+static void luring_fixed_bh(void *opaque)
+{
+    luring_fixed_sync(opaque);
+}
+
+/* Returns the index of the registered buffer that contains @iov, or -1 */
+static int luring_fixed_buf_index(LuringState *s, const struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t)iov->iov_base;
+
+    for (unsigned i = 0; i < s->nr_fixed_bufs; i++) {
+        uintptr_t buf_start = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (start >= buf_start &&
+            start - buf_start + iov->iov_len <= s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the index of @fd in the registered file table, or -1 */
+static int luring_fixed_file_index(LuringState *s, int fd)
+{
+    for (unsigned i = 0; i < s->nr_fixed_files; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Called with luring_fixed.lock held */
+static void luring_fixed_buf_put(void *host, size_t size)
+{
+    for (int i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (luring_fixed.bufs[i].iov_base == host &&
+            luring_fixed.bufs[i].iov_len == size) {
+            if (--luring_fixed.buf_refs[i] == 0) {
+                luring_fixed.bufs[i] = (struct iovec) {};
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * luring_register_buf:
+ *
+ * Register memory with all rings so that requests whose buffer lies within it
+ * can use IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED and skip pinning the
+ * pages for every request.  Memory is split into chunks that the kernel
+ * accepts, a request that crosses a chunk boundary is submitted normally.
+ */
+bool luring_register_buf(void *host, size_t size, Error **errp)
+{
+    size_t done;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (done = 0; done < size; done += MAX_FIXED_BUF_SIZE) {
+        struct iovec iov = {
+            .iov_base = host + done,
+            .iov_len = MIN(size - done, MAX_FIXED_BUF_SIZE),
+        };
+        int free_slot = -1;
+        int i;
+
+        for (i = 0; i < MAX_FIXED_BUFS; i++) {
+            if (luring_fixed.bufs[i].iov_base == iov.iov_base &&
+                luring_fixed.bufs[i].iov_len == iov.iov_len) {
+                break;
+            }
+            if (free_slot < 0 && !luring_fixed.buf_refs[i]) {
+                free_slot = i;
+            }
+        }
+        if (i == MAX_FIXED_BUFS) {
+            if (free_slot < 0) {
+                error_setg(errp, "Too many io_uring registered buffers");
+                goto fail;
+            }
+            i = free_slot;
+            luring_fixed.bufs[i] = iov;
+        }
+        luring_fixed.buf_refs[i]++;
+    }
+
+    luring_fixed_changed(false);
+    return true;
+
+fail:
+    while (done > 0) {
+        done -= MAX_FIXED_BUF_SIZE;
+        luring_fixed_buf_put(host + done,
+                             MIN(size - done, MAX_FIXED_BUF_SIZE));
+    }
+    return false;
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (size_t done = 0; done < size; done += MAX_FIXED_BUF_SIZE) {
+        luring_fixed_buf_put(host + done,
+                             MIN(size - done, MAX_FIXED_BUF_SIZE));
+    }
+    luring_fixed_changed(true);
+}
+
+/**
+ * luring_register_file:
+ *
+ * Register @fd with all rings so that requests on it skip the per-request
+ * file reference counting.  This is only an optimization, so running out of
+ * slots is not an error.  luring_unregister_file() must be called before
+ * @fd is closed.
+ */
+void luring_register_file(int fd)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (int i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.files[i] < 0) {
+            luring_fixed.files[i] = fd;
+            luring_fixed_changed(false);
+            return;
+        }
+    }
+}
+
+void luring_unregister_file(int fd)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (int i = 0; i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed.files[i] == fd) {
+            luring_fixed.files[i] = -1;
+            luring_fixed_changed(true);
+            return;
+        }
+    }
+}
+
 /**
  * luring_resubmit:
  *
@@ -90,6 +386,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* The rest of the buffer is still within the registered buffer */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -108,6 +413,81 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/* Completes a request whose cqe returned @ret */
+static void luring_complete(LuringState *s, LuringAIOCB *luringcb, int ret)
+{
+    /* total_read is non-zero only for resubmitted read requests */
+    int total_bytes = ret + luringcb->total_read;
+
+    /* Change counters one-by-one because we can be nested. */
+    s->io_q.in_flight--;
+    trace_luring_process_completion(s, luringcb, ret);
+
+    if (ret < 0) {
+        /*
+         * Only writev/readv/fsync requests on regular files or host block
+         * devices are submitted. Therefore -EAGAIN is not expected but it's
+         * known to happen sometimes with Linux SCSI. Submit again and hope
+         * the request completes successfully.
+         *
+         * For more information, see:
+         * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
+         *
+         * If the code is changed to submit other types of requests in the
+         * future, then this workaround may need to be extended to deal with
+         * genuine -EAGAIN results that should not be resubmitted
+         * immediately.
+         */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            return;
+        }
+#ifdef HAVE_NVME_URING_CMD
+    } else if (luringcb->sqeq.opcode == IORING_OP_URING_CMD) {
+        /* NVMe passthrough returns the NVMe status instead of a length */
+        if (ret) {
+            trace_luring_nvme_status(s, luringcb, ret);
+            ret = -EIO;
+        }
+        goto end;
+#endif
+    } else if (!luringcb->qiov) {
+        goto end;
+    } else if (total_bytes == luringcb->qiov->size) {
+        ret = 0;
+    /* Only read/write */
+    } else {
+        /* Short Read/Write */
+        if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            } else {
+                /* Pad with zeroes */
+                qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                  luringcb->qiov->size - total_bytes);
+                ret = 0;
+            }
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+end:
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    assert(luringcb->co->ctx == s->aio_context);
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -124,7 +504,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
-    int total_bytes;
 
     defer_call_begin();
 
@@ -145,7 +524,7 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
-    while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
+    while (io_uring_peek_cqe(s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
 
@@ -155,70 +534,10 @@ static void luring_process_completions(LuringState *s)
 
         luringcb = io_uring_cqe_get_data(cqes);
         ret = cqes->res;
-        io_uring_cqe_seen(&s->ring, cqes);
+        io_uring_cqe_seen(s->ring, cqes);
         cqes = NULL;
 
-        /* Change counters one-by-one because we can be nested. */
-        s->io_q.in_flight--;
-        trace_luring_process_completion(s, luringcb, ret);
-
-        /* total_read is non-zero only for resubmitted read requests */
-        total_bytes = ret + luringcb->total_read;
-
-        if (ret < 0) {
-            /*
-             * Only writev/readv/fsync requests on regular files or host block
-             * devices are submitted. Therefore -EAGAIN is not expected but it's
-             * known to happen sometimes with Linux SCSI. Submit again and hope
-             * the request completes successfully.
-             *
-             * For more information, see:
-             * https://lore.kernel.org/io-uring/20210727165811.284510-3-axboe@kernel.dk/T/#u
-             *
-             * If the code is changed to submit other types of requests in the
-             * future, then this workaround may need to be extended to deal with
-             * genuine -EAGAIN results that should not be resubmitted
-             * immediately.
-             */
-            if (ret == -EINTR || ret == -EAGAIN) {
-                luring_resubmit(s, luringcb);
-                continue;
-            }
-        } else if (!luringcb->qiov) {
-            goto end;
-        } else if (total_bytes == luringcb->qiov->size) {
-            ret = 0;
-        /* Only read/write */
-        } else {
-            /* Short Read/Write */
-            if (luringcb->is_read) {
-                if (ret > 0) {
-                    luring_resubmit_short_read(s, luringcb, ret);
-                    continue;
-                } else {
-                    /* Pad with zeroes */
-                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
-                                      luringcb->qiov->size - total_bytes);
-                    ret = 0;
-                }
-            } else {
-                ret = -ENOSPC;
-            }
-        }
-end:
-        luringcb->ret = ret;
-        qemu_iovec_destroy(&luringcb->resubmit_qiov);
-
-        /*
-         * If the coroutine is already entered it must be in ioq_submit()
-         * and will notice luringcb->ret has been filled in when it
-         * eventually runs later. Coroutines cannot be entered recursively
-         * so avoid doing that!
-         */
-        assert(luringcb->co->ctx == s->aio_context);
-        if (!qemu_coroutine_entered(luringcb->co)) {
-            aio_co_wake(luringcb->co);
-        }
+        luring_complete(s, luringcb, ret);
     }
 
     qemu_bh_cancel(s->completion_bh);
@@ -226,11 +545,44 @@ end:
     defer_call_end();
 }
 
+static int ioq_submit_shared(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+        struct io_uring_sqe *sqes = io_uring_get_sqe(s->ring);
+
+        if (!sqes) {
+            /* Make room for the remaining requests */
+            ret = aio_uring_submit(s->ring_owner, true);
+            trace_luring_io_uring_submit(s, ret);
+            if (ret <= 0) {
+                return ret;
+            }
+            continue;
+        }
+        *sqes = luringcb->sqeq;
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.in_flight++;
+        s->io_q.in_queue--;
+    }
+
+    /* Usually left to the io_uring_submit_and_wait() call of aio_poll() */
+    ret = aio_uring_submit(s->ring_owner, false);
+    trace_luring_io_uring_submit(s, ret);
+    return ret;
+}
+
 static int ioq_submit(LuringState *s)
 {
     int ret = 0;
     LuringAIOCB *luringcb, *luringcb_next;
 
+    if (s->ring_owner) {
+        return ioq_submit_shared(s);
+    }
+
     while (s->io_q.in_queue > 0) {
         /*
          * Try to fetch sqes from the ring for requests waiting in
@@ -238,15 +590,22 @@ static int ioq_submit(LuringState *s)
          */
         QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
                               luringcb_next) {
-            struct io_uring_sqe *sqes = io_uring_get_sqe(&s->ring);
+            struct io_uring_sqe *sqes = io_uring_get_sqe(s->ring);
             if (!sqes) {
                 break;
             }
             /* Prep sqe for submission */
-            *sqes = luringcb->sqeq;
+#ifdef HAVE_NVME_URING_CMD
+            if (s->ring->flags & IORING_SETUP_SQE128) {
+                memcpy(sqes, luringcb->sqe128, sizeof(luringcb->sqe128));
+            } else
+#endif
+            {
+                *sqes = luringcb->sqeq;
+            }
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
-        ret = io_uring_submit(&s->ring);
+        ret = io_uring_submit(s->ring);
         trace_luring_io_uring_submit(s, ret);
         /* Prevent infinite loop if submission is refused */
         if (ret <= 0) {
@@ -295,7 +654,7 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
-    return io_uring_cq_ready(&s->ring);
+    return io_uring_cq_ready(s->ring);
 }
 
 static void qemu_luring_poll_ready(void *opaque)
@@ -323,6 +682,55 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
+/* AioUringRequest callback for requests on a shared ring */
+static void luring_request_done(AioUringRequest *req)
+{
+    LuringAIOCB *luringcb = container_of(req, LuringAIOCB, req);
+    LuringState *s = luringcb->s;
+
+    luring_complete(s, luringcb, req->res);
+
+    /* Resubmitted requests go out with those that the callbacks submit */
+    if (s->io_q.in_queue > 0) {
+        defer_call(luring_deferred_fn, s);
+    }
+}
+
+/**
+ * luring_queue_request:
+ * @luringcb: AIO control block with a prepared sqe
+ * @s: AIO state
+ *
+ * Adds the request to the pending queue and submits the queue if it is full
+ */
+static int luring_queue_request(LuringAIOCB *luringcb, LuringState *s)
+{
+    int ret;
+
+    if (s->ring_owner) {
+        luringcb->s = s;
+        luringcb->req.cb = luring_request_done;
+        aio_uring_sqe_set_request(&luringcb->sqeq, &luringcb->req);
+    } else {
+        io_uring_sqe_set_data(&luringcb->sqeq, luringcb);
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.in_queue,
+                           s->io_q.in_flight);
+    if (!s->io_q.blocked) {
+        if (s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES) {
+            ret = ioq_submit(s);
+            trace_luring_do_submit_done(s, ret);
+            return ret;
+        }
+
+        defer_call(luring_deferred_fn, s);
+    }
+    return 0;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -337,21 +745,37 @@ static void luring_deferred_fn(void *opaque)
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int fixed_file;
+    int fixed_buf = -1;
+
+    luring_fixed_sync(s);
+    fixed_file = luring_fixed_file_index(s, fd);
+    if (fixed_file >= 0) {
+        fd = fixed_file;
+    }
+    if (qiov && qiov->niov == 1) {
+        fixed_buf = luring_fixed_buf_index(s, &qiov->iov[0]);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
     case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (fixed_buf >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, fixed_buf);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (fixed_buf >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, fixed_buf);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -361,22 +785,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
-    io_uring_sqe_set_data(sqes, luringcb);
-
-    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
-    s->io_q.in_queue++;
-    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.in_queue,
-                           s->io_q.in_flight);
-    if (!s->io_q.blocked) {
-        if (s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES) {
-            ret = ioq_submit(s);
-            trace_luring_do_submit_done(s, ret);
-            return ret;
-        }
-
-        defer_call(luring_deferred_fn, s);
+    if (fixed_file >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
     }
-    return 0;
+
+    return luring_queue_request(luringcb, s);
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
@@ -405,32 +818,202 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     return luringcb.ret;
 }
 
+#ifdef HAVE_NVME_URING_CMD
+/**
+ * luring_co_submit_nvme:
+ * @fd: NVMe generic character device
+ * @nsid: namespace ID
+ * @lba_shift: log2 of the namespace's LBA size
+ *
+ * Like luring_co_submit(), but sends NVMe commands through IORING_OP_URING_CMD
+ * instead of going through the kernel's block layer.  @offset and the size of
+ * @qiov must be aligned to the LBA size.
+ */
+int coroutine_fn luring_co_submit_nvme(BlockDriverState *bs, int fd,
+                                       uint32_t nsid, unsigned lba_shift,
+                                       uint64_t offset, QEMUIOVector *qiov,
+                                       int type)
+{
+    int ret;
+    AioContext *ctx = qemu_get_current_aio_context();
+    LuringState *s = aio_get_linux_io_uring_cmd(ctx);
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+    struct io_uring_sqe *sqe = &luringcb.sqeq;
+    struct nvme_uring_cmd *cmd = (struct nvme_uring_cmd *)sqe->cmd;
+    uint64_t slba = offset >> lba_shift;
+    int fixed_file;
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
+                           type);
+
+    luring_fixed_sync(s);
+    fixed_file = luring_fixed_file_index(s, fd);
+
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = fixed_file >= 0 ? fixed_file : fd;
+    sqe->flags = fixed_file >= 0 ? IOSQE_FIXED_FILE : 0;
+    sqe->cmd_op = NVME_URING_CMD_IO;
+    cmd->nsid = nsid;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+        assert(QEMU_IS_ALIGNED(offset | qiov->size, 1 << lba_shift));
+        cmd->opcode = type == QEMU_AIO_READ ? NVME_CMD_READ : NVME_CMD_WRITE;
+        cmd->cdw10 = slba;
+        cmd->cdw11 = slba >> 32;
+        cmd->cdw12 = (qiov->size >> lba_shift) - 1;
+        if (qiov->niov == 1) {
+            cmd->addr = (uintptr_t)qiov->iov[0].iov_base;
+            cmd->data_len = qiov->iov[0].iov_len;
+        } else {
+            sqe->cmd_op = NVME_URING_CMD_IO_VEC;
+            cmd->addr = (uintptr_t)qiov->iov;
+            cmd->data_len = qiov->niov;
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        cmd->opcode = NVME_CMD_FLUSH;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
+                        __func__, type);
+        abort();
+    }
+
+    ret = luring_queue_request(&luringcb, s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+#endif
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
-    aio_set_fd_handler(old_context, s->ring.ring_fd,
-                       NULL, NULL, NULL, NULL, s);
-    qemu_bh_delete(s->completion_bh);
+    WITH_QEMU_LOCK_GUARD(&luring_fixed.lock) {
+        QLIST_REMOVE(s, next);
+    }
+    qemu_bh_delete(s->fixed_bh);
+    if (!s->ring_owner) {
+        aio_set_fd_handler(old_context, s->ring->ring_fd,
+                           NULL, NULL, NULL, NULL, s);
+        qemu_bh_delete(s->completion_bh);
+    }
     s->aio_context = NULL;
 }
 
 void luring_attach_aio_context(LuringState *s, AioContext *new_context)
 {
+    /* A shared ring can only be used from its own AioContext */
+    assert(!s->ring_owner || s->ring_owner == new_context);
+
     s->aio_context = new_context;
-    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
-    aio_set_fd_handler(s->aio_context, s->ring.ring_fd,
-                       qemu_luring_completion_cb, NULL,
-                       qemu_luring_poll_cb, qemu_luring_poll_ready, s);
+    if (!s->ring_owner) {
+        s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh,
+                                      s);
+        aio_set_fd_handler(s->aio_context, s->ring->ring_fd,
+                           qemu_luring_completion_cb, NULL,
+                           qemu_luring_poll_cb, qemu_luring_poll_ready, s);
+    }
+    s->fixed_bh = aio_bh_new(new_context, luring_fixed_bh, s);
+    WITH_QEMU_LOCK_GUARD(&luring_fixed.lock) {
+        QLIST_INSERT_HEAD(&luring_fixed.rings, s, next);
+    }
+}
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+static void luring_fixed_setup(LuringState *s)
+{
+    /*
+     * Registered buffers and files are only an optimization, so keep going
+     * with plain requests if the kernel doesn't support sparse tables.
+     */
+    for (int i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
+    s->fixed_supported =
+        io_uring_register_buffers_sparse(s->ring, MAX_FIXED_BUFS) == 0 &&
+        io_uring_register_files_sparse(s->ring, MAX_FIXED_FILES) == 0;
+    s->fixed_generation = qatomic_load_acquire(&luring_fixed.generation) - 1;
 }
 
-LuringState *luring_init(Error **errp)
+static int luring_queue_init(LuringState *s, int64_t sqpoll_idle_ms,
+                             bool uring_cmd)
+{
+    struct io_uring_params params = {};
+    unsigned flags = 0;
+    int rc;
+
+#ifdef HAVE_NVME_URING_CMD
+    if (uring_cmd) {
+        flags |= IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    }
+#else
+    assert(!uring_cmd);
+#endif
+
+    params.flags = flags;
+    if (sqpoll_idle_ms) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = MIN(sqpoll_idle_ms, UINT32_MAX);
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, s->ring, &params);
+    if (rc < 0 && sqpoll_idle_ms) {
+        warn_report("io_uring submission queue polling is not available (%s), "
+                    "using normal submission instead", strerror(-rc));
+        params = (struct io_uring_params) { .flags = flags };
+        rc = io_uring_queue_init_params(MAX_ENTRIES, s->ring, &params);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+
+    luring_fixed_setup(s);
+    return 0;
+}
+#else
+static void luring_fixed_setup(LuringState *s)
+{
+}
+
+static int luring_queue_init(LuringState *s, int64_t sqpoll_idle_ms,
+                             bool uring_cmd)
+{
+    assert(!uring_cmd);
+    if (sqpoll_idle_ms) {
+        warn_report("io_uring submission queue polling is not supported by "
+                    "this build, using normal submission instead");
+    }
+    return io_uring_queue_init(MAX_ENTRIES, s->ring, 0);
+}
+#endif
+
+/**
+ * luring_init:
+ * @sqpoll_idle_ms: idle time of the submission queue polling thread, 0 to
+ *                  submit requests with system calls
+ * @uring_cmd: set up the ring for luring_co_submit_nvme()
+ */
+LuringState *luring_init(int64_t sqpoll_idle_ms, bool uring_cmd, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
-    struct io_uring *ring = &s->ring;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    s->ring = &s->own_ring;
+    rc = luring_queue_init(s, sqpoll_idle_ms, uring_cmd);
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -442,9 +1025,39 @@ LuringState *luring_init(Error **errp)
 
 }
 
+/**
+ * luring_init_shared:
+ *
+ * Like luring_init(), but submit requests on the ring that @ctx uses to
+ * monitor file descriptors, so that one io_uring_enter() both submits I/O
+ * and waits for events.  Returns NULL if @ctx doesn't use io_uring.
+ */
+LuringState *luring_init_shared(AioContext *ctx)
+{
+    struct io_uring *ring = aio_uring_attach(ctx);
+    LuringState *s;
+
+    if (!ring) {
+        return NULL;
+    }
+
+    s = g_new0(LuringState, 1);
+    trace_luring_init_shared(s, ctx);
+
+    s->ring = ring;
+    s->ring_owner = ctx;
+    luring_fixed_setup(s);
+    ioq_init(&s->io_q);
+    return s;
+}
+
 void luring_cleanup(LuringState *s)
 {
-    io_uring_queue_exit(&s->ring);
+    if (s->ring_owner) {
+        aio_uring_detach(s->ring_owner);
+    } else {
+        io_uring_queue_exit(s->ring);
+    }
     trace_luring_cleanup_state(s);
     g_free(s);
 }
@@ -28,22 +28,59 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Replacement follows the 2Q algorithm: a table that is loaded enters the
+ * A1in FIFO and only moves to the Am LRU queue if it is needed again
+ * after it was evicted, which the A1out ghost queue remembers.  Tables
+ * touched by a single sequential pass (a backup job, qemu-img convert)
+ * therefore cycle through A1in without pushing the guest's working set
+ * out of Am.
+ */
+typedef enum Qcow2CacheQueue {
+    QCOW2_CACHE_FREE,       /* table slot without a table */
+    QCOW2_CACHE_A1IN,       /* table loaded once, FIFO order */
+    QCOW2_CACHE_AM,         /* table that proved hot, LRU order */
+    QCOW2_CACHE_A1OUT,      /* ghost: offset recently evicted from A1in */
+    QCOW2_CACHE_GHOST_FREE, /* ghost slot without an offset */
+    QCOW2_CACHE_QUEUE_MAX,
+} Qcow2CacheQueue;
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* the metadata journal has a record of the current contents */
+    bool     journaled;
+    Qcow2CacheQueue queue;
+    /* next slot in the same hash bucket, or -1 */
+    int      hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
+    /* c->size table slots followed by c->nb_ghosts ghost slots */
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     nb_ghosts;
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* offset -> slot index, chained through Qcow2CachedTable.hash_next */
+    int                    *hash;
+    unsigned                hash_bits;
+
+    QTAILQ_HEAD(, Qcow2CachedTable) queues[QCOW2_CACHE_QUEUE_MAX];
+    int                     a1in_len;
+    int                     a1in_max;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +96,139 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline int qcow2_cache_slot(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    return t - c->entries;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+/* Returns the table or ghost slot for @offset, or NULL */
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    unsigned bucket = qcow2_cache_hash(c, t->offset);
+
+    t->hash_next = c->hash[bucket];
+    c->hash[bucket] = qcow2_cache_slot(c, t);
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    int *p = &c->hash[qcow2_cache_hash(c, t->offset)];
+    int slot = qcow2_cache_slot(c, t);
+
+    while (*p != slot) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = t->hash_next;
+    t->hash_next = -1;
+}
+
+/* Moves @t to the tail of @queue, i.e. makes it the newest entry there */
+static void qcow2_cache_move(Qcow2Cache *c, Qcow2CachedTable *t,
+                             Qcow2CacheQueue queue)
+{
+    QTAILQ_REMOVE(&c->queues[t->queue], t, next);
+    if (t->queue == QCOW2_CACHE_A1IN) {
+        c->a1in_len--;
+    }
+    t->queue = queue;
+    QTAILQ_INSERT_TAIL(&c->queues[queue], t, next);
+    if (queue == QCOW2_CACHE_A1IN) {
+        c->a1in_len++;
+    }
+}
+
+/* Drops the table in slot @t from the cache, leaving the slot free */
+static void qcow2_cache_forget(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, t);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+    t->journaled = false;
+    qcow2_cache_move(c, t, QCOW2_CACHE_FREE);
+}
+
+/* Remembers that a table at @offset was evicted from A1in */
+static void qcow2_cache_add_ghost(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *g;
+
+    g = QTAILQ_FIRST(&c->queues[QCOW2_CACHE_GHOST_FREE]);
+    if (!g) {
+        /* Recycle the oldest ghost */
+        g = QTAILQ_FIRST(&c->queues[QCOW2_CACHE_A1OUT]);
+        qcow2_cache_hash_remove(c, g);
+    }
+    g->offset = offset;
+    qcow2_cache_hash_insert(c, g);
+    qcow2_cache_move(c, g, QCOW2_CACHE_A1OUT);
+}
+
+static void qcow2_cache_remove_ghost(Qcow2Cache *c, Qcow2CachedTable *g)
+{
+    qcow2_cache_hash_remove(c, g);
+    g->offset = 0;
+    qcow2_cache_move(c, g, QCOW2_CACHE_GHOST_FREE);
+}
+
+/* Returns the oldest unreferenced table in @queue, or NULL */
+static Qcow2CachedTable *qcow2_cache_find_victim(Qcow2Cache *c,
+                                                 Qcow2CacheQueue queue)
+{
+    Qcow2CachedTable *t;
+
+    QTAILQ_FOREACH(t, &c->queues[queue], next) {
+        if (t->ref == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Resets all slots to free, dropping all tables and ghosts */
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_CACHE_QUEUE_MAX; i++) {
+        QTAILQ_INIT(&c->queues[i]);
+    }
+    memset(c->hash, -1, sizeof(int) * ((size_t) 1 << c->hash_bits));
+    c->a1in_len = 0;
+
+    for (i = 0; i < c->size + c->nb_ghosts; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        assert(i >= c->size || t->ref == 0);
+        t->offset = 0;
+        t->lru_counter = 0;
+        t->hash_next = -1;
+        t->queue = i < c->size ? QCOW2_CACHE_FREE : QCOW2_CACHE_GHOST_FREE;
+        QTAILQ_INSERT_TAIL(&c->queues[t->queue], t, next);
+    }
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -106,8 +276,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_forget(c, &c->entries[i]);
             i++;
             to_clean++;
         }
@@ -134,17 +303,26 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
-    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    /* 2Q tuning from the paper: A1in gets 1/4 of the slots, A1out 1/2 */
+    c->a1in_max = MAX(num_tables / 4, 1);
+    c->nb_ghosts = MAX(MIN(num_tables / 2, INT_MAX - num_tables), 1);
+    c->hash_bits = MAX(ctz64(pow2ceil((uint64_t) num_tables +
+                                      c->nb_ghosts)), 1);
+    c->entries = g_try_new0(Qcow2CachedTable,
+                            (size_t) num_tables + c->nb_ghosts);
+    c->hash = g_try_new(int, (size_t) 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(c);
     return c;
 }
 
@@ -157,6 +335,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash);
     g_free(c->entries);
     g_free(c);
 
@@ -220,6 +399,12 @@ qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         return ret;
     }
 
+    ret = qcow2_journal_before_write(bs, c->entries[i].offset,
+                                     c->entries[i].journaled);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (c == s->refcount_block_cache) {
         BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
     } else if (c == s->l2_table_cache) {
@@ -300,19 +485,14 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
-    }
-
+    qcow2_cache_reset(c);
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
@@ -325,11 +505,10 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t, *victim;
+    Qcow2CacheQueue queue = QCOW2_CACHE_A1IN;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,29 +523,41 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    t = qcow2_cache_lookup(c, offset);
+    if (t && qcow2_cache_slot(c, t) < c->size) {
+        i = qcow2_cache_slot(c, t);
+        c->hits++;
+        goto found;
+    }
+
+    c->misses++;
+    if (t) {
+        /* Evicted from A1in not long ago, so it belongs to the hot set */
+        qcow2_cache_remove_ghost(c, t);
+        queue = QCOW2_CACHE_AM;
+    }
 
-    if (min_lru_index == -1) {
+    /*
+     * Cache miss: take a free slot, or evict from A1in while it is over
+     * its share and from Am otherwise
+     */
+    victim = QTAILQ_FIRST(&c->queues[QCOW2_CACHE_FREE]);
+    if (!victim && c->a1in_len > c->a1in_max) {
+        victim = qcow2_cache_find_victim(c, QCOW2_CACHE_A1IN);
+    }
+    if (!victim) {
+        victim = qcow2_cache_find_victim(c, QCOW2_CACHE_AM);
+    }
+    if (!victim) {
+        victim = qcow2_cache_find_victim(c, QCOW2_CACHE_A1IN);
+    }
+    if (!victim) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = qcow2_cache_slot(c, victim);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -375,9 +566,16 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         return ret;
     }
 
+    if (victim->offset) {
+        c->evictions++;
+        if (victim->queue == QCOW2_CACHE_A1IN) {
+            qcow2_cache_add_ghost(c, victim->offset);
+        }
+    }
+    qcow2_cache_forget(c, victim);
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -390,7 +588,9 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    victim->offset = offset;
+    qcow2_cache_hash_insert(c, victim);
+    qcow2_cache_move(c, victim, queue);
 
     /* And return the right table */
 found:
@@ -424,6 +624,10 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        /* A1in stays in load order, Am in order of use */
+        if (c->entries[i].queue == QCOW2_CACHE_AM) {
+            qcow2_cache_move(c, &c->entries[i], QCOW2_CACHE_AM);
+        }
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,16 +638,15 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    c->entries[i].journaled = false;
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = offset ? qcow2_cache_lookup(c, offset) : NULL;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (t && qcow2_cache_slot(c, t) < c->size) {
+        return qcow2_cache_get_table_addr(c, qcow2_cache_slot(c, t));
     }
     return NULL;
 }
@@ -454,9 +657,56 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_forget(c, &c->entries[i]);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+}
+
+/* Appends the dirty tables that changed since they were last journaled */
+int qcow2_cache_journal(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (!t->dirty || t->journaled || !t->offset) {
+            continue;
+        }
+
+        ret = qcow2_journal_append(bs, t->offset,
+                                   qcow2_cache_get_table_addr(c, i),
+                                   c->table_size);
+        if (ret < 0) {
+            return ret;
+        }
+        t->journaled = true;
+    }
+
+    return 0;
+}
+
+void qcow2_cache_journal_forget(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].journaled = false;
+    }
+}
+
+/* Returns the journal space needed to log every table of the cache */
+uint64_t qcow2_cache_journal_size(Qcow2Cache *c)
+{
+    return (uint64_t) c->size *
+           (QCOW2_JOURNAL_RECORD_HEADER_SIZE + c->table_size);
+}
@@ -1081,7 +1081,9 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i,
+                     m->dedup_fingerprint ? offset
+                                          : offset | QCOW_OFLAG_COPIED);
 
         /* Update bitmap with the subclusters that were just written */
         if (has_subclusters(s) && !m->prealloc) {
@@ -1104,6 +1106,11 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
+    if (m->dedup_fingerprint) {
+        assert(m->nb_clusters == 1);
+        qcow2_dedup_insert(bs, m->dedup_fingerprint, cluster_offset);
+    }
+
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
      *
@@ -1619,7 +1626,15 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
+    if (s->cluster_pool_size) {
+        int64_t cluster_offset =
+            qcow2_alloc_clusters_pooled(bs, *host_offset, nb_clusters);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+        *host_offset = cluster_offset;
+        return 0;
+    } else if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
@@ -1893,6 +1908,66 @@ again:
     return 0;
 }
 
+/*
+ * Points the guest cluster at @guest_offset to the existing data cluster at
+ * @host_offset, whose refcount the caller has already increased for this
+ * reference, and frees the cluster that was mapped there before.
+ *
+ * Called with s->lock held.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_l2(BlockDriverState *bs, uint64_t guest_offset,
+                    uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t old_l2_entry, bytes;
+    QCowL2Meta *m = NULL;
+    int l2_index;
+    int ret;
+
+    assert(!has_subclusters(s));
+    assert(!offset_into_cluster(s, guest_offset));
+
+    /* Let allocating writes to the same cluster finish first */
+    do {
+        bytes = s->cluster_size;
+        ret = handle_dependencies(bs, guest_offset, &bytes, &m);
+    } while (ret == -EAGAIN);
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    if ((old_l2_entry & L2E_OFFSET_MASK) == host_offset &&
+        qcow2_get_cluster_type(bs, old_l2_entry) == QCOW2_CLUSTER_NORMAL) {
+        /* Already mapped there, drop the extra reference again */
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                             1, true, QCOW2_DISCARD_NEVER);
+    }
+
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    if (old_l2_entry) {
+        qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_NEVER);
+    }
+
+    return 0;
+}
+
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 slice) and returns the number of discarded
@@ -0,0 +1,468 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Guests read compressed clusters in small pieces, so without a cache every
+ * 4k read of a compressed base image reads and decompresses a whole cluster.
+ * Decompressed clusters are kept here, keyed by the host offset of their
+ * compressed data.  That data never changes while it is referenced, so
+ * entries only need to be dropped when the host cluster that holds it is
+ * freed, see qcow2_compressed_cache_cluster_freed().
+ *
+ * On a miss, the compressed clusters that follow in the guest and are
+ * stored right after the requested one in the image file are read with the
+ * same request and decompressed in parallel, because sequential readers will
+ * want them next.
+ */
+
+#include "qemu/osdep.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "qemu/memalign.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Compressed clusters read ahead on a miss, at most */
+#define QCOW2_COMPRESSED_READAHEAD 8
+
+typedef struct Qcow2CompressedCacheEntry {
+    /* Host offset of the compressed data, 0 if the entry is unused */
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;
+    uint64_t lru_counter;
+} Qcow2CompressedCacheEntry;
+
+/*
+ * Compressed data that is being read and decompressed.  If a host cluster
+ * in its range is freed meanwhile, the result must not be cached.
+ */
+typedef struct Qcow2CompressedFill {
+    uint64_t start;
+    uint64_t end;
+    bool stale;
+    QLIST_ENTRY(Qcow2CompressedFill) next;
+} Qcow2CompressedFill;
+
+struct Qcow2CompressedCache {
+    /* Lookups don't take s->lock, so the cache has its own lock */
+    QemuMutex lock;
+    GHashTable *index;
+    QLIST_HEAD(, Qcow2CompressedFill) fills;
+    int size;
+    uint64_t lru_counter;
+    uint64_t cache_clean_lru_counter;
+    Qcow2CompressedCacheEntry entries[];
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters)
+{
+    Qcow2CompressedCache *c;
+
+    assert(num_clusters > 0);
+
+    c = g_malloc0(sizeof(*c) +
+                  num_clusters * sizeof(Qcow2CompressedCacheEntry));
+    qemu_mutex_init(&c->lock);
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->size = num_clusters;
+
+    return c;
+}
+
+static void qcow2_compressed_cache_forget(Qcow2CompressedCache *c,
+                                          Qcow2CompressedCacheEntry *e)
+{
+    g_hash_table_remove(c->index, &e->coffset);
+    qemu_vfree(e->data);
+    *e = (Qcow2CompressedCacheEntry) { 0 };
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    if (!c) {
+        return;
+    }
+
+    for (int i = 0; i < c->size; i++) {
+        qemu_vfree(c->entries[i].data);
+    }
+    g_hash_table_destroy(c->index);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+/* Drops the entries that have not been used since the last call */
+void qcow2_compressed_cache_clean_unused(Qcow2CompressedCache *c)
+{
+    if (!c) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+    for (int i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->coffset && e->lru_counter <= c->cache_clean_lru_counter) {
+            qcow2_compressed_cache_forget(c, e);
+        }
+    }
+    c->cache_clean_lru_counter = c->lru_counter;
+}
+
+/*
+ * Called whenever a host cluster is freed.  Its bytes may hold new
+ * compressed data at the same offsets afterwards.
+ */
+void qcow2_compressed_cache_cluster_freed(BlockDriverState *bs,
+                                          uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t end = offset + s->cluster_size;
+    Qcow2CompressedFill *fill;
+
+    if (!c) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+    for (int i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->coffset && e->coffset < end && offset < e->coffset + e->csize) {
+            qcow2_compressed_cache_forget(c, e);
+        }
+    }
+    QLIST_FOREACH(fill, &c->fills, next) {
+        if (fill->start < end && offset < fill->end) {
+            fill->stale = true;
+        }
+    }
+}
+
+static Qcow2CompressedCacheEntry *
+qcow2_compressed_cache_find(Qcow2CompressedCache *c, uint64_t coffset,
+                            int csize)
+{
+    Qcow2CompressedCacheEntry *e = g_hash_table_lookup(c->index, &coffset);
+
+    return e && e->csize == csize ? e : NULL;
+}
+
+/*
+ * Copies @bytes at @offset_in_cluster of the compressed cluster described by
+ * @l2_entry into @qiov if it is cached.  Returns whether it was.
+ */
+bool qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t l2_entry,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCacheEntry *e;
+    uint64_t coffset;
+    int csize;
+
+    if (!c) {
+        return false;
+    }
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    QEMU_LOCK_GUARD(&c->lock);
+    e = qcow2_compressed_cache_find(c, coffset, csize);
+    if (!e) {
+        return false;
+    }
+
+    e->lru_counter = ++c->lru_counter;
+    qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_cluster,
+                        bytes);
+    return true;
+}
+
+/* Takes ownership of @data */
+static void qcow2_compressed_cache_insert(Qcow2CompressedCache *c,
+                                          Qcow2CompressedFill *fill,
+                                          uint64_t coffset, int csize,
+                                          uint8_t *data)
+{
+    Qcow2CompressedCacheEntry *e = NULL;
+    uint64_t min_lru_counter = UINT64_MAX;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    /*
+     * The data may be gone already, or another request may have
+     * decompressed the same cluster meanwhile
+     */
+    if (fill->stale || qcow2_compressed_cache_find(c, coffset, csize)) {
+        qemu_vfree(data);
+        return;
+    }
+
+    for (int i = 0; i < c->size; i++) {
+        if (!c->entries[i].coffset) {
+            e = &c->entries[i];
+            break;
+        }
+        if (c->entries[i].lru_counter < min_lru_counter) {
+            min_lru_counter = c->entries[i].lru_counter;
+            e = &c->entries[i];
+        }
+    }
+    if (e->coffset) {
+        qcow2_compressed_cache_forget(c, e);
+    }
+
+    *e = (Qcow2CompressedCacheEntry) {
+        .coffset        = coffset,
+        .csize          = csize,
+        .data           = data,
+        .lru_counter    = ++c->lru_counter,
+    };
+    g_hash_table_insert(c->index, &e->coffset, e);
+}
+
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    void *dest;
+    const void *src;
+    int csize;
+    int *ret;
+} Qcow2DecompressTask;
+
+static int coroutine_fn qcow2_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    *t->ret = qcow2_co_decompress(t->bs, t->dest, s->cluster_size,
+                                  t->src, t->csize) < 0 ? -EIO : 0;
+    return 0;
+}
+
+/*
+ * Registers @fill for the compressed cluster at guest @offset and finds the
+ * compressed clusters after it whose data directly follows in the image
+ * file, and isn't cached yet.  Their L2 entries are stored in @l2_entries,
+ * after the one of the requested cluster.  Returns how many clusters are to
+ * be read in total.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_readahead_plan(BlockDriverState *bs, uint64_t offset,
+                                Qcow2CompressedFill *fill,
+                                uint64_t *l2_entries, int max)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t coffset, l2_entry;
+    unsigned int bytes = s->cluster_size;
+    QCow2SubclusterType type;
+    int csize, n = 1;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entries[0], &coffset, &csize);
+
+    /* Until s->lock is taken, any freed cluster may be ours */
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        *fill = (Qcow2CompressedFill) { .start = 0, .end = UINT64_MAX };
+        QLIST_INSERT_HEAD(&c->fills, fill, next);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    /* The data of the requested cluster may have been freed already */
+    offset = start_of_cluster(s, offset);
+    if (qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type) < 0 ||
+        l2_entry != l2_entries[0]) {
+        WITH_QEMU_LOCK_GUARD(&c->lock) {
+            fill->stale = true;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        return 1;
+    }
+
+    fill->start = coffset;
+    fill->end = coffset + csize;
+
+    while (n <= max) {
+        uint64_t next_coffset;
+        int next_csize;
+        bool cached = false;
+
+        bytes = s->cluster_size;
+        offset += s->cluster_size;
+        if (offset >= disk_size ||
+            qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type) < 0 ||
+            type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &next_coffset,
+                                        &next_csize);
+        if (next_coffset < coffset || next_coffset > fill->end ||
+            next_coffset + next_csize - fill->start >
+            (uint64_t) (max + 1) * s->cluster_size) {
+            break;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&c->lock) {
+            cached = qcow2_compressed_cache_find(c, next_coffset, next_csize);
+        }
+        if (cached) {
+            break;
+        }
+
+        l2_entries[n++] = l2_entry;
+        coffset = next_coffset;
+        fill->end = MAX(fill->end, next_coffset + next_csize);
+    }
+
+    /* Frees happen under s->lock, so from now on the range is watched */
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        fill->stale = false;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+/*
+ * Decompresses the compressed cluster at guest @offset, described by
+ * @l2_entry, into @out_buf.  With a cache, the clusters that follow are
+ * read ahead and everything that was decompressed is added to the cache.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t offset,
+                            uint64_t l2_entry, uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t l2_entries[QCOW2_COMPRESSED_READAHEAD + 1] = { l2_entry };
+    uint64_t coffsets[QCOW2_COMPRESSED_READAHEAD + 1];
+    int csizes[QCOW2_COMPRESSED_READAHEAD + 1];
+    uint8_t *dests[QCOW2_COMPRESSED_READAHEAD + 1] = { out_buf };
+    int rets[QCOW2_COMPRESSED_READAHEAD + 1];
+    Qcow2CompressedFill fill;
+    uint64_t start, end;
+    AioTaskPool *aio = NULL;
+    uint8_t *buf;
+    int i, n = 1, ret;
+
+    if (c) {
+        /* Leave most of the cache to clusters that were actually read */
+        n = qcow2_compressed_readahead_plan(
+            bs, offset, &fill, l2_entries,
+            MIN(QCOW2_COMPRESSED_READAHEAD, c->size / 4));
+    }
+
+    for (i = 0; i < n; i++) {
+        qcow2_parse_compressed_l2_entry(bs, l2_entries[i], &coffsets[i],
+                                        &csizes[i]);
+    }
+    start = coffsets[0];
+    end = coffsets[0] + csizes[0];
+    for (i = 1; i < n; i++) {
+        end = MAX(end, coffsets[i] + csizes[i]);
+    }
+
+    buf = g_try_malloc(end - start);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    trace_qcow2_co_decompress_cluster(bs, offset, start, end - start, n);
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 1; i < n; i++) {
+        dests[i] = qemu_try_blockalign(bs, s->cluster_size);
+        if (!dests[i]) {
+            n = i;
+            break;
+        }
+    }
+
+    if (n > 1) {
+        aio = aio_task_pool_new(QCOW2_MAX_THREADS);
+    }
+    for (i = 0; i < n; i++) {
+        Qcow2DecompressTask local_task;
+        Qcow2DecompressTask *t = aio ? g_new(Qcow2DecompressTask, 1) :
+                                       &local_task;
+
+        *t = (Qcow2DecompressTask) {
+            .task.func  = qcow2_decompress_task_entry,
+            .bs         = bs,
+            .dest       = dests[i],
+            .src        = buf + coffsets[i] - start,
+            .csize      = csizes[i],
+            .ret        = &rets[i],
+        };
+        if (aio) {
+            aio_task_pool_start_task(aio, &t->task);
+        } else {
+            qcow2_decompress_task_entry(&t->task);
+        }
+    }
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        aio_task_pool_free(aio);
+    }
+
+    ret = rets[0];
+    if (c && ret == 0) {
+        uint8_t *data = qemu_try_blockalign(bs, s->cluster_size);
+
+        if (data) {
+            memcpy(data, out_buf, s->cluster_size);
+            qcow2_compressed_cache_insert(c, &fill, coffsets[0], csizes[0],
+                                          data);
+        }
+    }
+    for (i = 1; i < n; i++) {
+        if (rets[i] == 0) {
+            qcow2_compressed_cache_insert(c, &fill, coffsets[i], csizes[i],
+                                          dests[i]);
+        } else {
+            qemu_vfree(dests[i]);
+        }
+    }
+
+out:
+    if (c) {
+        WITH_QEMU_LOCK_GUARD(&c->lock) {
+            QLIST_REMOVE(&fill, next);
+        }
+    }
+    g_free(buf);
+    return ret;
+}
@@ -0,0 +1,564 @@
+/*
+ * Data cluster deduplication for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Clusters that are written completely by the guest are fingerprinted.  If
+ * the dedup index knows a cluster with the same fingerprint, and its data
+ * really is the same, the guest cluster is pointed at it and its refcount
+ * is increased instead of allocating a new cluster.  Otherwise the new
+ * cluster is added to the index once it is linked into the L2 table.
+ *
+ * Indexed clusters are linked without QCOW_OFLAG_COPIED, so they are never
+ * overwritten in place and their data stays what was fingerprinted.  When
+ * they are freed, they are dropped from the index, see
+ * qcow2_dedup_cluster_freed().
+ *
+ * The index is a cuckoo hash table with four slots per bucket, so a lookup
+ * reads at most two cache lines.  It is kept in memory while the image is
+ * open read-write and written to its area in the image when it is closed.
+ * QCOW2_DEDUP_INDEX_VALID is cleared in the header extension while the
+ * in-memory copy is in use, so the index on disk is only trusted after a
+ * clean shutdown.  Otherwise the next open starts with an empty index.
+ *
+ * The index is only a hint: a hit is always verified by reading the
+ * candidate cluster, so stale entries and fingerprint collisions cost an
+ * extra read but never share clusters with different data.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/xxhash.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_DEDUP_BUCKET_SLOTS    4
+
+/* Entries that are displaced before an insertion gives up */
+#define QCOW2_DEDUP_MAX_KICKS       32
+
+typedef struct Qcow2DedupEntry {
+    uint64_t fingerprint;
+    /* Host offset of the data cluster, 0 for a free slot */
+    uint64_t offset;
+} QEMU_PACKED Qcow2DedupEntry;
+
+typedef struct Qcow2DedupBucket {
+    Qcow2DedupEntry slots[QCOW2_DEDUP_BUCKET_SLOTS];
+} QEMU_PACKED Qcow2DedupBucket;
+
+struct Qcow2Dedup {
+    Qcow2DedupBucket *buckets;
+    uint64_t nb_buckets;
+
+    /*
+     * Host clusters that have not been freed since they were indexed.
+     * Entries for other clusters are stale and count as free slots.
+     */
+    unsigned long *indexed;
+    uint64_t indexed_bits;
+};
+
+static uint64_t qcow2_dedup_bucket(Qcow2Dedup *d, uint64_t fingerprint)
+{
+    return fingerprint & (d->nb_buckets - 1);
+}
+
+/* The other bucket of an entry, given one of its buckets */
+static uint64_t qcow2_dedup_alt_bucket(Qcow2Dedup *d, uint64_t bucket,
+                                       uint64_t fingerprint)
+{
+    return (bucket ^ qemu_xxhash2(fingerprint)) & (d->nb_buckets - 1);
+}
+
+static bool qcow2_dedup_entry_live(BDRVQcow2State *s, Qcow2DedupEntry *e)
+{
+    Qcow2Dedup *d = s->dedup;
+    uint64_t index = e->offset >> s->cluster_bits;
+
+    return e->offset && index < d->indexed_bits && test_bit(index, d->indexed);
+}
+
+static void qcow2_dedup_mark_indexed(BDRVQcow2State *s, uint64_t offset)
+{
+    Qcow2Dedup *d = s->dedup;
+    uint64_t index = offset >> s->cluster_bits;
+
+    if (index >= d->indexed_bits) {
+        uint64_t bits = MAX(index + 1, d->indexed_bits * 2);
+
+        d->indexed = bitmap_zero_extend(d->indexed, d->indexed_bits, bits);
+        d->indexed_bits = bits;
+    }
+    set_bit(index, d->indexed);
+}
+
+/* Returns the host offset of an indexed cluster, or 0 if there is none */
+static uint64_t qcow2_dedup_lookup(BDRVQcow2State *s, uint64_t fingerprint)
+{
+    Qcow2Dedup *d = s->dedup;
+    uint64_t bucket[2];
+
+    bucket[0] = qcow2_dedup_bucket(d, fingerprint);
+    bucket[1] = qcow2_dedup_alt_bucket(d, bucket[0], fingerprint);
+
+    for (int i = 0; i < ARRAY_SIZE(bucket); i++) {
+        Qcow2DedupBucket *b = &d->buckets[bucket[i]];
+
+        for (int j = 0; j < QCOW2_DEDUP_BUCKET_SLOTS; j++) {
+            if (b->slots[j].fingerprint == fingerprint &&
+                qcow2_dedup_entry_live(s, &b->slots[j])) {
+                return b->slots[j].offset;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Stores @e in a free slot of @bucket if there is one */
+static bool qcow2_dedup_try_store(BDRVQcow2State *s, uint64_t bucket,
+                                  Qcow2DedupEntry *e)
+{
+    Qcow2DedupBucket *b = &s->dedup->buckets[bucket];
+
+    for (int j = 0; j < QCOW2_DEDUP_BUCKET_SLOTS; j++) {
+        if (!qcow2_dedup_entry_live(s, &b->slots[j])) {
+            b->slots[j] = *e;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Adds the cluster at @host_offset, which has just been linked, to the index.
+ * Called with s->lock held.
+ */
+void qcow2_dedup_insert(BlockDriverState *bs, uint64_t fingerprint,
+                        uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry e = {
+        .fingerprint = fingerprint,
+        .offset = host_offset,
+    };
+    uint64_t bucket;
+
+    if (!d) {
+        return;
+    }
+
+    qcow2_dedup_mark_indexed(s, host_offset);
+
+    bucket = qcow2_dedup_bucket(d, fingerprint);
+    if (qcow2_dedup_try_store(s, bucket, &e) ||
+        qcow2_dedup_try_store(s, qcow2_dedup_alt_bucket(d, bucket, fingerprint),
+                              &e)) {
+        return;
+    }
+
+    /* Both buckets are full; move entries to their other bucket */
+    for (int kicks = 0; kicks < QCOW2_DEDUP_MAX_KICKS; kicks++) {
+        Qcow2DedupEntry *victim =
+            &d->buckets[bucket].slots[g_random_int_range(0,
+                                                QCOW2_DEDUP_BUCKET_SLOTS)];
+        Qcow2DedupEntry tmp = *victim;
+
+        *victim = e;
+        e = tmp;
+
+        bucket = qcow2_dedup_alt_bucket(d, bucket, e.fingerprint);
+        if (qcow2_dedup_try_store(s, bucket, &e)) {
+            return;
+        }
+    }
+
+    /* The index is full; forget the last displaced cluster */
+    trace_qcow2_dedup_evict(bs, e.offset);
+}
+
+void qcow2_dedup_cluster_freed(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t index = offset >> s->cluster_bits;
+
+    if (d && index < d->indexed_bits) {
+        clear_bit(index, d->indexed);
+    }
+}
+
+bool qcow2_dedup_is_indexed(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t index = offset >> s->cluster_bits;
+
+    return d && index < d->indexed_bits && test_bit(index, d->indexed);
+}
+
+/*
+ * Handles a guest write of the whole cluster at @offset.  Returns 1 if the
+ * cluster was pointed at an existing cluster with the same data, and 0 if it
+ * must be written normally.  In that case, *fingerprint is set to a value
+ * for QCowL2Meta.dedup_fingerprint, or 0 if the cluster shouldn't be
+ * indexed.
+ *
+ * Called with s->lock unlocked.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_co_write(BlockDriverState *bs, uint64_t offset,
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     uint64_t *fingerprint)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_index, host_offset;
+    uint8_t *buf, *cmp_buf = NULL;
+    bool same = false;
+    int ret;
+
+    *fingerprint = 0;
+
+    buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (!buf) {
+        return 0;
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+
+    /* Zeroed clusters are left to detect-zeroes and discard */
+    if (buffer_is_zero(buf, s->cluster_size)) {
+        ret = 0;
+        goto out;
+    }
+
+    *fingerprint = qcow2_co_fingerprint(bs, buf, s->cluster_size);
+    if (!*fingerprint) {
+        ret = 0;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    host_offset = s->dedup ? qcow2_dedup_lookup(s, *fingerprint) : 0;
+    if (!host_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = 0;
+        goto out;
+    }
+
+    /* Keep the candidate from being freed while its data is compared */
+    cluster_index = host_offset >> s->cluster_bits;
+    ret = qcow2_update_cluster_refcount(bs, cluster_index, 1, false,
+                                        QCOW2_DISCARD_NEVER);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        /* -ERANGE means the cluster has as many references as it can get */
+        ret = ret == -ERANGE ? 0 : ret;
+        goto out;
+    }
+
+    cmp_buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (cmp_buf) {
+        ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size,
+                            cmp_buf, 0);
+        same = ret >= 0 && !memcmp(buf, cmp_buf, s->cluster_size);
+    }
+
+    /* If the candidate can't be read, just write the data normally */
+    ret = 0;
+    qemu_co_mutex_lock(&s->lock);
+    if (same) {
+        ret = qcow2_dedup_link_l2(bs, offset, host_offset);
+    }
+    if (!same || ret < 0) {
+        qcow2_update_cluster_refcount(bs, cluster_index, 1, true,
+                                      QCOW2_DISCARD_NEVER);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_qcow2_dedup_lookup(bs, offset, host_offset, same);
+    if (ret >= 0) {
+        ret = same;
+    }
+
+out:
+    qemu_vfree(cmp_buf);
+    qemu_vfree(buf);
+    return ret;
+}
+
+void qcow2_dedup_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+
+    if (!d) {
+        return;
+    }
+
+    qemu_vfree(d->buckets);
+    g_free(d->indexed);
+    g_free(d);
+    s->dedup = NULL;
+}
+
+static int GRAPH_RDLOCK qcow2_dedup_write_ext(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(bs->file->bs);
+}
+
+/*
+ * Frees the index area.  Clusters that were deduplicated keep their
+ * references, but the ones that are left with a single reference get
+ * QCOW_OFLAG_COPIED back.
+ */
+static int GRAPH_RDLOCK qcow2_dedup_drop(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->dedup_offset;
+    uint64_t size = s->dedup_area_size;
+    int ret;
+
+    assert(!s->dedup);
+
+    if (!offset) {
+        return 0;
+    }
+
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dedup_offset = 0;
+    s->dedup_area_size = 0;
+    s->dedup_flags = 0;
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DEDUP;
+
+    ret = qcow2_dedup_write_ext(bs);
+    if (ret < 0) {
+        /* The area is still referenced and holds no valid index */
+        s->dedup_offset = offset;
+        s->dedup_area_size = size;
+        s->incompatible_features |= QCOW2_INCOMPAT_DEDUP;
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    trace_qcow2_dedup_drop(bs, offset, size);
+
+    return 0;
+}
+
+static int GRAPH_RDLOCK qcow2_dedup_load(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t nb_entries = d->nb_buckets * QCOW2_DEDUP_BUCKET_SLOTS;
+    Qcow2DedupEntry *entries = &d->buckets[0].slots[0];
+    int ret;
+
+    ret = bdrv_pread(bs->file, s->dedup_offset, s->dedup_area_size,
+                     d->buckets, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (uint64_t i = 0; i < nb_entries; i++) {
+        Qcow2DedupEntry *e = &entries[i];
+
+        e->fingerprint = be64_to_cpu(e->fingerprint);
+        e->offset = be64_to_cpu(e->offset);
+        if (offset_into_cluster(s, e->offset) ||
+            (e->offset & ~L2E_OFFSET_MASK)) {
+            e->offset = 0;
+        }
+        if (e->offset) {
+            qcow2_dedup_mark_indexed(s, e->offset);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sets up the index for a read-write open, according to dedup-index-size.
+ */
+int qcow2_dedup_open(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size;
+    int64_t offset;
+    int ret;
+
+    assert(!s->dedup);
+
+    size = s->dedup_index_size < 0 ? s->dedup_area_size : s->dedup_index_size;
+    if (!size || s->dedup_area_size != size) {
+        ret = qcow2_dedup_drop(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not drop the dedup index");
+            return ret;
+        }
+    }
+    if (!size) {
+        return 0;
+    }
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Deduplication requires a qcow2 image with at least "
+                   "qemu 1.1 compatibility level");
+        return -ENOTSUP;
+    }
+    if (bs->encrypted || has_data_file(bs) || has_subclusters(s)) {
+        error_setg(errp, "Deduplication is not supported with encryption, "
+                   "external data files or extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (!s->dedup_offset) {
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Could not allocate the dedup "
+                             "index");
+            return offset;
+        }
+
+        /* The header must not point to clusters that aren't allocated yet */
+        ret = qcow2_flush_caches(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not allocate the dedup index");
+            qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+            return ret;
+        }
+
+        s->dedup_offset = offset;
+        s->dedup_area_size = size;
+        s->dedup_flags = 0;
+    }
+
+    s->dedup = g_new0(Qcow2Dedup, 1);
+    s->dedup->nb_buckets = size / sizeof(Qcow2DedupBucket);
+    s->dedup->buckets = qemu_try_blockalign0(bs->file->bs, size);
+    if (!s->dedup->buckets) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    if (s->dedup_flags & QCOW2_DEDUP_INDEX_VALID) {
+        ret = qcow2_dedup_load(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The index on disk goes stale with the first write */
+    s->dedup_flags &= ~QCOW2_DEDUP_INDEX_VALID;
+    s->incompatible_features |= QCOW2_INCOMPAT_DEDUP;
+    ret = qcow2_dedup_write_ext(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    trace_qcow2_dedup_open(bs, s->dedup_offset, size);
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not set up the dedup index");
+    qcow2_dedup_close(bs);
+
+    /* Clusters can be freed from now on without updating the index */
+    if (s->dedup_flags & QCOW2_DEDUP_INDEX_VALID) {
+        s->dedup_flags &= ~QCOW2_DEDUP_INDEX_VALID;
+        qcow2_dedup_write_ext(bs);
+    }
+    return ret;
+}
+
+/*
+ * Writes the index to the image and stops deduplicating, for closing the
+ * image or making it read-only.
+ */
+int qcow2_dedup_store(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    uint64_t nb_entries;
+    Qcow2DedupEntry *entries;
+    int ret;
+
+    if (!d) {
+        return 0;
+    }
+
+    nb_entries = d->nb_buckets * QCOW2_DEDUP_BUCKET_SLOTS;
+    entries = &d->buckets[0].slots[0];
+    for (uint64_t i = 0; i < nb_entries; i++) {
+        Qcow2DedupEntry *e = &entries[i];
+
+        if (!qcow2_dedup_entry_live(s, e)) {
+            *e = (Qcow2DedupEntry) { 0 };
+        }
+        e->fingerprint = cpu_to_be64(e->fingerprint);
+        e->offset = cpu_to_be64(e->offset);
+    }
+
+    ret = bdrv_pwrite(bs->file, s->dedup_offset, s->dedup_area_size,
+                      d->buckets, 0);
+    qcow2_dedup_close(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * The index and the refcounts that keep its clusters alive must be on
+     * disk before the header says that it is valid
+     */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dedup_flags |= QCOW2_DEDUP_INDEX_VALID;
+    ret = qcow2_dedup_write_ext(bs);
+    if (ret < 0) {
+        s->dedup_flags &= ~QCOW2_DEDUP_INDEX_VALID;
+        return ret;
+    }
+
+    trace_qcow2_dedup_store(bs, s->dedup_offset, s->dedup_area_size);
+    return 0;
+}
@@ -0,0 +1,792 @@
+/*
+ * Metadata journal for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With a journal, flushing the metadata caches does not write every dirty
+ * L2 table and refcount block to its place in the image.  The tables are
+ * appended to a log area instead, as one sequential write that ends with
+ * a commit record.  A checkpoint writes them in place later, either in the
+ * background or when the log runs full, and then empties the log by
+ * starting a new generation.  After a crash, replaying the committed
+ * records restores the metadata of the last flush.
+ *
+ * The journal only exists while the image is open read-write, and
+ * QCOW2_INCOMPAT_JOURNAL is set during that time so that nothing else
+ * uses the image before the log has been replayed.
+ *
+ * Replaying must never roll anything back, which gives three rules:
+ *
+ * - A table that has a record in the current generation may only be
+ *   written in place after its current contents have been logged and the
+ *   log has been flushed, see qcow2_journal_before_write().
+ *
+ * - A cluster that has records must not be reused before the next
+ *   checkpoint, see qcow2_journal_prepare_alloc().
+ *
+ * - Code that writes L2 tables or refcount blocks without going through
+ *   the metadata caches checkpoints the journal first.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/memalign.h"
+#include "qemu/range.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC         0x716a6e6c /* "qjnl" */
+#define QCOW2_JOURNAL_RECORD_MAGIC  0x716a7263 /* "qjrc" */
+
+/* Records are collected in a buffer of this size before they are written */
+#define QCOW2_JOURNAL_BUF_SIZE      (1 * MiB)
+
+enum {
+    QCOW2_JOURNAL_RECORD_TABLE  = 1,
+    QCOW2_JOURNAL_RECORD_COMMIT = 2,
+};
+
+/* First sector of the journal area */
+typedef struct Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t generation;
+} QEMU_PACKED Qcow2JournalHeader;
+
+/* Start of the header sector of each record */
+typedef struct Qcow2JournalRecord {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t generation;
+    uint64_t sequence;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t checksum;
+} QEMU_PACKED Qcow2JournalRecord;
+
+struct Qcow2Journal {
+    uint64_t generation;
+    /* Sequence number of the next record; never goes back in a generation */
+    uint64_t sequence;
+    /* End of the last record, relative to the start of the journal area */
+    uint64_t used;
+    /* Log space that committing both metadata caches completely takes */
+    uint64_t reserve;
+
+    /* Records that are not written yet, starting at @buf_start */
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_len;
+    uint64_t buf_start;
+
+    /* Clusters that have records in the current generation */
+    GHashTable *logged;
+    /* One of the clusters in @logged was freed */
+    bool reuse_barrier;
+    /* Records were written, but the image file has not been flushed since */
+    bool unflushed;
+    bool checkpointing;
+    bool checkpoint_scheduled;
+};
+
+static uint32_t qcow2_journal_checksum(uint8_t *buf, size_t len,
+                                       uint32_t *field)
+{
+    uint32_t saved = *field;
+    uint32_t crc;
+
+    *field = 0;
+    crc = crc32c(0xffffffff, buf, len);
+    *field = saved;
+
+    return crc;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+
+    if (!j) {
+        return;
+    }
+
+    g_hash_table_destroy(j->logged);
+    qemu_vfree(j->buf);
+    g_free(j);
+    s->journal = NULL;
+}
+
+/* Writes out the records collected in the buffer */
+static int GRAPH_RDLOCK qcow2_journal_write_buf(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    int ret;
+
+    if (j->buf_len == 0) {
+        return 0;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->journal_offset + j->buf_start, j->buf_len,
+                      j->buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    j->buf_start += j->buf_len;
+    j->buf_len = 0;
+    j->unflushed = true;
+
+    return 0;
+}
+
+static int GRAPH_RDLOCK
+qcow2_journal_add_record(BlockDriverState *bs, uint32_t type, uint64_t offset,
+                         const void *data, uint32_t length)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    size_t size = QCOW2_JOURNAL_RECORD_HEADER_SIZE + length;
+    Qcow2JournalRecord *rec;
+    uint8_t *p;
+    int ret;
+
+    /* The reserve should have made sure that this can't happen */
+    if (j->used + size > s->journal_area_size) {
+        return -ENOSPC;
+    }
+
+    if (j->buf_len + size > j->buf_size) {
+        ret = qcow2_journal_write_buf(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    p = j->buf + j->buf_len;
+    memset(p, 0, QCOW2_JOURNAL_RECORD_HEADER_SIZE);
+    if (length) {
+        memcpy(p + QCOW2_JOURNAL_RECORD_HEADER_SIZE, data, length);
+    }
+
+    rec = (Qcow2JournalRecord *) p;
+    rec->magic      = cpu_to_be32(QCOW2_JOURNAL_RECORD_MAGIC);
+    rec->type       = cpu_to_be32(type);
+    rec->generation = cpu_to_be64(j->generation);
+    rec->sequence   = cpu_to_be64(j->sequence);
+    rec->offset     = cpu_to_be64(offset);
+    rec->length     = cpu_to_be32(length);
+    rec->checksum   = cpu_to_be32(qcow2_journal_checksum(p, size,
+                                                         &rec->checksum));
+
+    j->buf_len += size;
+    j->used += size;
+    j->sequence++;
+
+    return 0;
+}
+
+int qcow2_journal_append(BlockDriverState *bs, uint64_t offset,
+                         const void *table, int size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    uint64_t cluster = start_of_cluster(s, offset);
+    int ret;
+
+    ret = qcow2_journal_add_record(bs, QCOW2_JOURNAL_RECORD_TABLE, offset,
+                                   table, size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!g_hash_table_contains(j->logged, &cluster)) {
+        g_hash_table_add(j->logged, g_memdup2(&cluster, sizeof(cluster)));
+    }
+
+    return 0;
+}
+
+/*
+ * Starts a new, empty generation of the log.  Records of the old one are
+ * ignored from now on.
+ */
+static int GRAPH_RDLOCK
+qcow2_journal_reset(BlockDriverState *bs, uint64_t generation)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    Qcow2JournalHeader *header = (Qcow2JournalHeader *) j->buf;
+    int ret;
+
+    assert(j->buf_len == 0);
+
+    memset(j->buf, 0, BDRV_SECTOR_SIZE);
+    header->magic      = cpu_to_be32(QCOW2_JOURNAL_MAGIC);
+    header->generation = cpu_to_be64(generation);
+    header->checksum   = cpu_to_be32(qcow2_journal_checksum(j->buf,
+                                         BDRV_SECTOR_SIZE, &header->checksum));
+
+    ret = bdrv_pwrite_sync(bs->file, s->journal_offset, BDRV_SECTOR_SIZE,
+                           j->buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    j->generation = generation;
+    j->sequence = 0;
+    j->used = j->buf_start = BDRV_SECTOR_SIZE;
+    j->reuse_barrier = false;
+    j->unflushed = false;
+    g_hash_table_remove_all(j->logged);
+    qcow2_cache_journal_forget(s->l2_table_cache);
+    qcow2_cache_journal_forget(s->refcount_block_cache);
+
+    return 0;
+}
+
+/* Logs all dirty tables that don't have a record of their contents yet */
+static int GRAPH_RDLOCK qcow2_journal_do_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    uint64_t start = j->used;
+    uint64_t start_sequence = j->sequence;
+    int ret;
+
+    /* Table order doesn't matter, replay applies a commit completely or not */
+    ret = qcow2_cache_journal(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = qcow2_cache_journal(bs, s->l2_table_cache);
+    }
+    if (ret == 0 && j->sequence != start_sequence) {
+        ret = qcow2_journal_add_record(bs, QCOW2_JOURNAL_RECORD_COMMIT, 0,
+                                       NULL, 0);
+    }
+    if (ret == 0) {
+        ret = qcow2_journal_write_buf(bs);
+    }
+
+    if (ret < 0) {
+        /*
+         * Overwrite the incomplete commit next time.  Sequence numbers are
+         * not reused, so replay can't mistake what is left of it for part
+         * of a later commit.
+         */
+        j->used = j->buf_start = start;
+        j->buf_len = 0;
+        qcow2_cache_journal_forget(s->l2_table_cache);
+        qcow2_cache_journal_forget(s->refcount_block_cache);
+        return ret;
+    }
+
+    trace_qcow2_journal_commit(bs, j->sequence - start_sequence, j->used);
+    return 0;
+}
+
+static int GRAPH_RDLOCK qcow2_journal_flush(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    int ret;
+
+    if (!j->unflushed) {
+        return 0;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    j->unflushed = false;
+    return 0;
+}
+
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    int ret;
+
+    if (!j || j->used == BDRV_SECTOR_SIZE) {
+        return 0;
+    }
+
+    assert(!j->checkpointing);
+    j->checkpointing = true;
+
+    trace_qcow2_journal_checkpoint(bs, j->generation, j->used);
+
+    /* Everything must be in the log before it is written in place */
+    ret = qcow2_journal_do_commit(bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_journal_flush(bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_cache_write(bs, s->l2_table_cache);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_cache_write(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_journal_reset(bs, j->generation + 1);
+
+out:
+    j->checkpointing = false;
+    return ret;
+}
+
+static void coroutine_fn qcow2_journal_checkpoint_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->journal) {
+        s->journal->checkpoint_scheduled = false;
+        /* Errors come back with the next flush */
+        qcow2_journal_checkpoint(bs);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    int ret;
+
+    /*
+     * Always leave enough space for the commit at the start of a
+     * checkpoint.  If this commit could eat into it, checkpoint now.
+     */
+    if (!j->checkpointing &&
+        j->used + 2 * j->reserve > s->journal_area_size) {
+        return qcow2_journal_checkpoint(bs);
+    }
+
+    ret = qcow2_journal_do_commit(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * Checkpoint in the background once the log is half full.  Drained
+     * sections and closing the image checkpoint synchronously anyway.
+     */
+    if (!j->checkpointing && !j->checkpoint_scheduled &&
+        !bs->quiesce_counter && j->used > s->journal_area_size / 2) {
+        j->checkpoint_scheduled = true;
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs),
+                        qemu_coroutine_create(qcow2_journal_checkpoint_entry,
+                                              bs));
+    }
+
+    return 0;
+}
+
+int qcow2_journal_before_write(BlockDriverState *bs, uint64_t offset,
+                               bool journaled)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    uint64_t cluster = start_of_cluster(s, offset);
+    int ret;
+
+    if (!j || !g_hash_table_contains(j->logged, &cluster)) {
+        return 0;
+    }
+
+    if (!journaled) {
+        ret = qcow2_journal_commit(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return qcow2_journal_flush(bs);
+}
+
+void qcow2_journal_cluster_freed(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+
+    if (j && g_hash_table_contains(j->logged, &offset)) {
+        j->reuse_barrier = true;
+    }
+}
+
+int qcow2_journal_prepare_alloc(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+
+    if (!j || !j->reuse_barrier || j->checkpointing) {
+        return 0;
+    }
+
+    return qcow2_journal_checkpoint(bs);
+}
+
+int qcow2_journal_enable(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j;
+    uint64_t reserve, size;
+    int64_t offset;
+    int ret;
+
+    assert(!s->journal && !s->journal_offset && s->journal_size);
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "The metadata journal requires a qcow2 image with at "
+                   "least qemu 1.1 compatibility level");
+        return -ENOTSUP;
+    }
+
+    reserve = qcow2_cache_journal_size(s->l2_table_cache) +
+              qcow2_cache_journal_size(s->refcount_block_cache) +
+              QCOW2_JOURNAL_RECORD_HEADER_SIZE;
+    size = MAX(s->journal_size, BDRV_SECTOR_SIZE + 2 * reserve);
+    size = ROUND_UP(size, s->cluster_size);
+    if (size > QCOW2_MAX_JOURNAL_SIZE) {
+        error_setg(errp, "The metadata caches are too large for a journal, "
+                   "it would need %" PRIu64 " bytes", size);
+        return -EINVAL;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate the journal");
+        return offset;
+    }
+
+    /* The header must not point to clusters that aren't allocated yet */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not allocate the journal");
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+        return ret;
+    }
+
+    j = g_new0(Qcow2Journal, 1);
+    j->reserve = reserve;
+    j->buf_size = MAX(QCOW2_JOURNAL_BUF_SIZE,
+                      QCOW2_JOURNAL_RECORD_HEADER_SIZE + s->cluster_size);
+    j->buf = qemu_try_blockalign(bs->file->bs, j->buf_size);
+    j->logged = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                      g_free, NULL);
+
+    s->journal = j;
+    s->journal_offset = offset;
+    s->journal_area_size = size;
+
+    if (!j->buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    /* A random generation keeps out records from earlier uses of the area */
+    ret = qcow2_journal_reset(bs, ((uint64_t) g_random_int() << 32) |
+                                  g_random_int());
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        /*
+         * The header on disk may point to the journal now.  Leak the area
+         * instead of freeing it; the next open drops it.
+         */
+        error_setg_errno(errp, -ret, "Could not enable the journal");
+        qcow2_journal_close(bs);
+        return ret;
+    }
+
+    trace_qcow2_journal_enable(bs, offset, size);
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not enable the journal");
+    qcow2_journal_close(bs);
+    s->journal_offset = 0;
+    s->journal_area_size = 0;
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    return ret;
+}
+
+int qcow2_journal_disable(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->journal_offset;
+    uint64_t size = s->journal_area_size;
+    int ret;
+
+    if (s->journal) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        qcow2_journal_close(bs);
+    }
+
+    if (!offset) {
+        return 0;
+    }
+
+    /* Stop pointing to the area before it can be reused */
+    s->journal_offset = 0;
+    s->journal_area_size = 0;
+    s->incompatible_features &= ~QCOW2_INCOMPAT_JOURNAL;
+
+    ret = qcow2_update_header(bs);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        /* The log is empty, replaying it next time is harmless */
+        s->journal_offset = offset;
+        s->journal_area_size = size;
+        s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    trace_qcow2_journal_disable(bs, offset, size);
+
+    return 0;
+}
+
+/*
+ * Reads the record at @pos into @buf.  Returns the size of the record, 0 if
+ * there is no valid record at @pos, or -errno on I/O errors.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_journal_read_record(BlockDriverState *bs, uint8_t *buf, uint64_t pos,
+                          uint64_t generation, uint64_t min_sequence)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalRecord *rec = (Qcow2JournalRecord *) buf;
+    uint32_t type, length;
+    int ret;
+
+    if (pos + QCOW2_JOURNAL_RECORD_HEADER_SIZE > s->journal_area_size) {
+        return 0;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->journal_offset + pos,
+                        QCOW2_JOURNAL_RECORD_HEADER_SIZE, buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    type = be32_to_cpu(rec->type);
+    length = be32_to_cpu(rec->length);
+
+    if (be32_to_cpu(rec->magic) != QCOW2_JOURNAL_RECORD_MAGIC ||
+        be64_to_cpu(rec->generation) != generation ||
+        be64_to_cpu(rec->sequence) < min_sequence) {
+        return 0;
+    }
+
+    if (type == QCOW2_JOURNAL_RECORD_TABLE) {
+        if (length == 0 || length > s->cluster_size ||
+            !QEMU_IS_ALIGNED(length, BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+    } else if (type != QCOW2_JOURNAL_RECORD_COMMIT || length != 0) {
+        return 0;
+    }
+
+    if (pos + QCOW2_JOURNAL_RECORD_HEADER_SIZE + length >
+        s->journal_area_size) {
+        return 0;
+    }
+
+    if (length) {
+        ret = bdrv_co_pread(bs->file,
+                            s->journal_offset + pos +
+                            QCOW2_JOURNAL_RECORD_HEADER_SIZE,
+                            length, buf + QCOW2_JOURNAL_RECORD_HEADER_SIZE, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (qcow2_journal_checksum(buf, QCOW2_JOURNAL_RECORD_HEADER_SIZE + length,
+                               &rec->checksum) != be32_to_cpu(rec->checksum)) {
+        return 0;
+    }
+
+    return QCOW2_JOURNAL_RECORD_HEADER_SIZE + length;
+}
+
+int coroutine_fn qcow2_journal_replay(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader *header;
+    Qcow2JournalRecord *rec;
+    uint64_t generation, pos, end, min_sequence;
+    uint64_t nb_tables = 0;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->journal_offset) {
+        error_setg(errp, "qcow2: Image needs journal replay, but has no "
+                   "journal");
+        return -EINVAL;
+    }
+
+    if (!bdrv_is_writable(bs)) {
+        error_setg(errp, "qcow2: Image contains a metadata journal that needs "
+                   "to be replayed; open it read/write to replay it");
+        return -EPERM;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs,
+                              QCOW2_JOURNAL_RECORD_HEADER_SIZE +
+                              s->cluster_size);
+    if (!buf) {
+        error_setg(errp, "Could not allocate journal buffer");
+        return -ENOMEM;
+    }
+    header = (Qcow2JournalHeader *) buf;
+    rec = (Qcow2JournalRecord *) buf;
+
+    ret = bdrv_co_pread(bs->file, s->journal_offset, BDRV_SECTOR_SIZE, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read journal header");
+        goto out;
+    }
+
+    if (be32_to_cpu(header->magic) != QCOW2_JOURNAL_MAGIC ||
+        qcow2_journal_checksum(buf, BDRV_SECTOR_SIZE, &header->checksum) !=
+        be32_to_cpu(header->checksum)) {
+        error_setg(errp, "qcow2: Journal header is corrupt");
+        ret = -EINVAL;
+        goto out;
+    }
+    generation = be64_to_cpu(header->generation);
+
+    /* Find the end of the last complete commit */
+    pos = end = BDRV_SECTOR_SIZE;
+    min_sequence = 0;
+    for (;;) {
+        ret = qcow2_journal_read_record(bs, buf, pos, generation,
+                                        min_sequence);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read journal");
+            goto out;
+        } else if (ret == 0) {
+            break;
+        }
+
+        pos += ret;
+        min_sequence = be64_to_cpu(rec->sequence) + 1;
+        if (be32_to_cpu(rec->type) == QCOW2_JOURNAL_RECORD_COMMIT) {
+            end = pos;
+        }
+    }
+
+    /* Write the tables of all complete commits in place */
+    pos = BDRV_SECTOR_SIZE;
+    min_sequence = 0;
+    while (pos < end) {
+        uint64_t offset;
+        uint32_t length;
+
+        ret = qcow2_journal_read_record(bs, buf, pos, generation,
+                                        min_sequence);
+        if (ret <= 0) {
+            ret = ret < 0 ? ret : -EIO;
+            error_setg_errno(errp, -ret, "Could not read journal");
+            goto out;
+        }
+
+        pos += ret;
+        min_sequence = be64_to_cpu(rec->sequence) + 1;
+        if (be32_to_cpu(rec->type) != QCOW2_JOURNAL_RECORD_TABLE) {
+            continue;
+        }
+
+        offset = be64_to_cpu(rec->offset);
+        length = be32_to_cpu(rec->length);
+        if (!QEMU_IS_ALIGNED(offset, BDRV_SECTOR_SIZE) ||
+            offset < s->cluster_size ||
+            ranges_overlap(offset, length, s->journal_offset,
+                           s->journal_area_size)) {
+            error_setg(errp, "qcow2: Journal record for invalid offset "
+                       "%#" PRIx64, offset);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        ret = bdrv_co_pwrite(bs->file, offset, length,
+                             buf + QCOW2_JOURNAL_RECORD_HEADER_SIZE, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not replay journal");
+            goto out;
+        }
+        nb_tables++;
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not replay journal");
+        goto out;
+    }
+
+    trace_qcow2_journal_replay(bs, generation, nb_tables);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
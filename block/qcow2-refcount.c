@@ -901,6 +901,10 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_journal_cluster_freed(bs, cluster_offset);
+            qcow2_dedup_cluster_freed(bs, cluster_offset);
+            qcow2_compressed_cache_cluster_freed(bs, cluster_offset);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -977,6 +981,12 @@ alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
         qcow2_process_discards(bs, 0);
     }
 
+    /* Nor if journal replay could still overwrite them */
+    ret = qcow2_journal_prepare_alloc(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
@@ -1041,6 +1051,11 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
         return 0;
     }
 
+    ret = qcow2_journal_prepare_alloc(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
@@ -1065,6 +1080,117 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
     return i;
 }
 
+static Qcow2ClusterPool *qcow2_get_cluster_pool(BDRVQcow2State *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    Qcow2ClusterPool *pool;
+
+    QLIST_FOREACH(pool, &s->cluster_pools, next) {
+        if (pool->ctx == ctx) {
+            return pool;
+        }
+    }
+
+    pool = g_new0(Qcow2ClusterPool, 1);
+    pool->ctx = ctx;
+    QLIST_INSERT_HEAD(&s->cluster_pools, pool, next);
+    return pool;
+}
+
+/*
+ * Allocates up to *nb_clusters data clusters from the pool of the current
+ * AioContext, refilling it if needed.  If @offset is not INV_OFFSET, the
+ * clusters must start there.
+ *
+ * On success returns the offset of the first cluster and updates
+ * *nb_clusters to the number of contiguous clusters allocated, which can
+ * be 0 if @offset was given and could not be used.  Returns -errno on
+ * failure.
+ *
+ * The caller must hold s->lock.  The pools only batch the refcount updates
+ * done under it; allocating writes from different AioContexts still take
+ * s->lock for the L2 update and are serialized.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_clusters_pooled(BlockDriverState *bs, uint64_t offset,
+                            uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ClusterPool *pool = qcow2_get_cluster_pool(s);
+    int64_t ret;
+    uint64_t n;
+
+    assert(s->cluster_pool_size);
+
+    /* Extending an allocation that did not come from this pool */
+    if (offset != INV_OFFSET && offset != pool->offset) {
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (!pool->nb_clusters) {
+        ret = 0;
+        /* Try to keep going right after the previous batch */
+        if (pool->offset) {
+            ret = qcow2_alloc_clusters_at(bs, pool->offset,
+                                          s->cluster_pool_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (ret == 0) {
+            if (offset != INV_OFFSET) {
+                *nb_clusters = 0;
+                return offset;
+            }
+            ret = qcow2_alloc_clusters(bs, s->cluster_pool_size <<
+                                           s->cluster_bits);
+            if (ret < 0) {
+                return ret;
+            }
+            pool->offset = ret;
+            ret = s->cluster_pool_size;
+        }
+        pool->nb_clusters = ret;
+        trace_qcow2_cluster_pool_refill(qemu_coroutine_self(), pool->ctx,
+                                        pool->offset, pool->nb_clusters);
+    }
+
+    n = MIN(*nb_clusters, pool->nb_clusters);
+    offset = pool->offset;
+    pool->offset += n << s->cluster_bits;
+    pool->nb_clusters -= n;
+    *nb_clusters = n;
+
+    return offset;
+}
+
+/*
+ * Gives the clusters that are still reserved in cluster pools back, e.g.
+ * before the image is closed or its refcounts are looked at as a whole.
+ */
+void GRAPH_RDLOCK qcow2_release_cluster_pools(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ClusterPool *pool, *next_pool;
+
+    QLIST_FOREACH_SAFE(pool, &s->cluster_pools, next, next_pool) {
+        if (pool->nb_clusters) {
+            trace_qcow2_cluster_pool_release(pool->ctx, pool->offset,
+                                             pool->nb_clusters);
+            qcow2_free_clusters(bs, pool->offset,
+                                pool->nb_clusters << s->cluster_bits,
+                                QCOW2_DISCARD_NEVER);
+        }
+        QLIST_REMOVE(pool, next);
+        g_free(pool);
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1379,7 +1505,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         abort();
                     }
 
-                    if (refcount == 1) {
+                    /* Indexed clusters may get more references any time */
+                    if (refcount == 1 &&
+                        !qcow2_dedup_is_indexed(bs, offset)) {
                         entry |= QCOW_OFLAG_COPIED;
                     }
                     if (entry != old_entry) {
@@ -2032,7 +2160,14 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                         continue;
                     }
                 }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                bool copied = l2_entry & QCOW_OFLAG_COPIED;
+
+                /*
+                 * Clusters in the dedup index don't have the flag even
+                 * with a single reference, see qcow2-dedup.c
+                 */
+                if ((refcount == 1) != copied &&
+                    !(refcount == 1 && s->dedup_offset)) {
                     res->corruptions++;
                     fprintf(stderr, "%s OFLAG_COPIED data cluster: "
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
@@ -2287,6 +2422,25 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* metadata journal */
+    if (s->journal_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->journal_offset,
+                                       s->journal_area_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* dedup index */
+    if (s->dedup_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->dedup_offset, s->dedup_area_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -37,6 +37,8 @@
 #include "block/block-io.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "crypto/hash.h"
+#include "qemu/bswap.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
@@ -525,3 +527,50 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+
+/*
+ * Deduplication
+ */
+
+typedef struct Qcow2FingerprintData {
+    const uint8_t *buf;
+    size_t len;
+    uint64_t fingerprint;
+} Qcow2FingerprintData;
+
+static int qcow2_fingerprint_pool_func(void *opaque)
+{
+    Qcow2FingerprintData *data = opaque;
+    g_autofree uint8_t *hash = NULL;
+    size_t hash_len;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *) data->buf,
+                           data->len, &hash, &hash_len, NULL) < 0) {
+        return -EIO;
+    }
+    assert(hash_len >= sizeof(uint64_t));
+    data->fingerprint = ldq_be_p(hash);
+    return 0;
+}
+
+/*
+ * qcow2_co_fingerprint()
+ *
+ * Returns the first 8 bytes of the SHA-256 hash of @len bytes at @buf,
+ * or 0 on error.  Hashing a whole cluster costs about as much as
+ * compressing it, so it is done in the thread pool.
+ */
+uint64_t coroutine_fn
+qcow2_co_fingerprint(BlockDriverState *bs, const void *buf, size_t len)
+{
+    Qcow2FingerprintData arg = {
+        .buf = buf,
+        .len = len,
+    };
+
+    if (qcow2_co_process(bs, qcow2_fingerprint_pool_func, &arg) < 0) {
+        return 0;
+    }
+    return arg.fingerprint;
+}
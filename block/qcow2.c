@@ -73,6 +73,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x4a524e4c
+#define  QCOW2_EXT_MAGIC_DEDUP 0x44445550
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -417,6 +419,74 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+        {
+            Qcow2JournalHeaderExt journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "journal_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &journal_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "journal_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            journal_ext.offset = be64_to_cpu(journal_ext.offset);
+            journal_ext.size = be64_to_cpu(journal_ext.size);
+
+            if (journal_ext.offset == 0 ||
+                offset_into_cluster(s, journal_ext.offset) ||
+                journal_ext.size == 0 ||
+                offset_into_cluster(s, journal_ext.size) ||
+                journal_ext.size > QCOW2_MAX_JOURNAL_SIZE) {
+                error_setg(errp, "journal_ext: Invalid journal area");
+                return -EINVAL;
+            }
+
+            s->journal_offset = journal_ext.offset;
+            s->journal_area_size = journal_ext.size;
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_DEDUP:
+        {
+            Qcow2DedupHeaderExt dedup_ext;
+
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            dedup_ext.offset = be64_to_cpu(dedup_ext.offset);
+            dedup_ext.size = be64_to_cpu(dedup_ext.size);
+            dedup_ext.flags = be32_to_cpu(dedup_ext.flags);
+
+            if (dedup_ext.offset == 0 ||
+                offset_into_cluster(s, dedup_ext.offset) ||
+                dedup_ext.size < s->cluster_size ||
+                !is_power_of_2(dedup_ext.size) ||
+                dedup_ext.size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+                error_setg(errp, "dedup_ext: Invalid dedup index area");
+                return -EINVAL;
+            }
+
+            s->dedup_offset = dedup_ext.offset;
+            s->dedup_area_size = dedup_ext.size;
+            s->dedup_flags = dedup_ext.flags;
+            break;
+        }
+
         case QCOW2_EXT_MAGIC_DATA_FILE:
         {
             s->image_data_file = g_malloc0(ext.len + 1);
@@ -614,6 +684,15 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would look like leaks */
+    qcow2_release_cluster_pools(bs);
+
+    /* Repairs write metadata directly, not through the journal */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -701,6 +780,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CLUSTER_POOL_SIZE,
+    QCOW2_OPT_JOURNAL_SIZE,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
     NULL
 };
 
@@ -817,6 +899,30 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve data clusters in batches of this size for "
+                    "each thread doing allocating writes (0 = off)",
+        },
+        {
+            .name = QCOW2_OPT_JOURNAL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Journal metadata updates in a log of this size "
+                    "(0 = off)",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP_INDEX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Deduplicate newly written clusters using an index of "
+                    "this size (0 = drop the index)",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache "
+                    "(0 = off)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -841,6 +947,7 @@ static void cache_clean_timer_cb(void *opaque)
     BDRVQcow2State *s = bs->opaque;
     qcow2_cache_clean_unused(s->l2_table_cache);
     qcow2_cache_clean_unused(s->refcount_block_cache);
+    qcow2_compressed_cache_clean_unused(s->compressed_cache);
     timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               (int64_t) s->cache_clean_interval * 1000);
 }
@@ -973,12 +1080,16 @@ static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t cluster_pool_size;
+    uint64_t journal_size;
+    int64_t dedup_index_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,6 +1102,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1032,6 +1144,68 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->cluster_pool_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE, 0) /
+        s->cluster_size;
+    if (r->cluster_pool_size > INT32_MAX) {
+        error_setg(errp, QCOW2_OPT_CLUSTER_POOL_SIZE " too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /*
+     * Unused pooled clusters are given back when pools get resized or the
+     * image becomes read-only.  Do it before the refcount cache is flushed
+     * below, or the update would be lost with the old cache.
+     */
+    if (r->cluster_pool_size != s->cluster_pool_size ||
+        !(flags & BDRV_O_RDWR)) {
+        qcow2_release_cluster_pools(bs);
+    }
+
+    r->journal_size = qemu_opt_get_size(opts, QCOW2_OPT_JOURNAL_SIZE, 0);
+    if (r->journal_size > QCOW2_MAX_JOURNAL_SIZE) {
+        error_setg(errp, QCOW2_OPT_JOURNAL_SIZE " may not exceed %llu",
+                   QCOW2_MAX_JOURNAL_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->journal_size && s->qcow_version < 3) {
+        error_setg(errp, "The metadata journal requires a qcow2 image with at "
+                   "least qemu 1.1 compatibility level");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Not in mutable_opts, so this only changes when the image is opened */
+    r->dedup_index_size = -1;
+    if (qemu_opt_get(opts, QCOW2_OPT_DEDUP_INDEX_SIZE)) {
+        uint64_t size = qemu_opt_get_size(opts, QCOW2_OPT_DEDUP_INDEX_SIZE, 0);
+
+        if (size && (size < s->cluster_size || !is_power_of_2(size) ||
+                     size > QCOW2_MAX_DEDUP_INDEX_SIZE)) {
+            error_setg(errp, QCOW2_OPT_DEDUP_INDEX_SIZE " must be 0 or a "
+                       "power of two between the cluster size and %llu",
+                       QCOW2_MAX_DEDUP_INDEX_SIZE);
+            ret = -EINVAL;
+            goto fail;
+        }
+        r->dedup_index_size = size;
+    }
+
+    /*
+     * The journal is sized for the current caches, so it is set up again
+     * after the reopen.  It also needs to be checkpointed before the caches
+     * are flushed below.
+     */
+    if (s->journal) {
+        ret = qcow2_journal_disable(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to disable the journal");
+            goto fail;
+        }
+    }
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -1061,6 +1235,19 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                          DEFAULT_COMPRESSED_CACHE_SIZE) / s->cluster_size;
+    if (compressed_cache_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (compressed_cache_size) {
+        r->compressed_cache =
+            qcow2_compressed_cache_create(compressed_cache_size);
+    }
+
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
         qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
@@ -1230,6 +1417,9 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
 
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = r->compressed_cache;
+
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
 
@@ -1238,6 +1428,9 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->cluster_pool_size = r->cluster_pool_size;
+    s->journal_size = r->journal_size;
+    s->dedup_index_size = r->dedup_index_size;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1258,6 +1451,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_compressed_cache_destroy(r->compressed_cache);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1627,6 +1821,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->cluster_pools);
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
@@ -1636,6 +1831,15 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Bring the metadata up to date before anything reads it */
+    if (!(bdrv_get_flags(bs) & BDRV_O_INACTIVE) &&
+        (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL)) {
+        ret = qcow2_journal_replay(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     if (open_data_file) {
         /* Open external data file */
         bdrv_graph_co_rdunlock();
@@ -1866,6 +2070,30 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /*
+     * A journal area left behind by a crash has been replayed above; drop
+     * it, and set up a new one if requested
+     */
+    if (bdrv_is_writable(bs) && !(bdrv_get_flags(bs) & BDRV_O_INACTIVE)) {
+        ret = qcow2_journal_disable(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not drop the old journal");
+            goto fail;
+        }
+
+        if (s->journal_size) {
+            ret = qcow2_journal_enable(bs, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        ret = qcow2_dedup_open(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1878,6 +2106,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 
  fail:
+    qcow2_dedup_close(bs);
+    qcow2_journal_close(bs);
     g_free(s->image_data_file);
     if (open_data_file && has_data_file(bs)) {
         bdrv_graph_co_rdunlock();
@@ -1899,6 +2129,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1997,6 +2229,12 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        ret = qcow2_dedup_store(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to store the dedup index");
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2045,6 +2283,8 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
 
 static void qcow2_reopen_commit_post(BDRVReopenState *state)
 {
+    BDRVQcow2State *s = state->bs->opaque;
+
     GRAPH_RDLOCK_GUARD_MAINLOOP();
 
     if (state->flags & BDRV_O_RDWR) {
@@ -2060,6 +2300,21 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        if (s->journal_size && !s->journal &&
+            qcow2_journal_enable(state->bs, &local_err) < 0) {
+            /* Not fatal either, metadata is just written in place */
+            error_reportf_err(local_err,
+                              "%s: Failed to enable the metadata journal: ",
+                              bdrv_get_node_name(state->bs));
+        }
+
+        if (!s->dedup && qcow2_dedup_open(state->bs, &local_err) < 0) {
+            /* Not fatal either, new clusters are just not deduplicated */
+            error_reportf_err(local_err,
+                              "%s: Failed to set up the dedup index: ",
+                              bdrv_get_node_name(state->bs));
+        }
     }
 }
 
@@ -2078,6 +2333,28 @@ static void qcow2_reopen_abort(BDRVReopenState *state)
     }
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
+
+    /* qcow2_update_options_prepare() disabled the journal */
+    if (s->journal_size && !s->journal && bdrv_is_writable(state->bs)) {
+        Error *local_err = NULL;
+
+        if (qcow2_journal_enable(state->bs, &local_err) < 0) {
+            error_reportf_err(local_err,
+                              "%s: Failed to enable the metadata journal: ",
+                              bdrv_get_node_name(state->bs));
+        }
+    }
+
+    /* qcow2_reopen_prepare() may have stored the index already */
+    if (!s->dedup && s->dedup_offset && bdrv_is_writable(state->bs)) {
+        Error *local_err = NULL;
+
+        if (qcow2_dedup_open(state->bs, &local_err) < 0) {
+            error_reportf_err(local_err,
+                              "%s: Failed to set up the dedup index: ",
+                              bdrv_get_node_name(state->bs));
+        }
+    }
 }
 
 static void qcow2_join_options(QDict *options, QDict *old_options)
@@ -2675,6 +2952,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        uint64_t dedup_fingerprint = 0;
 
         l2meta = NULL;
 
@@ -2687,6 +2965,21 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        /* Whole clusters are deduplicated one at a time */
+        if (s->dedup && offset_in_cluster == 0 && bytes >= s->cluster_size) {
+            ret = qcow2_dedup_co_write(bs, offset, qiov, qiov_offset,
+                                       &dedup_fingerprint);
+            if (ret < 0) {
+                goto fail_nometa;
+            } else if (ret > 0) {
+                bytes -= s->cluster_size;
+                offset += s->cluster_size;
+                qiov_offset += s->cluster_size;
+                continue;
+            }
+            cur_bytes = s->cluster_size;
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
@@ -2695,6 +2988,12 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto out_locked;
         }
 
+        /* Only newly allocated clusters get into the index */
+        if (dedup_fingerprint && l2meta) {
+            assert(!l2meta->next);
+            l2meta->dedup_fingerprint = dedup_fingerprint;
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
                                             cur_bytes, true);
         if (ret < 0) {
@@ -2748,6 +3047,8 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_cluster_pools(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2756,6 +3057,20 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_dedup_store(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to store the dedup index: %s", strerror(-ret));
+    }
+
+    /* Freeing the journal area updates refcounts, so do it before flushing */
+    ret = qcow2_journal_disable(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to checkpoint the metadata journal: %s",
+                     strerror(-ret));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2790,8 +3105,12 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     }
 
     cache_clean_timer_del(bs);
+    qcow2_dedup_close(bs);
+    qcow2_journal_close(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -3033,10 +3352,10 @@ int qcow2_update_header(BlockDriverState *bs)
     }
 
     /*
-     * Feature table.  A mere 8 feature names occupies 392 bytes, and
+     * Feature table.  A mere 10 feature names occupies 488 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
-     * 8-byte end-of-extension marker, that would leave only 8 bytes
-     * for a backing file name in an image with 512-byte clusters.
+     * 8-byte end-of-extension marker, that would not even fit in an
+     * image with 512-byte clusters, let alone a backing file name.
      * Thus, we choose to omit this header for cluster sizes 4k and
      * smaller.
      */
@@ -3067,6 +3386,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_DEDUP_BITNR,
+                .name = "deduplication",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3093,6 +3422,39 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Metadata journal extension */
+    if (s->journal_offset) {
+        Qcow2JournalHeaderExt journal_header = {
+            .offset = cpu_to_be64(s->journal_offset),
+            .size   = cpu_to_be64(s->journal_area_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_header, sizeof(journal_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Dedup index extension */
+    if (s->dedup_offset) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .offset = cpu_to_be64(s->dedup_offset),
+            .size   = cpu_to_be64(s->dedup_area_size),
+            .flags  = cpu_to_be32(s->dedup_flags),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP,
+                             &dedup_header, sizeof(dedup_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Bitmap extension */
     if (s->nb_bitmaps > 0) {
         Qcow2BitmapHeaderExt bitmaps_header = {
@@ -4326,6 +4688,17 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
     old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
     new_l1_size = size_to_l1(s, offset);
 
+    /* Don't keep clusters reserved that could be in the way of shrinking */
+    qcow2_release_cluster_pools(bs);
+
+    /* Shrinking rewrites refcount structures directly */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Failed to checkpoint the metadata journal");
+        goto fail;
+    }
+
     if (offset < old_length) {
         int64_t last_cluster, old_file_size;
         if (prealloc != PREALLOC_MODE_OFF) {
@@ -4813,36 +5186,24 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    int ret;
+    uint8_t *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
-    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
-
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    if (qcow2_compressed_cache_read(bs, l2_entry, offset_in_cluster, bytes,
+                                    qiov, qiov_offset)) {
+        return 0;
     }
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
+    ret = qcow2_co_decompress_cluster(bs, offset, l2_entry, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
     qemu_vfree(out_buf);
-    g_free(buf);
 
     return ret;
 }
@@ -4861,6 +5222,8 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    qcow2_release_cluster_pools(bs);
+
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -5008,18 +5371,20 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
+        !s->journal_offset && !s->dedup_offset &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, persistent bitmaps, the metadata journal or the
+         * dedup index),
+         * because it completely empties the image.  Furthermore, the L1
+         * table and three additional clusters (image header, refcount
+         * table, one refcount block) have to fit inside one refcount
+         * block. It only resets the image file, i.e. does not work with
+         * an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -5048,7 +5413,11 @@ static coroutine_fn GRAPH_RDLOCK int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_write_caches(bs);
+    if (s->journal) {
+        ret = qcow2_journal_commit(bs);
+    } else {
+        ret = qcow2_write_caches(bs);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -5233,6 +5602,25 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new0(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new0(Qcow2CacheStats, 1);
+    if (s->l2_table_cache) {
+        qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_get_stats(s->refcount_block_cache,
+                              stats->u.qcow2.refcount_cache);
+    }
+
+    return stats;
+}
+
 static ImageInfoSpecific * GRAPH_RDLOCK
 qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
 {
@@ -5769,6 +6157,14 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                             (encryption_update == true)
     };
 
+    /* Some of the steps below rewrite metadata without the caches */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Failed to checkpoint the metadata journal");
+        return ret;
+    }
+
     /* Upgrade first (some features may require compat=1.1) */
     if (new_version > old_version) {
         helper_cb_info.current_operation = QCOW2_UPGRADING;
@@ -6162,6 +6558,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure                       = qcow2_measure,
     .bdrv_co_get_info                   = qcow2_co_get_info,
     .bdrv_get_specific_info             = qcow2_get_specific_info,
+    .bdrv_get_specific_stats            = qcow2_get_specific_stats,
 
     .bdrv_co_save_vmstate               = qcow2_co_save_vmstate,
     .bdrv_co_load_vmstate               = qcow2_co_load_vmstate,
@@ -128,6 +128,9 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Decompressed clusters kept per image, allocated when they are read */
+#define DEFAULT_COMPRESSED_CACHE_SIZE (4 * MiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +153,24 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_POOL_SIZE "cluster-pool-size"
+#define QCOW2_OPT_JOURNAL_SIZE "journal-size"
+#define QCOW2_OPT_DEDUP_INDEX_SIZE "dedup-index-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+
+/*
+ * Data clusters reserved in one go for the allocating writes of a single
+ * AioContext.  Handing them out only needs s->lock for a few instructions,
+ * and requests from different IOThreads get separate contiguous ranges
+ * instead of interleaving their clusters.
+ */
+typedef struct Qcow2ClusterPool {
+    AioContext *ctx;
+    /* First reserved cluster not handed out yet, or end of the last batch */
+    uint64_t offset;
+    uint64_t nb_clusters;
+    QLIST_ENTRY(Qcow2ClusterPool) next;
+} Qcow2ClusterPool;
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -256,17 +277,23 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR    = 5,
+    QCOW2_INCOMPAT_DEDUP_BITNR      = 6,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL          = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
+    QCOW2_INCOMPAT_DEDUP            = 1 << QCOW2_INCOMPAT_DEDUP_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_JOURNAL
+                                    | QCOW2_INCOMPAT_DEDUP,
 };
 
 /* Compatible feature bits */
@@ -322,6 +349,36 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
+/* Each journal record starts with a header sector */
+#define QCOW2_JOURNAL_RECORD_HEADER_SIZE BDRV_SECTOR_SIZE
+
+/* Largest journal area that can be requested with journal-size */
+#define QCOW2_MAX_JOURNAL_SIZE (1ULL << 30)
+
+typedef struct Qcow2Journal Qcow2Journal;
+
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t flags;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+/* The dedup index on disk matches the image, see qcow2-dedup.c */
+#define QCOW2_DEDUP_INDEX_VALID 1
+
+/* Largest dedup index that can be requested with dedup-index-size */
+#define QCOW2_MAX_DEDUP_INDEX_SIZE (256 * MiB)
+
+typedef struct Qcow2Dedup Qcow2Dedup;
+
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -350,6 +407,33 @@ typedef struct BDRVQcow2State {
 
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
+    /* Size of a cluster pool refill in clusters, 0 if pools are disabled */
+    uint64_t cluster_pool_size;
+    QLIST_HEAD(, Qcow2ClusterPool) cluster_pools;
+
+    /* Journal size requested with journal-size, 0 to disable journaling */
+    uint64_t journal_size;
+    /* Journal area from the header extension, 0 if there is none */
+    uint64_t journal_offset;
+    uint64_t journal_area_size;
+    /* Set while metadata updates are journaled, see qcow2-journal.c */
+    Qcow2Journal *journal;
+
+    /*
+     * Index size requested with dedup-index-size, 0 to drop the index, or
+     * -1 to keep whatever the image has
+     */
+    int64_t dedup_index_size;
+    /* Dedup index area from the header extension, 0 if there is none */
+    uint64_t dedup_offset;
+    uint64_t dedup_area_size;
+    uint32_t dedup_flags;
+    /* Set while new clusters are deduplicated, see qcow2-dedup.c */
+    Qcow2Dedup *dedup;
+
+    /* Decompressed clusters, NULL if disabled */
+    Qcow2CompressedCache *compressed_cache;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -454,6 +538,13 @@ typedef struct QCowL2Meta
     /** Do not free the old clusters */
     bool keep_old_clusters;
 
+    /**
+     * Fingerprint of the data of a single new cluster that is added to the
+     * dedup index when it is linked, or 0.  Such clusters are linked without
+     * QCOW_OFLAG_COPIED, so that they are never overwritten in place.
+     */
+    uint64_t dedup_fingerprint;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -873,6 +964,11 @@ int64_t GRAPH_RDLOCK coroutine_fn
 qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
+int64_t GRAPH_RDLOCK coroutine_fn
+qcow2_alloc_clusters_pooled(BlockDriverState *bs, uint64_t offset,
+                            uint64_t *nb_clusters);
+void GRAPH_RDLOCK qcow2_release_cluster_pools(BlockDriverState *bs);
+
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
@@ -950,6 +1046,10 @@ qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 void coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_l2(BlockDriverState *bs, uint64_t guest_offset,
+                    uint64_t host_offset);
+
 int GRAPH_RDLOCK
 qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                       enum qcow2_discard_type type, bool full_discard);
@@ -1021,6 +1121,53 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
+int GRAPH_RDLOCK qcow2_cache_journal(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_journal_forget(Qcow2Cache *c);
+uint64_t qcow2_cache_journal_size(Qcow2Cache *c);
+
+/* qcow2-journal.c functions */
+int GRAPH_RDLOCK qcow2_journal_enable(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_journal_disable(BlockDriverState *bs);
+void qcow2_journal_close(BlockDriverState *bs);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_journal_replay(BlockDriverState *bs, Error **errp);
+
+int GRAPH_RDLOCK qcow2_journal_append(BlockDriverState *bs, uint64_t offset,
+                                      const void *table, int size);
+int GRAPH_RDLOCK qcow2_journal_commit(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_journal_checkpoint(BlockDriverState *bs);
+int GRAPH_RDLOCK
+qcow2_journal_before_write(BlockDriverState *bs, uint64_t offset,
+                           bool journaled);
+void qcow2_journal_cluster_freed(BlockDriverState *bs, uint64_t offset);
+int GRAPH_RDLOCK qcow2_journal_prepare_alloc(BlockDriverState *bs);
+
+/* qcow2-dedup.c functions */
+int GRAPH_RDLOCK qcow2_dedup_open(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_dedup_store(BlockDriverState *bs);
+void qcow2_dedup_close(BlockDriverState *bs);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_co_write(BlockDriverState *bs, uint64_t offset,
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     uint64_t *fingerprint);
+void qcow2_dedup_insert(BlockDriverState *bs, uint64_t fingerprint,
+                        uint64_t host_offset);
+void qcow2_dedup_cluster_freed(BlockDriverState *bs, uint64_t offset);
+bool qcow2_dedup_is_indexed(BlockDriverState *bs, uint64_t offset);
+
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_clean_unused(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_cluster_freed(BlockDriverState *bs,
+                                          uint64_t offset);
+bool qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t l2_entry,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t offset,
+                            uint64_t l2_entry, uint8_t *out_buf);
 
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
@@ -1070,5 +1217,7 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+uint64_t coroutine_fn
+qcow2_co_fingerprint(BlockDriverState *bs, const void *buf, size_t len);
 
 #endif
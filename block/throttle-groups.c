@@ -26,6 +26,7 @@
 #include "sysemu/block-backend.h"
 #include "block/throttle-groups.h"
 #include "qemu/throttle-options.h"
+#include "qemu/host-utils.h"
 #include "qemu/main-loop.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
@@ -62,6 +63,19 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * With the weighted-fair scheduler, the member that may submit next is
+ * not picked round-robin but by start-time fair queuing: every member
+ * has a virtual time per direction that advances by the cost of each of
+ * its requests divided by its weight, and the member with the lowest
+ * virtual time goes first.  Members with a reservation that they have
+ * not used up yet go before all others.  Idle members do not accumulate
+ * credit, so a busy member can use all the bandwidth the group allows
+ * while the others are idle, but gets only its share once they are not.
+ *
+ * Groups can be nested: a group with a parent is a member of the parent
+ * group (through @parent_tgm), so its requests are first scheduled among
+ * the group's own members and then among the parent's members.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -77,10 +91,33 @@ struct ThrottleGroup {
     bool any_timer_armed[THROTTLE_MAX];
     QEMUClockType clock_type;
 
+    /* These are protected by lock, too */
+    ThrottleGroupScheduler scheduler;
+    uint64_t vclock[THROTTLE_MAX];
+
+    /* Parent group settings, constant after initialization */
+    char *parent_name;
+    unsigned weight;
+    uint64_t reservation;
+    ThrottleGroupMember parent_tgm;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
 
+/* Per-request cost in bytes on top of the payload, so that small
+ * requests are not free for the weighted-fair scheduler */
+#define THROTTLE_WFQ_REQUEST_COST 4096
+
+/* How much unused reservation a member can build up */
+#define THROTTLE_RESERVATION_BURST_NS (100 * SCALE_MS)
+
+/* Upper bounds (in ns) of all but the last throttling delay histogram bin */
+static const uint64_t wait_hist_boundaries[THROTTLE_WAIT_HIST_BINS - 1] = {
+    100 * SCALE_US, SCALE_MS, 10 * SCALE_MS, 100 * SCALE_MS,
+    NANOSECONDS_PER_SECOND, 10 * NANOSECONDS_PER_SECOND,
+};
+
 /* This is protected by the global QEMU mutex */
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -206,6 +243,100 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[direction];
 }
 
+/* Top up the reservation credit of a ThrottleGroupMember and return whether
+ * it has reserved bandwidth left.
+ *
+ * This assumes that tg->lock is held.
+ */
+static bool tgm_refill_reservation(ThrottleGroupMember *tgm, int64_t now)
+{
+    int64_t elapsed = now - tgm->resv_refill_ns;
+    int64_t burst;
+
+    if (!tgm->reservation) {
+        return false;
+    }
+
+    burst = muldiv64(tgm->reservation, THROTTLE_RESERVATION_BURST_NS,
+                     NANOSECONDS_PER_SECOND);
+    elapsed = MIN(MAX(elapsed, 0), THROTTLE_RESERVATION_BURST_NS);
+    tgm->resv_credit += muldiv64(tgm->reservation, elapsed,
+                                 NANOSECONDS_PER_SECOND);
+    tgm->resv_credit = MIN(tgm->resv_credit, burst);
+    tgm->resv_refill_ns = now;
+
+    return tgm->resv_credit > 0;
+}
+
+/* Return the ThrottleGroupMember with pending I/O requests that the
+ * weighted-fair scheduler picks next, or NULL if there is none.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:        the ThrottleGroup
+ * @direction: the ThrottleDirection
+ */
+static ThrottleGroupMember *wfq_next_token(ThrottleGroup *tg,
+                                           ThrottleDirection direction)
+{
+    ThrottleGroupMember *iter, *best = NULL;
+    bool best_reserved = false;
+    int64_t now = qemu_clock_get_ns(tg->clock_type);
+
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        bool reserved;
+
+        if (!tgm_has_pending_reqs(iter, direction)) {
+            continue;
+        }
+
+        reserved = tgm_refill_reservation(iter, now);
+        if (!best || (reserved && !best_reserved) ||
+            (reserved == best_reserved &&
+             iter->vtime[direction] < best->vtime[direction])) {
+            best = iter;
+            best_reserved = reserved;
+        }
+    }
+
+    return best;
+}
+
+/* Charge an I/O request that is about to be executed to its
+ * ThrottleGroupMember's virtual time and reservation.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void wfq_charge(ThrottleGroup *tg, ThrottleGroupMember *tgm,
+                       int64_t bytes, ThrottleDirection direction)
+{
+    uint64_t cost = bytes + THROTTLE_WFQ_REQUEST_COST;
+
+    tg->vclock[direction] = MAX(tg->vclock[direction], tgm->vtime[direction]);
+    tgm->vtime[direction] += cost * THROTTLE_GROUP_DEFAULT_WEIGHT / tgm->weight;
+
+    if (tgm->reservation) {
+        tgm->resv_credit -= bytes;
+    }
+}
+
+/* Record how long an I/O request has been held back by the group.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void tgm_account_wait(ThrottleGroupMember *tgm,
+                             ThrottleDirection direction, int64_t wait_ns)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(wait_hist_boundaries); i++) {
+        if (wait_ns < wait_hist_boundaries[i]) {
+            break;
+        }
+    }
+    tgm->wait_hist[direction][i]++;
+}
+
 /* Return the next ThrottleGroupMember in the round-robin sequence with pending
  * I/O requests.
  *
@@ -232,6 +363,11 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
         return tgm;
     }
 
+    if (tg->scheduler == THROTTLE_GROUP_SCHEDULER_WEIGHTED_FAIR) {
+        token = wfq_next_token(tg, direction);
+        return token ?: tgm;
+    }
+
     start = token = tg->tokens[direction];
 
     /* get next bs round in round robin style */
@@ -355,22 +491,32 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
  * algorithm.
  *
  * @tgm:       the current ThrottleGroupMember
+ * @origin:    for the parent_tgm of a nested group, the member that the
+ *             request comes from; NULL otherwise
  * @bytes:     the number of bytes for this I/O
  * @direction: the ThrottleDirection
  */
-void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm,
-                                                        int64_t bytes,
-                                                        ThrottleDirection direction)
+static void coroutine_fn
+throttle_group_co_member_intercept(ThrottleGroupMember *tgm,
+                                   ThrottleGroupMember *origin,
+                                   int64_t bytes, ThrottleDirection direction)
 {
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    int64_t start_ns = qemu_clock_get_ns(tg->clock_type);
 
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
     qemu_mutex_lock(&tg->lock);
 
+    /* A member that was idle starts at the group's current virtual time */
+    if (!tgm->pending_reqs[direction]) {
+        tgm->vtime[direction] = MAX(tgm->vtime[direction],
+                                    tg->vclock[direction]);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, direction);
     must_wait = throttle_group_schedule_timer(token, direction);
@@ -380,8 +526,17 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         tgm->pending_reqs[direction]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
-        qemu_co_queue_wait(&tgm->throttled_reqs[direction],
-                           &tgm->throttled_reqs_lock);
+        /*
+         * Don't queue in a parent group once the origin is drained.  This is
+         * checked under throttled_reqs_lock, which
+         * throttle_group_restart_parents() takes after the limits of the
+         * origin have been disabled, so the request is either released by it
+         * or does not wait at all.
+         */
+        if (!origin || !qatomic_read(&origin->io_limits_disabled)) {
+            qemu_co_queue_wait(&tgm->throttled_reqs[direction],
+                               &tgm->throttled_reqs_lock);
+        }
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[direction]--;
@@ -389,16 +544,35 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, direction, bytes);
+    wfq_charge(tg, tgm, bytes, direction);
+    tgm_account_wait(tgm, direction,
+                     qemu_clock_get_ns(tg->clock_type) - start_ns);
 
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
 
     qemu_mutex_unlock(&tg->lock);
+
+    /* Nested groups: now compete with the other members of the parent */
+    origin = origin ?: tgm;
+    if (tg->parent_tgm.throttle_state &&
+        !qatomic_read(&origin->io_limits_disabled)) {
+        throttle_group_co_member_intercept(&tg->parent_tgm, origin, bytes,
+                                           direction);
+    }
+}
+
+void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm,
+                                                        int64_t bytes,
+                                                        ThrottleDirection direction)
+{
+    throttle_group_co_member_intercept(tgm, NULL, bytes, direction);
 }
 
 typedef struct {
     ThrottleGroupMember *tgm;
     ThrottleDirection direction;
+    bool all;
 } RestartData;
 
 static void coroutine_fn throttle_group_restart_queue_entry(void *opaque)
@@ -410,7 +584,14 @@ static void coroutine_fn throttle_group_restart_queue_entry(void *opaque)
     ThrottleDirection direction = data->direction;
     bool empty_queue;
 
-    empty_queue = !throttle_group_co_restart_queue(tgm, direction);
+    if (data->all) {
+        qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
+        empty_queue = qemu_co_queue_empty(&tgm->throttled_reqs[direction]);
+        qemu_co_queue_restart_all(&tgm->throttled_reqs[direction]);
+        qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
+    } else {
+        empty_queue = !throttle_group_co_restart_queue(tgm, direction);
+    }
 
     /* If the request queue was empty then we have to take care of
      * scheduling the next one */
@@ -426,19 +607,23 @@ static void coroutine_fn throttle_group_restart_queue_entry(void *opaque)
     aio_wait_kick();
 }
 
+/* Restart the next request in the queue of @tgm, or all of them if @all */
 static void throttle_group_restart_queue(ThrottleGroupMember *tgm,
-                                        ThrottleDirection direction)
+                                        ThrottleDirection direction, bool all)
 {
     Coroutine *co;
     RestartData *rd = g_new0(RestartData, 1);
 
     rd->tgm = tgm;
     rd->direction = direction;
+    rd->all = all;
 
     /* This function is called when a timer is fired or when
      * throttle_group_restart_tgm() is called. Either way, there can
-     * be no timer pending on this tgm at this point */
-    assert(!timer_pending(tgm->throttle_timers.timers[direction]));
+     * be no timer pending on this tgm at this point. The parent_tgm
+     * of a nested group is restarted from other threads, which can
+     * race with a new timer being armed, so it is not checked. */
+    assert(all || !timer_pending(tgm->throttle_timers.timers[direction]));
 
     qatomic_inc(&tgm->restart_pending);
 
@@ -446,6 +631,34 @@ static void throttle_group_restart_queue(ThrottleGroupMember *tgm,
     aio_co_enter(tgm->aio_context, co);
 }
 
+/*
+ * Requests of a member whose limits have been disabled may already wait in
+ * the queues of the parent groups.  The timers of those run in the main
+ * loop and need not fire while the member is drained, so release all the
+ * requests that wait there.  This lets the requests of sibling groups
+ * through early as well, once per drain.
+ */
+static void throttle_group_restart_parents(ThrottleGroupMember *tgm)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleDirection dir;
+
+    while (tg->parent_tgm.throttle_state) {
+        ThrottleGroupMember *parent_tgm = &tg->parent_tgm;
+
+        tg = container_of(parent_tgm->throttle_state, ThrottleGroup, ts);
+        for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+            qemu_mutex_lock(&tg->lock);
+            if (timer_pending(parent_tgm->throttle_timers.timers[dir])) {
+                timer_del(parent_tgm->throttle_timers.timers[dir]);
+                tg->any_timer_armed[dir] = false;
+            }
+            qemu_mutex_unlock(&tg->lock);
+            throttle_group_restart_queue(parent_tgm, dir, true);
+        }
+    }
+}
+
 void throttle_group_restart_tgm(ThrottleGroupMember *tgm)
 {
     ThrottleDirection dir;
@@ -459,9 +672,12 @@ void throttle_group_restart_tgm(ThrottleGroupMember *tgm)
                 timer_cb(tgm, dir);
             } else {
                 /* Else run the next request from the queue manually */
-                throttle_group_restart_queue(tgm, dir);
+                throttle_group_restart_queue(tgm, dir, false);
             }
         }
+        if (qatomic_read(&tgm->io_limits_disabled)) {
+            throttle_group_restart_parents(tgm);
+        }
     }
 }
 
@@ -516,7 +732,7 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction)
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
-    throttle_group_restart_queue(tgm, direction);
+    throttle_group_restart_queue(tgm, direction, false);
 }
 
 static void read_timer_cb(void *opaque)
@@ -552,6 +768,12 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
 
+    tgm->name = NULL;
+    tgm->weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
+    tgm->reservation = 0;
+    tgm->resv_credit = 0;
+    memset(tgm->wait_hist, 0, sizeof(tgm->wait_hist));
+
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
     for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
@@ -559,6 +781,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
             tg->tokens[dir] = tgm;
         }
         qemu_co_queue_init(&tgm->throttled_reqs[dir]);
+        tgm->vtime[dir] = tg->vclock[dir];
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
@@ -615,12 +838,41 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
         throttle_timers_destroy(&tgm->throttle_timers);
+        g_free(tgm->name);
+        tgm->name = NULL;
     }
 
     throttle_group_unref(&tg->ts);
     tgm->throttle_state = NULL;
 }
 
+/* Set the name under which a ThrottleGroupMember appears in the group's
+ * statistics, and its weight and reservation for the weighted-fair
+ * scheduler.
+ *
+ * @tgm:         a ThrottleGroupMember that is a member of a group
+ * @name:        the name for statistics, may be NULL
+ * @weight:      the member's share of the group's bandwidth, relative to
+ *               the weights of the other members
+ * @reservation: bandwidth in bytes per second that the member gets before
+ *               any member without reservation, or 0
+ */
+void throttle_group_set_member_params(ThrottleGroupMember *tgm,
+                                      const char *name, unsigned weight,
+                                      uint64_t reservation)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+
+    QEMU_LOCK_GUARD(&tg->lock);
+    g_free(tgm->name);
+    tgm->name = g_strdup(name);
+    tgm->weight = weight;
+    tgm->reservation = reservation;
+    tgm->resv_refill_ns = qemu_clock_get_ns(tg->clock_type);
+}
+
 void throttle_group_attach_aio_context(ThrottleGroupMember *tgm,
                                        AioContext *new_context)
 {
@@ -761,6 +1013,8 @@ static void throttle_group_obj_init(Object *obj)
         tg->clock_type = QEMU_CLOCK_VIRTUAL;
     }
     tg->is_initialized = false;
+    tg->scheduler = THROTTLE_GROUP_SCHEDULER_ROUND_ROBIN;
+    tg->weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
@@ -791,9 +1045,24 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
+
+    /* The parent must already exist, so there can be no cycles */
+    if (tg->parent_name && !throttle_group_exists(tg->parent_name)) {
+        error_setg(errp, "Throttle group '%s' does not exist",
+                   tg->parent_name);
+        return;
+    }
+
     throttle_config(&tg->ts, tg->clock_type, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
+
+    if (tg->parent_name) {
+        throttle_group_register_tgm(&tg->parent_tgm, tg->parent_name,
+                                    qemu_get_aio_context());
+        throttle_group_set_member_params(&tg->parent_tgm, tg->name,
+                                         tg->weight, tg->reservation);
+    }
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -804,7 +1073,9 @@ static void throttle_group_obj_finalize(Object *obj)
     if (tg->is_initialized) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
     }
+    throttle_group_unregister_tgm(&tg->parent_tgm);
     qemu_mutex_destroy(&tg->lock);
+    g_free(tg->parent_name);
     g_free(tg->name);
 }
 
@@ -929,6 +1200,149 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static int throttle_group_get_scheduler(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    QEMU_LOCK_GUARD(&tg->lock);
+    return tg->scheduler;
+}
+
+static void throttle_group_set_scheduler(Object *obj, int value, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    /* Can be switched at any time, the scheduling state is always kept */
+    QEMU_LOCK_GUARD(&tg->lock);
+    tg->scheduler = value;
+}
+
+static char *throttle_group_get_parent(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    return g_strdup(tg->parent_name);
+}
+
+static void throttle_group_set_parent(Object *obj, const char *value,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    if (tg->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+
+    g_free(tg->parent_name);
+    tg->parent_name = g_strdup(value);
+}
+
+static void throttle_group_set_weight(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0 || value > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "%s must be between 1 and %d", name,
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        return;
+    }
+
+    tg->weight = value;
+    if (tg->parent_tgm.throttle_state) {
+        throttle_group_set_member_params(&tg->parent_tgm, tg->name,
+                                         tg->weight, tg->reservation);
+    }
+}
+
+static void throttle_group_get_weight(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint32_t value = tg->weight;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void throttle_group_set_reservation(Object *obj, Visitor *v,
+                                           const char *name, void *opaque,
+                                           Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint64_t value;
+
+    if (!visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+
+    tg->reservation = value;
+    if (tg->parent_tgm.throttle_state) {
+        throttle_group_set_member_params(&tg->parent_tgm, tg->name,
+                                         tg->weight, tg->reservation);
+    }
+}
+
+static void throttle_group_get_reservation(Object *obj, Visitor *v,
+                                           const char *name, void *opaque,
+                                           Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint64_t value = tg->reservation;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static BlockLatencyHistogramInfo *
+throttle_wait_hist_info(const uint64_t *bins)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    int i;
+
+    for (i = ARRAY_SIZE(wait_hist_boundaries) - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(info->boundaries, wait_hist_boundaries[i]);
+    }
+    for (i = THROTTLE_WAIT_HIST_BINS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(info->bins, bins[i]);
+    }
+
+    return info;
+}
+
+static void throttle_group_get_stats(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    ThrottleGroupStats *group_stats = g_new0(ThrottleGroupStats, 1);
+    ThrottleGroupMember *tgm;
+
+    WITH_QEMU_LOCK_GUARD(&tg->lock) {
+        QLIST_FOREACH(tgm, &tg->head, round_robin) {
+            ThrottleGroupMemberStats *stats =
+                g_new0(ThrottleGroupMemberStats, 1);
+
+            stats->name = g_strdup(tgm->name ?: "");
+            stats->weight = tgm->weight;
+            stats->reservation = tgm->reservation;
+            stats->read_wait =
+                throttle_wait_hist_info(tgm->wait_hist[THROTTLE_READ]);
+            stats->write_wait =
+                throttle_wait_hist_info(tgm->wait_hist[THROTTLE_WRITE]);
+            QAPI_LIST_PREPEND(group_stats->members, stats);
+        }
+    }
+
+    visit_type_ThrottleGroupStats(v, name, &group_stats, errp);
+    qapi_free_ThrottleGroupStats(group_stats);
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -958,6 +1372,27 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_get_limits,
                               throttle_group_set_limits,
                               NULL, NULL);
+
+    /* Scheduling among members and in the parent group */
+    object_class_property_add_enum(klass, "scheduler",
+                                   "ThrottleGroupScheduler",
+                                   &ThrottleGroupScheduler_lookup,
+                                   throttle_group_get_scheduler,
+                                   throttle_group_set_scheduler);
+    object_class_property_add_str(klass, "parent",
+                                  throttle_group_get_parent,
+                                  throttle_group_set_parent);
+    object_class_property_add(klass, "weight", "uint32",
+                              throttle_group_get_weight,
+                              throttle_group_set_weight,
+                              NULL, NULL);
+    object_class_property_add(klass, "reservation", "uint64",
+                              throttle_group_get_reservation,
+                              throttle_group_set_reservation,
+                              NULL, NULL);
+    object_class_property_add(klass, "stats", "ThrottleGroupStats",
+                              throttle_group_get_stats,
+                              NULL, NULL, NULL);
 }
 
 static const TypeInfo throttle_group_info = {
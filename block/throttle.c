@@ -26,6 +26,15 @@
 #include "qemu/throttle-options.h"
 #include "qapi/error.h"
 
+#define THROTTLE_OPT_WEIGHT      "weight"
+#define THROTTLE_OPT_RESERVATION "reservation"
+
+typedef struct ThrottleParams {
+    char *group;
+    unsigned weight;
+    uint64_t reservation;
+} ThrottleParams;
+
 static QemuOptsList throttle_opts = {
     .name = "throttle",
     .head = QTAILQ_HEAD_INITIALIZER(throttle_opts.head),
@@ -35,19 +44,33 @@ static QemuOptsList throttle_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Name of the throttle group",
         },
+        {
+            .name = THROTTLE_OPT_WEIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Share of the group's bandwidth relative to other "
+                    "members (default: 100)",
+        },
+        {
+            .name = THROTTLE_OPT_RESERVATION,
+            .type = QEMU_OPT_SIZE,
+            .help = "Bandwidth in bytes per second that is served before "
+                    "members without reservation",
+        },
         { /* end of list */ }
     },
 };
 
 /*
  * If this function succeeds then the throttle group name is stored in
- * @group and must be freed by the caller.
- * If there's an error then @group remains unmodified.
+ * @params->group and must be freed by the caller.
+ * If there's an error then @params remains unmodified.
  */
-static int throttle_parse_options(QDict *options, char **group, Error **errp)
+static int throttle_parse_options(QDict *options, ThrottleParams *params,
+                                  Error **errp)
 {
     int ret;
     const char *group_name;
+    uint64_t weight;
     QemuOpts *opts = qemu_opts_create(&throttle_opts, NULL, 0, &error_abort);
 
     if (!qemu_opts_absorb_qdict(opts, options, errp)) {
@@ -66,7 +89,18 @@ static int throttle_parse_options(QDict *options, char **group, Error **errp)
         goto fin;
     }
 
-    *group = g_strdup(group_name);
+    weight = qemu_opt_get_number(opts, THROTTLE_OPT_WEIGHT,
+                                 THROTTLE_GROUP_DEFAULT_WEIGHT);
+    if (weight == 0 || weight > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        ret = -EINVAL;
+        goto fin;
+    }
+
+    params->group = g_strdup(group_name);
+    params->weight = weight;
+    params->reservation = qemu_opt_get_size(opts, THROTTLE_OPT_RESERVATION, 0);
     ret = 0;
 fin:
     qemu_opts_del(opts);
@@ -77,7 +111,7 @@ static int throttle_open(BlockDriverState *bs, QDict *options,
                          int flags, Error **errp)
 {
     ThrottleGroupMember *tgm = bs->opaque;
-    char *group;
+    ThrottleParams params;
     int ret;
 
     ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
@@ -92,11 +126,14 @@ static int throttle_open(BlockDriverState *bs, QDict *options,
     bs->supported_zero_flags = bs->file->bs->supported_zero_flags |
                                BDRV_REQ_WRITE_UNCHANGED;
 
-    ret = throttle_parse_options(options, &group, errp);
+    ret = throttle_parse_options(options, &params, errp);
     if (ret == 0) {
         /* Register membership to group with name group_name */
-        throttle_group_register_tgm(tgm, group, bdrv_get_aio_context(bs));
-        g_free(group);
+        throttle_group_register_tgm(tgm, params.group,
+                                    bdrv_get_aio_context(bs));
+        throttle_group_set_member_params(tgm, bdrv_get_node_name(bs),
+                                         params.weight, params.reservation);
+        g_free(params.group);
     }
 
     return ret;
@@ -185,13 +222,17 @@ static int throttle_reopen_prepare(BDRVReopenState *reopen_state,
                                    BlockReopenQueue *queue, Error **errp)
 {
     int ret;
-    char *group = NULL;
+    ThrottleParams *params = g_new0(ThrottleParams, 1);
 
     assert(reopen_state != NULL);
     assert(reopen_state->bs != NULL);
 
-    ret = throttle_parse_options(reopen_state->options, &group, errp);
-    reopen_state->opaque = group;
+    ret = throttle_parse_options(reopen_state->options, params, errp);
+    if (ret < 0) {
+        g_free(params);
+        params = NULL;
+    }
+    reopen_state->opaque = params;
     return ret;
 }
 
@@ -199,21 +240,31 @@ static void throttle_reopen_commit(BDRVReopenState *reopen_state)
 {
     BlockDriverState *bs = reopen_state->bs;
     ThrottleGroupMember *tgm = bs->opaque;
-    char *group = reopen_state->opaque;
+    ThrottleParams *params = reopen_state->opaque;
 
-    assert(group);
+    assert(params);
 
-    if (strcmp(group, throttle_group_get_name(tgm))) {
+    if (strcmp(params->group, throttle_group_get_name(tgm))) {
         throttle_group_unregister_tgm(tgm);
-        throttle_group_register_tgm(tgm, group, bdrv_get_aio_context(bs));
+        throttle_group_register_tgm(tgm, params->group,
+                                    bdrv_get_aio_context(bs));
     }
-    g_free(reopen_state->opaque);
+    throttle_group_set_member_params(tgm, bdrv_get_node_name(bs),
+                                     params->weight, params->reservation);
+
+    g_free(params->group);
+    g_free(params);
     reopen_state->opaque = NULL;
 }
 
 static void throttle_reopen_abort(BDRVReopenState *reopen_state)
 {
-    g_free(reopen_state->opaque);
+    ThrottleParams *params = reopen_state->opaque;
+
+    if (params) {
+        g_free(params->group);
+        g_free(params);
+    }
     reopen_state->opaque = NULL;
 }
 
@@ -1862,6 +1862,7 @@ static void block_dirty_bitmap_add_action(BlockDirtyBitmapAdd *action,
                                action->has_granularity, action->granularity,
                                action->has_persistent, action->persistent,
                                action->has_disabled, action->disabled,
+                               action->has_compressed, action->compressed,
                                &local_err);
 
     if (!local_err) {
@@ -2621,7 +2622,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 {
     BlockJob *job = NULL;
     BdrvDirtyBitmap *bmap = NULL;
-    BackupPerf perf = { .max_workers = 64 };
+    BackupPerf perf = { .max_workers = 64, .adaptive = true };
     int job_flags = JOB_DEFAULT;
 
     if (!backup->has_speed) {
@@ -2653,6 +2654,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_adaptive) {
+            perf.adaptive = backup->x_perf->adaptive;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
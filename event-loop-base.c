@@ -15,6 +15,7 @@
 #include "qom/object_interfaces.h"
 #include "qapi/error.h"
 #include "block/thread-pool.h"
+#include "qemu/thread-context.h"
 #include "sysemu/event-loop-base.h"
 
 typedef struct {
@@ -32,6 +33,9 @@ static void event_loop_base_instance_init(Object *obj)
 static EventLoopBaseParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(EventLoopBase, aio_max_batch),
 };
+static EventLoopBaseParamInfo aio_sqpoll_idle_info = {
+    "aio-sqpoll-idle", offsetof(EventLoopBase, aio_sqpoll_idle_ms),
+};
 static EventLoopBaseParamInfo thread_pool_min_info = {
     "thread-pool-min", offsetof(EventLoopBase, thread_pool_min),
 };
@@ -77,6 +81,42 @@ static void event_loop_base_set_param(Object *obj, Visitor *v,
     return;
 }
 
+static bool event_loop_base_get_unified_ring(Object *obj, Error **errp)
+{
+    return EVENT_LOOP_BASE(obj)->aio_unified_ring;
+}
+
+static void event_loop_base_set_unified_ring(Object *obj, bool value,
+                                             Error **errp)
+{
+    EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(obj);
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    base->aio_unified_ring = value;
+
+    if (bc->update_params) {
+        bc->update_params(base, errp);
+    }
+}
+
+static bool event_loop_base_get_thread_pool_shared(Object *obj, Error **errp)
+{
+    return EVENT_LOOP_BASE(obj)->thread_pool_shared;
+}
+
+static void event_loop_base_set_thread_pool_shared(Object *obj, bool value,
+                                                   Error **errp)
+{
+    EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(obj);
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    base->thread_pool_shared = value;
+
+    if (bc->update_params) {
+        bc->update_params(base, errp);
+    }
+}
+
 static void event_loop_base_complete(UserCreatable *uc, Error **errp)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(uc);
@@ -109,6 +149,13 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &aio_max_batch_info);
+    object_class_property_add(klass, "aio-sqpoll-idle", "int",
+                              event_loop_base_get_param,
+                              event_loop_base_set_param,
+                              NULL, &aio_sqpoll_idle_info);
+    object_class_property_add_bool(klass, "aio-unified-ring",
+                                   event_loop_base_get_unified_ring,
+                                   event_loop_base_set_unified_ring);
     object_class_property_add(klass, "thread-pool-min", "int",
                               event_loop_base_get_param,
                               event_loop_base_set_param,
@@ -117,6 +164,12 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &thread_pool_max_info);
+    object_class_property_add_bool(klass, "thread-pool-shared",
+                                   event_loop_base_get_thread_pool_shared,
+                                   event_loop_base_set_thread_pool_shared);
+    object_class_property_add_link(klass, "thread-pool-context",
+        TYPE_THREAD_CONTEXT, offsetof(EventLoopBase, thread_pool_context),
+        object_property_allow_set_link, OBJ_PROP_LINK_STRONG);
 }
 
 static const TypeInfo event_loop_base_info = {
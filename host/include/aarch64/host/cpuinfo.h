@@ -12,6 +12,11 @@
 #define CPUINFO_AES             (1u << 3)
 #define CPUINFO_PMULL           (1u << 4)
 #define CPUINFO_BTI             (1u << 5)
+/*
+ * Advanced SIMD is part of the base ISA and always available; the bit lets
+ * users of cpuinfo list vector code separately from a scalar fallback.
+ */
+#define CPUINFO_ASIMD           (1u << 6)
 
 /* Initialized with a constructor. */
 extern unsigned cpuinfo;
@@ -3927,6 +3927,8 @@ static const VMStateDescription vmstate_virtio_net = {
     },
     .pre_save = virtio_net_pre_save,
     .dev_unplug_pending = dev_unplug_pending,
+    /* The backend is stopped, virtio_save() only reads the device */
+    .parallel_save = true,
 };
 
 static Property virtio_net_properties[] = {
@@ -20,6 +20,7 @@
 #include "qemu/coroutine-core.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "block/graph-lock.h"
@@ -57,6 +58,23 @@ struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * A request that is submitted on the io_uring that an AioContext uses for
+ * file descriptor monitoring, see aio_uring_attach().
+ */
+typedef struct AioUringRequest AioUringRequest;
+struct AioUringRequest {
+    /*
+     * Called from the event loop in the AioContext's home thread after the
+     * request has completed, with @res set to the cqe's result.
+     */
+    void (*cb)(AioUringRequest *req);
+    int res;
+    QSIMPLEQ_ENTRY(AioUringRequest) next;
+};
+#endif
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -203,6 +221,8 @@ struct AioContext {
 
     int thread_pool_min;
     int thread_pool_max;
+    bool thread_pool_shared;                    /* use the shared workers */
+    struct ThreadContext *thread_pool_context;  /* placement of workers */
     /* Thread pool for performing work and receiving completion callbacks.
      * Has its own locking.
      */
@@ -213,10 +233,22 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     LuringState *linux_io_uring;
+#ifdef HAVE_NVME_URING_CMD
+    /* Ring with big SQEs and CQEs for NVMe passthrough */
+    LuringState *linux_io_uring_cmd;
+#endif
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /*
+     * Requests that other code submits on fdmon_io_uring, see
+     * aio_uring_attach().  Only accessed from the home thread.
+     */
+    unsigned uring_users;
+    QSIMPLEQ_HEAD(, AioUringRequest) uring_completed;
+    AioHandler *uring_node;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -227,14 +259,24 @@ struct AioContext {
     /* Number of AioHandlers without .io_poll() */
     int poll_disable_cnt;
 
-    /* Polling mode parameters */
+    /*
+     * Polling mode parameters.  Each AioHandler has its own polling time,
+     * poll_ns is the longest of them.
+     */
     int64_t poll_ns;        /* current polling time in nanoseconds */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /* Polling efficiency, can be read from any thread */
+    Stat64 poll_hits;       /* polling runs that found an event */
+    Stat64 poll_misses;     /* polling runs that ended without an event */
+    Stat64 poll_wasted_ns;  /* time spent in polling runs without an event */
+
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
+    int64_t aio_sqpoll_idle_ms; /* io_uring SQPOLL idle time, 0 disables */
+    bool aio_unified_ring;  /* block I/O shares the fd monitoring io_uring */
 
     /*
      * List of handlers participating in userspace polling.  Protected by
@@ -513,6 +555,61 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef HAVE_NVME_URING_CMD
+/* Setup the LuringState for NVMe passthrough bound to this AioContext */
+LuringState *aio_setup_linux_io_uring_cmd(AioContext *ctx, Error **errp);
+
+/* Return the LuringState for NVMe passthrough bound to this AioContext */
+LuringState *aio_get_linux_io_uring_cmd(AioContext *ctx);
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_uring_attach:
+ * @ctx: the aio context
+ *
+ * Start submitting requests on the io_uring that @ctx uses to monitor file
+ * descriptors, so that a single ring (and a single system call per event
+ * loop iteration) serves both.
+ *
+ * Returns: the ring, or NULL if @ctx does not monitor file descriptors with
+ * io_uring.
+ */
+struct io_uring *aio_uring_attach(AioContext *ctx);
+
+/**
+ * aio_uring_detach:
+ * @ctx: the aio context
+ *
+ * Stop using the ring returned by aio_uring_attach().  There must not be any
+ * requests in flight.
+ */
+void aio_uring_detach(AioContext *ctx);
+
+/**
+ * aio_uring_sqe_set_request:
+ * @sqe: an sqe of the ring returned by aio_uring_attach()
+ * @req: the request that completes with @sqe
+ *
+ * Use this instead of io_uring_sqe_set_data() on the shared ring.
+ */
+void aio_uring_sqe_set_request(struct io_uring_sqe *sqe, AioUringRequest *req);
+
+/**
+ * aio_uring_submit:
+ * @ctx: the aio context
+ * @now: submit even if aio_poll() would do it
+ *
+ * Submit the sqes that were prepared on the ring returned by
+ * aio_uring_attach().  While @ctx monitors file descriptors with io_uring,
+ * aio_poll() submits pending sqes together with waiting for events, so
+ * unless @now is true this does not make a system call.
+ *
+ * Returns: the number of sqes submitted by this call or a negative errno.
+ */
+int aio_uring_submit(AioContext *ctx, bool now);
+#endif
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -703,15 +800,30 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
  * @ctx: the aio context
  * @max_batch: maximum number of requests in a batch, 0 means that the
  *             engine will use its default
- */
-void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
+ * @sqpoll_idle_ms: idle time of the io_uring submission queue polling
+ *                  thread, 0 means that no polling thread is used.  Only
+ *                  takes effect if the io_uring engine has not been set up
+ *                  for @ctx yet.
+ * @unified_ring: let the io_uring engine submit requests on the ring that
+ *                @ctx uses to monitor file descriptors, if there is one and
+ *                @sqpoll_idle_ms is 0.  Only takes effect if the io_uring
+ *                engine has not been set up for @ctx yet.
+ */
+void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
+                                int64_t sqpoll_idle_ms, bool unified_ring);
 
 /**
  * aio_context_set_thread_pool_params:
  * @ctx: the aio context
  * @min: min number of threads to have readily available in the thread pool
  * @min: max number of threads the thread pool can contain
+ * @shared: run requests in worker threads that are shared with the other
+ *          AioContexts that set @shared.  Only takes effect if the thread
+ *          pool has not been created yet.
+ * @tc: thread context to create worker threads in, or NULL
  */
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
-                                        int64_t max, Error **errp);
+                                        int64_t max, bool shared,
+                                        struct ThreadContext *tc,
+                                        Error **errp);
 #endif
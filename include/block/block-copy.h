@@ -97,5 +97,8 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
+void block_copy_set_adaptive(BlockCopyState *s, bool adaptive);
+void block_copy_get_tuning(BlockCopyState *s, int64_t *chunk_size,
+                           int *max_workers, bool *copy_offload);
 
 #endif /* BLOCK_COPY_H */
@@ -65,12 +65,24 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(int64_t sqpoll_idle_ms, bool uring_cmd, Error **errp);
+LuringState *luring_init_shared(AioContext *ctx);
 void luring_cleanup(LuringState *s);
 
+bool luring_register_buf(void *host, size_t size, Error **errp);
+void luring_unregister_buf(void *host, size_t size);
+void luring_register_file(int fd);
+void luring_unregister_file(int fd);
+
 /* luring_co_submit: submit I/O requests in the thread's current AioContext. */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type);
+#ifdef HAVE_NVME_URING_CMD
+int coroutine_fn luring_co_submit_nvme(BlockDriverState *bs, int fd,
+                                       uint32_t nsid, unsigned lba_shift,
+                                       uint64_t offset, QEMUIOVector *qiov,
+                                       int type);
+#endif
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 #endif
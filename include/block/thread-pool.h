@@ -19,6 +19,7 @@
 #define QEMU_THREAD_POOL_H
 
 #include "block/aio.h"
+#include "qapi/qapi-types-misc.h"
 
 #define THREAD_POOL_MAX_THREADS_DEFAULT         64
 
@@ -40,4 +41,10 @@ void thread_pool_submit(ThreadPoolFunc *func, void *arg);
 
 void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
 
+/*
+ * Fill @stats with the current state and the cumulative statistics of
+ * @pool.  May be called from any thread.
+ */
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 #endif
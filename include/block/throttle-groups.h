@@ -29,6 +29,12 @@
 #include "qemu/throttle.h"
 #include "qom/object.h"
 
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     10000
+
+/* Number of bins in the per-member throttling delay histograms */
+#define THROTTLE_WAIT_HIST_BINS 7
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -57,6 +63,16 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[THROTTLE_MAX];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Weighted fair queuing state, also protected by the ThrottleGroup
+     * lock.  See throttle_group_set_member_params(). */
+    char          *name;
+    unsigned       weight;
+    uint64_t       reservation;     /* bytes per second */
+    int64_t        resv_credit;     /* bytes */
+    int64_t        resv_refill_ns;
+    uint64_t       vtime[THROTTLE_MAX];
+    uint64_t       wait_hist[THROTTLE_MAX][THROTTLE_WAIT_HIST_BINS];
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -74,6 +90,9 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
                                 AioContext *ctx);
 void throttle_group_unregister_tgm(ThrottleGroupMember *tgm);
+void throttle_group_set_member_params(ThrottleGroupMember *tgm,
+                                      const char *name, unsigned weight,
+                                      uint64_t reservation);
 void throttle_group_restart_tgm(ThrottleGroupMember *tgm);
 
 void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm,
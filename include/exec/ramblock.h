@@ -79,6 +79,15 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Write frequency tracking for the x-defer-hot-pages capability, one
+     * entry per chunk of guest pages: the number of consecutive dirty
+     * sync periods in which the chunk was sent, and the last such period.
+     * Only used on the source side, protected by ram_state.bitmap_mutex.
+     */
+    uint8_t *hot_hits;
+    uint32_t *hot_period;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
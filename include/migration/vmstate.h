@@ -198,6 +198,14 @@ struct VMStateDescription {
      * a QEMU_VM_SECTION_START section.
      */
     bool early_setup;
+    /*
+     * The device state can be saved concurrently with other devices,
+     * from a thread other than the migration thread, and sent over a
+     * multifd channel when the x-multifd-device-state capability is
+     * enabled.  Its pre_save(), needed() and field accessors must not
+     * depend on the state of other devices or take the BQL.
+     */
+    bool parallel_save;
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
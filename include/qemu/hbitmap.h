@@ -61,6 +61,44 @@ struct HBitmapIter {
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_compressed:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap, as for hbitmap_alloc.
+ *
+ * Allocate a new HBitmap whose last level only takes memory for the parts
+ * of the bitmap that are neither all clear nor all set.  This is meant for
+ * very large bitmaps that are mostly clean or mostly dirty.
+ */
+HBitmap *hbitmap_alloc_compressed(uint64_t size, int granularity);
+
+/**
+ * hbitmap_set_compressed:
+ * @hb: HBitmap to operate on.
+ * @compressed: Whether @hb should use the compressed representation.
+ *
+ * Switch @hb between the representations of hbitmap_alloc and
+ * hbitmap_alloc_compressed.  The contents are unchanged.
+ */
+void hbitmap_set_compressed(HBitmap *hb, bool compressed);
+
+/**
+ * hbitmap_is_compressed:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether @hb uses the compressed representation.
+ */
+bool hbitmap_is_compressed(const HBitmap *hb);
+
+/**
+ * hbitmap_memory_usage:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory used by @hb, not counting its meta
+ * bitmap.
+ */
+size_t hbitmap_memory_usage(const HBitmap *hb);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -603,6 +603,7 @@ int qemu_open(const char *name, int flags, Error **errp);
 int qemu_create(const char *name, int flags, mode_t mode, Error **errp);
 int qemu_close(int fd);
 int qemu_unlink(const char *name);
+bool qemu_has_direct_io(void);
 #ifndef _WIN32
 int qemu_dup_flags(int fd, int flags);
 int qemu_dup(int fd);
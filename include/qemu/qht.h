@@ -42,6 +42,29 @@ struct qht_stats {
     struct qdist occupancy;
 };
 
+/**
+ * struct qht_counters - Running counters of a QHT
+ * @head_buckets: number of head buckets
+ * @added_buckets: number of non-head buckets
+ * @entries: total number of entries
+ * @max_chain: number of buckets in the longest chain
+ * @resizes: number of times the hash table has been resized
+ * @migrating: number of head buckets that an ongoing automatic resize still
+ *             has to move to the new map; 0 if no resize is in progress.
+ *
+ * Unlike &struct qht_stats, these are maintained by the writers as they go,
+ * so reading them does not walk the buckets. They are not read atomically
+ * with respect to each other.
+ */
+struct qht_counters {
+    size_t head_buckets;
+    size_t added_buckets;
+    size_t entries;
+    size_t max_chain;
+    size_t resizes;
+    size_t migrating;
+};
+
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
 typedef void (*qht_iter_func_t)(void *p, uint32_t h, void *up);
 typedef bool (*qht_iter_bool_func_t)(void *p, uint32_t h, void *up);
@@ -166,6 +189,8 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * If an automatic resize is in progress, it is completed first.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
@@ -213,6 +238,16 @@ void qht_iter_remove(struct qht *ht, qht_iter_bool_func_t func, void *userp);
  */
 void qht_statistics_init(const struct qht *ht, struct qht_stats *stats);
 
+/**
+ * qht_counters_read - Read the running counters of a QHT
+ * @ht: QHT to read the counters of
+ * @counters: pointer to a &struct qht_counters to be filled in
+ *
+ * This is cheap enough to be called often, e.g. to monitor the hash table
+ * while it is in use. It can be called on a QHT that is all zeroes.
+ */
+void qht_counters_read(const struct qht *ht, struct qht_counters *counters);
+
 /**
  * qht_statistics_destroy - Destroy a &struct qht_stats
  * @stats: &struct qht_stats to be destroyed
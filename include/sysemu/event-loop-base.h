@@ -32,9 +32,13 @@ struct EventLoopBase {
 
     /* AioContext AIO engine parameters */
     int64_t aio_max_batch;
+    int64_t aio_sqpoll_idle_ms;
+    bool aio_unified_ring;
 
     /* AioContext thread pool parameters */
     int64_t thread_pool_min;
     int64_t thread_pool_max;
+    bool thread_pool_shared;
+    struct ThreadContext *thread_pool_context;
 };
 #endif
@@ -17,6 +17,7 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/event-loop-base.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
@@ -170,10 +171,14 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
     }
 
     aio_context_set_aio_params(iothread->ctx,
-                               iothread->parent_obj.aio_max_batch);
+                               iothread->parent_obj.aio_max_batch,
+                               iothread->parent_obj.aio_sqpoll_idle_ms,
+                               iothread->parent_obj.aio_unified_ring);
 
     aio_context_set_thread_pool_params(iothread->ctx, base->thread_pool_min,
-                                       base->thread_pool_max, errp);
+                                       base->thread_pool_max,
+                                       base->thread_pool_shared,
+                                       base->thread_pool_context, errp);
 }
 
 
@@ -344,6 +349,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    ThreadPool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -357,6 +363,17 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
+    /* Updated by the iothread without synchronization, fine for a report */
+    info->poll_ns = iothread->ctx->poll_ns;
+    info->poll_hits = stat64_get(&iothread->ctx->poll_hits);
+    info->poll_misses = stat64_get(&iothread->ctx->poll_misses);
+    info->poll_wasted_ns = stat64_get(&iothread->ctx->poll_wasted_ns);
+
+    pool = qatomic_load_acquire(&iothread->ctx->thread_pool);
+    if (pool) {
+        info->thread_pool = g_new0(ThreadPoolStats, 1);
+        thread_pool_get_stats(pool, info->thread_pool);
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
@@ -21,6 +21,11 @@
 
 #define OFFSET_OPTION ",offset="
 
+/* The direct-io parameter cannot be enabled on hosts without O_DIRECT */
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
 static struct FileOutgoingArgs {
     char *fname;
 } outgoing_args;
@@ -56,6 +61,14 @@ bool file_send_channel_create(gpointer opaque, Error **errp)
     int flags = O_WRONLY;
     bool ret = true;
 
+    if (migrate_direct_io()) {
+        /*
+         * The multifd channels only write page aligned buffers at page
+         * aligned file offsets, so they can bypass the page cache.
+         */
+        flags |= O_DIRECT;
+    }
+
     ioc = qio_channel_file_new_path(outgoing_args.fname, flags, 0, errp);
     if (!ioc) {
         ret = false;
@@ -109,13 +122,16 @@ static gboolean file_accept_incoming_migration(QIOChannel *ioc,
     return G_SOURCE_REMOVE;
 }
 
-void file_create_incoming_channels(QIOChannel *ioc, Error **errp)
+void file_create_incoming_channels(QIOChannel *ioc, const char *filename,
+                                   Error **errp)
 {
     int i, fd, channels = 1;
     g_autofree QIOChannel **iocs = NULL;
+    bool direct_io = false;
 
     if (migrate_multifd()) {
         channels += migrate_multifd_channels();
+        direct_io = migrate_direct_io();
     }
 
     iocs = g_new0(QIOChannel *, channels);
@@ -123,7 +139,21 @@ void file_create_incoming_channels(QIOChannel *ioc, Error **errp)
     iocs[0] = ioc;
 
     for (i = 1; i < channels; i++) {
-        QIOChannelFile *fioc = qio_channel_file_new_dupfd(fd, errp);
+        QIOChannelFile *fioc;
+
+        /*
+         * O_DIRECT is a property of the open file description, which
+         * duplicated descriptors share with the main channel.  Open
+         * the file again so that only the multifd channels, which
+         * read whole pages into page aligned guest memory, bypass the
+         * page cache.
+         */
+        if (direct_io) {
+            fioc = qio_channel_file_new_path(filename, O_RDONLY | O_DIRECT,
+                                             0, errp);
+        } else {
+            fioc = qio_channel_file_new_dupfd(fd, errp);
+        }
 
         if (!fioc) {
             while (i) {
@@ -163,7 +193,7 @@ void file_start_incoming_migration(FileMigrationArgs *file_args, Error **errp)
         return;
     }
 
-    file_create_incoming_channels(QIO_CHANNEL(fioc), errp);
+    file_create_incoming_channels(QIO_CHANNEL(fioc), filename, errp);
 }
 
 int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
@@ -186,6 +186,20 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->x_hot_pages) {
+        uint64List *level;
+
+        monitor_printf(mon, "hot page chunk size: %" PRIu64 " bytes\n",
+                       info->x_hot_pages->chunk_size);
+        monitor_printf(mon, "hot page histogram:");
+        for (level = info->x_hot_pages->histogram; level; level = level->next) {
+            monitor_printf(mon, " %" PRIu64, level->value);
+        }
+        monitor_printf(mon, "\n");
+        monitor_printf(mon, "hot page deferrals: %" PRIu64 "\n",
+                       info->x_hot_pages->deferred);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -217,6 +231,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->x_postcopy_prefetch) {
+        monitor_printf(mon, "postcopy prefetch streams: %" PRIu64 "\n",
+                       info->x_postcopy_prefetch->streams);
+        monitor_printf(mon, "postcopy prefetch requested: %" PRIu64
+                       " pages\n", info->x_postcopy_prefetch->requested);
+        monitor_printf(mon, "postcopy prefetch hits: %" PRIu64 " pages\n",
+                       info->x_postcopy_prefetch->hits);
+        monitor_printf(mon, "postcopy prefetch late: %" PRIu64 " pages\n",
+                       info->x_postcopy_prefetch->late);
+    }
+
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -397,6 +423,13 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MODE),
             qapi_enum_lookup(&MigMode_lookup, params->mode));
+
+        if (params->has_direct_io) {
+            monitor_printf(mon, "%s: %s\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_DIRECT_IO),
+                           params->direct_io ? "on" : "off");
+        }
     }
 
     qapi_free_MigrationParameters(params);
@@ -690,6 +723,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_mode = true;
         visit_type_MigMode(v, param, &p->mode, &err);
         break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
     default:
         assert(0);
     }
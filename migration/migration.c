@@ -425,17 +425,17 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return qemu_fflush(mis->to_src_file);
 }
 
-/* Request one page from the source VM at the given start address.
+/* Request pages from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -495,7 +495,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
 }
 
 static bool migration_colo_enabled;
@@ -1179,6 +1180,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     }
 
     populate_compress(info);
+    populate_hot_pages(info);
 
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
@@ -1300,16 +1302,20 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
-    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_FAILED:
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
         break;
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+        info->has_status = true;
+        populate_postcopy_prefetch(info);
+        break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        populate_postcopy_prefetch(info);
         break;
     }
     info->status = mis->state;
@@ -3825,6 +3831,12 @@ static bool migration_object_check(MigrationState *ms, Error **errp)
     /* Assuming all off */
     bool old_caps[MIGRATION_CAPABILITY__MAX] = { 0 };
 
+    if (ms->bitmap_sync_threads > MIGRATION_BITMAP_SYNC_THREADS_MAX) {
+        error_setg(errp, "x-bitmap-sync-threads must be at most %d",
+                   MIGRATION_BITMAP_SYNC_THREADS_MAX);
+        return false;
+    }
+
     if (!migrate_params_check(&ms->parameters, errp)) {
         return false;
     }
@@ -19,6 +19,7 @@
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qmp/json-writer.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qemu/coroutine_int.h"
 #include "io/channel.h"
 #include "io/channel-buffer.h"
@@ -67,6 +68,33 @@ typedef struct {
     bool all_zero;
 } PostcopyTmpPage;
 
+/*
+ * Postcopy page prefetcher state.  The detector fields are only used by
+ * the fault thread, the counters are also read by query-migrate.
+ */
+typedef struct {
+    /* RAMBlock and offset of the last page fault */
+    RAMBlock *rb;
+    ram_addr_t last;
+    /* Distance in bytes between the last faults, 0 if not a stream */
+    ram_addr_t stride;
+    /* Number of consecutive faults that were @stride apart */
+    unsigned int streak;
+    /*
+     * Stream pages from @start (included) to @end (excluded) have been
+     * requested, but the guest has not faulted past them yet.
+     */
+    ram_addr_t start;
+    ram_addr_t end;
+    /* Number of pages to request ahead of the last fault */
+    unsigned int window;
+
+    Stat64 streams;
+    Stat64 requested;
+    Stat64 hits;
+    Stat64 late;
+} PostcopyPrefetch;
+
 typedef enum {
     PREEMPT_THREAD_NONE = 0,
     PREEMPT_THREAD_CREATED,
@@ -179,6 +207,9 @@ struct MigrationIncomingState {
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
 
+    /* Only used with the x-postcopy-prefetch capability */
+    PostcopyPrefetch prefetch;
+
     /* notify PAUSED postcopy incoming migrations to try to continue */
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
@@ -236,6 +267,7 @@ void migration_incoming_transport_cleanup(MigrationIncomingState *mis);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void populate_postcopy_prefetch(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
@@ -248,6 +280,9 @@ struct MigrationClass {
     DeviceClass parent_class;
 };
 
+/* Maximum value of the x-bitmap-sync-threads property */
+#define MIGRATION_BITMAP_SYNC_THREADS_MAX 64
+
 struct MigrationState {
     /*< private >*/
     DeviceState parent_obj;
@@ -450,6 +485,17 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Number of threads used to sync the dirty bitmap of all RAMBlocks at
+     * the start of each iteration.  Guest RAM is split into ranges that
+     * are handed out to the threads; threads syncing memory that belongs
+     * to a memory backend with a "prealloc-context" are created in that
+     * thread context, so that they run on CPUs close to the memory.
+     * 0 or 1 means the migration thread syncs all blocks by itself.
+     * The threads live as long as the migration.
+     */
+    uint8_t bitmap_sync_threads;
+
     /*
      * This save hostname when out-going migration starts
      */
@@ -502,7 +548,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,104 @@
+/*
+ * Multifd device state transfer, destination side.
+ *
+ * Device state that the source saved in parallel arrives on the multifd
+ * channels in any order.  The receive threads park it here until the
+ * main migration stream reaches the matching section and loads it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "multifd.h"
+#include "trace.h"
+
+static struct {
+    QemuMutex lock;
+    QemuCond cond;
+    /* section_id -> QIOChannelBuffer */
+    GHashTable *buffers;
+    /* set when receiving failed; no more buffers will arrive */
+    bool aborted;
+} *recv_state;
+
+void multifd_device_state_recv_setup(void)
+{
+    assert(!recv_state);
+    recv_state = g_new0(typeof(*recv_state), 1);
+    qemu_mutex_init(&recv_state->lock);
+    qemu_cond_init(&recv_state->cond);
+    recv_state->buffers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL, object_unref);
+}
+
+void multifd_device_state_recv_cleanup(void)
+{
+    if (!recv_state) {
+        return;
+    }
+    g_hash_table_destroy(recv_state->buffers);
+    qemu_cond_destroy(&recv_state->cond);
+    qemu_mutex_destroy(&recv_state->lock);
+    g_free(recv_state);
+    recv_state = NULL;
+}
+
+void multifd_device_state_recv_abort(void)
+{
+    if (!recv_state) {
+        return;
+    }
+    WITH_QEMU_LOCK_GUARD(&recv_state->lock) {
+        recv_state->aborted = true;
+        qemu_cond_broadcast(&recv_state->cond);
+    }
+}
+
+/*
+ * Called by the receive threads.  Takes ownership of @bioc on success.
+ */
+bool multifd_device_state_recv_buffer(uint32_t section_id,
+                                      QIOChannelBuffer *bioc, Error **errp)
+{
+    gpointer key = GUINT_TO_POINTER(section_id);
+
+    QEMU_LOCK_GUARD(&recv_state->lock);
+
+    if (g_hash_table_contains(recv_state->buffers, key)) {
+        error_setg(errp, "multifd: duplicate device state for section %u",
+                   section_id);
+        return false;
+    }
+    g_hash_table_insert(recv_state->buffers, key, bioc);
+    qemu_cond_broadcast(&recv_state->cond);
+    return true;
+}
+
+/*
+ * Waits until the device state of the given main stream section has
+ * been received and returns it.  The caller owns the returned buffer.
+ */
+QIOChannelBuffer *multifd_device_state_recv_wait(uint32_t section_id,
+                                                 Error **errp)
+{
+    gpointer key = GUINT_TO_POINTER(section_id);
+    gpointer bioc = NULL;
+
+    trace_multifd_device_state_recv_wait(section_id);
+
+    QEMU_LOCK_GUARD(&recv_state->lock);
+
+    while (!g_hash_table_steal_extended(recv_state->buffers, key,
+                                        NULL, &bioc)) {
+        if (recv_state->aborted) {
+            error_setg(errp, "multifd: channels failed before device state "
+                       "for section %u arrived", section_id);
+            return NULL;
+        }
+        qemu_cond_wait(&recv_state->cond, &recv_state->lock);
+    }
+    return bioc;
+}
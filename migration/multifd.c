@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -38,6 +39,19 @@
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
 
+/*
+ * Adaptive scheduling (x-multifd-adaptive).
+ *
+ * Batches are sized so that the fastest active channel needs roughly
+ * MULTIFD_ADAPTIVE_TARGET_NS to push one of them, never going below
+ * MULTIFD_ADAPTIVE_MIN_PAGES.  A channel is dropped from the active set
+ * after MULTIFD_ADAPTIVE_IDLE_STREAK consecutive sends during which at
+ * least two other active channels were sitting idle.
+ */
+#define MULTIFD_ADAPTIVE_TARGET_NS      (2 * SCALE_MS)
+#define MULTIFD_ADAPTIVE_MIN_PAGES      16
+#define MULTIFD_ADAPTIVE_IDLE_STREAK    64
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -79,6 +93,25 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /*
+     * Number of pages queued before a batch is handed to a channel.
+     * Always equal to the packet capacity unless x-multifd-adaptive
+     * is enabled.  Only accessed by the migration thread.
+     */
+    uint32_t batch_pages;
+    /*
+     * Channels [0, active_channels) are preferred when picking a
+     * channel in adaptive mode.  Only accessed by the migration thread.
+     */
+    int active_channels;
+    /* consecutive sends that found spare idle channels */
+    unsigned int idle_streak;
+    /*
+     * Serializes multifd_queue_device_state() callers, which may be
+     * any thread.  RAM pages are only queued by the migration thread
+     * and never while device state is being saved.
+     */
+    QemuMutex device_state_mutex;
 } *multifd_send_state;
 
 struct {
@@ -554,6 +587,96 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
     qemu_sem_post(&multifd_send_state->channels_ready);
 }
 
+/*
+ * Size the next batch after the per-page cost of channel @p, so that
+ * slow channels (compression, TLS, congested links) get smaller packets
+ * and fast ones get full packets.
+ */
+static void multifd_send_adapt_batch(MultiFDSendParams *p)
+{
+    uint32_t cost = qatomic_read(&p->page_cost_ns);
+    uint32_t batch = p->page_count;
+
+    if (cost) {
+        batch = MIN(MULTIFD_ADAPTIVE_TARGET_NS / cost, p->page_count);
+        batch = MAX(batch, MIN(MULTIFD_ADAPTIVE_MIN_PAGES, p->page_count));
+    }
+    multifd_send_state->batch_pages = batch;
+}
+
+/*
+ * Pick an idle channel for the next batch in adaptive mode.
+ *
+ * Among the idle channels in the active set, the one with the lowest
+ * measured per-page cost wins.  If every active channel is busy, the
+ * active set is grown and an idle channel outside of it is used; if
+ * spare channels keep being idle, the active set is shrunk.
+ *
+ * Must be called after consuming one count of channels_ready, which
+ * guarantees that at least one channel is idle.
+ *
+ * Returns NULL if migration is exiting.
+ */
+static MultiFDSendParams *multifd_send_pick_adaptive(void)
+{
+    int channels = migrate_multifd_channels();
+    MultiFDSendParams *best = NULL, *spare = NULL;
+    int idle = 0;
+    int i;
+
+    multifd_send_state->active_channels =
+        MIN(MAX(multifd_send_state->active_channels, 1), channels);
+
+    for (i = 0; i < channels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (multifd_send_should_exit()) {
+            return NULL;
+        }
+        /* Same lockless rule as in multifd_send_pick_channel() */
+        if (qatomic_read(&p->pending_job)) {
+            continue;
+        }
+        if (i >= multifd_send_state->active_channels) {
+            if (!spare) {
+                spare = p;
+            }
+            continue;
+        }
+        idle++;
+        if (!best || qatomic_read(&p->page_cost_ns) <
+                     qatomic_read(&best->page_cost_ns)) {
+            best = p;
+        }
+    }
+
+    if (!best) {
+        if (!spare) {
+            /* Only possible if we were kicked because of an error */
+            return NULL;
+        }
+        /* All active channels are busy: bring one more into play */
+        best = spare;
+        multifd_send_state->active_channels = MIN(best->id + 1, channels);
+        multifd_send_state->idle_streak = 0;
+    } else if (idle > 2) {
+        if (++multifd_send_state->idle_streak >= MULTIFD_ADAPTIVE_IDLE_STREAK &&
+            multifd_send_state->active_channels > 1) {
+            multifd_send_state->active_channels--;
+            multifd_send_state->idle_streak = 0;
+        }
+    } else {
+        multifd_send_state->idle_streak = 0;
+    }
+
+    multifd_send_adapt_batch(best);
+    trace_multifd_send_adaptive(best->id, qatomic_read(&best->page_cost_ns),
+                                multifd_send_state->active_channels,
+                                multifd_send_state->batch_pages);
+
+    return best;
+}
+
 /*
  * How we use multifd_send_state->pages and channel->pages?
  *
@@ -573,20 +696,28 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
  *
  * Returns true if succeed, false otherwise.
  */
-static bool multifd_send_pages(void)
+/*
+ * Waits for an idle channel and returns it, or NULL if multifd is
+ * exiting.  The caller owns the channel until it sets pending_job.
+ */
+static MultiFDSendParams *multifd_send_pick_channel(void)
 {
     int i;
     static int next_channel;
-    MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
 
     if (multifd_send_should_exit()) {
-        return false;
+        return NULL;
     }
 
     /* We wait here, until at least one channel is ready */
     qemu_sem_wait(&multifd_send_state->channels_ready);
 
+    if (migrate_multifd_adaptive()) {
+        p = multifd_send_pick_adaptive();
+        goto found;
+    }
+
     /*
      * next_channel can remain from a previous migration that was
      * using more channels, so ensure it doesn't overflow if the
@@ -595,7 +726,7 @@ static bool multifd_send_pages(void)
     next_channel %= migrate_multifd_channels();
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_send_should_exit()) {
-            return false;
+            return NULL;
         }
         p = &multifd_send_state->params[i];
         /*
@@ -608,11 +739,25 @@ static bool multifd_send_pages(void)
         }
     }
 
+found:
     /*
      * Make sure we read p->pending_job before all the rest.  Pairs with
      * qatomic_store_release() in multifd_send_thread().
      */
     smp_mb_acquire();
+    return p;
+}
+
+static bool multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    p = multifd_send_pick_channel();
+    if (!p) {
+        return false;
+    }
+
     assert(!p->pages->num);
     multifd_send_state->pages = p->pages;
     p->pages = pages;
@@ -633,7 +778,7 @@ static inline bool multifd_queue_empty(MultiFDPages_t *pages)
 
 static inline bool multifd_queue_full(MultiFDPages_t *pages)
 {
-    return pages->num == pages->allocated;
+    return pages->num >= multifd_send_state->batch_pages;
 }
 
 static inline void multifd_enqueue(MultiFDPages_t *pages, ram_addr_t offset)
@@ -676,6 +821,94 @@ retry:
     return true;
 }
 
+/*
+ * Queues the saved state of one device for sending on a multifd
+ * channel.  Can be called from any thread; takes ownership of @buf.
+ *
+ * Returns true if queued, false if multifd is exiting.
+ */
+bool multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                                uint32_t section_id, char *buf, size_t len)
+{
+    MultiFDSendParams *p;
+    MultiFDDeviceState_t *state;
+
+    assert(multifd_use_packets());
+
+    QEMU_LOCK_GUARD(&multifd_send_state->device_state_mutex);
+
+    p = multifd_send_pick_channel();
+    if (!p) {
+        g_free(buf);
+        return false;
+    }
+
+    state = g_new0(MultiFDDeviceState_t, 1);
+    state->idstr = g_strdup(idstr);
+    state->instance_id = instance_id;
+    state->section_id = section_id;
+    state->buf = buf;
+    state->buf_len = len;
+
+    trace_multifd_queue_device_state(p->id, idstr, instance_id, len);
+
+    assert(!p->device_state);
+    p->device_state = state;
+    /* Pairs with the qatomic_load_acquire() in multifd_send_thread() */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
+static void multifd_device_state_free(MultiFDDeviceState_t *state)
+{
+    if (state) {
+        g_free(state->idstr);
+        g_free(state->buf);
+        g_free(state);
+    }
+}
+
+static int multifd_send_device_state(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDDeviceState_t *state = p->device_state;
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    struct iovec iov[2];
+    int ret;
+
+    if (state->buf_len > UINT32_MAX) {
+        error_setg(errp, "multifd %u: device state of '%s' too large: %zu",
+                   p->id, state->idstr, state->buf_len);
+        return -1;
+    }
+
+    memset(packet, 0, sizeof(*packet));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(MULTIFD_FLAG_DEVICE_STATE);
+    packet->instance_id = cpu_to_be32(state->instance_id);
+    packet->section_id = cpu_to_be32(state->section_id);
+    packet->next_packet_size = cpu_to_be32(state->buf_len);
+    pstrcpy(packet->idstr, sizeof(packet->idstr), state->idstr);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(*packet);
+    iov[1].iov_base = state->buf;
+    iov[1].iov_len = state->buf_len;
+
+    ret = qio_channel_writev_all(p->c, iov, 2, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    trace_multifd_send_device_state(p->id, state->idstr, state->instance_id,
+                                    state->buf_len);
+    stat64_add(&mig_stats.multifd_bytes, sizeof(*packet) + state->buf_len);
+    p->packets_sent++;
+    return 0;
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -782,6 +1015,10 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
+    multifd_device_state_free(p->device_state);
+    p->device_state = NULL;
     g_free(p->iov);
     p->iov = NULL;
     multifd_send_state->ops->send_cleanup(p, errp);
@@ -795,6 +1032,7 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_mutex_destroy(&multifd_send_state->device_state_mutex);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -897,6 +1135,23 @@ int multifd_send_sync_main(void)
     return 0;
 }
 
+/*
+ * Fold the time spent preparing and writing @num pages into the channel's
+ * moving average of per-page cost (1/8 weight for the new sample).
+ */
+static void multifd_send_update_cost(MultiFDSendParams *p, uint32_t num,
+                                     int64_t elapsed_ns)
+{
+    uint32_t sample = MIN(MAX(elapsed_ns, 0) / num, UINT32_MAX);
+    uint32_t cost = qatomic_read(&p->page_cost_ns);
+
+    if (cost) {
+        sample = cost - cost / 8 + sample / 8;
+    }
+    /* Zero means "not measured yet" */
+    qatomic_set(&p->page_cost_ns, MAX(sample, 1));
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -904,6 +1159,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_packets = multifd_use_packets();
+    bool adaptive = migrate_multifd_adaptive();
 
     thread = migration_threads_add(p->name, qemu_get_thread_id());
 
@@ -929,12 +1185,26 @@ static void *multifd_send_thread(void *opaque)
          * Read pending_job flag before p->pages.  Pairs with the
          * qatomic_store_release() in multifd_send_pages().
          */
-        if (qatomic_load_acquire(&p->pending_job)) {
+        if (qatomic_load_acquire(&p->pending_job) && p->device_state) {
+            ret = multifd_send_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+            multifd_device_state_free(p->device_state);
+            p->device_state = NULL;
+            /* Pairs with the smp_mb_acquire() in multifd_send_pick_channel() */
+            qatomic_store_release(&p->pending_job, false);
+        } else if (qatomic_load_acquire(&p->pending_job)) {
             MultiFDPages_t *pages = p->pages;
+            int64_t start = 0;
 
             p->iovs_num = 0;
             assert(pages->num);
 
+            if (adaptive) {
+                start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            }
+
             ret = multifd_send_state->ops->send_prepare(p, &local_err);
             if (ret != 0) {
                 break;
@@ -953,6 +1223,11 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            if (adaptive) {
+                multifd_send_update_cost(p, pages->num,
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+            }
+
             stat64_add(&mig_stats.multifd_bytes,
                        p->next_packet_size + p->packet_len);
             stat64_add(&mig_stats.normal_pages, pages->normal_num);
@@ -1161,8 +1436,12 @@ bool multifd_send_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_mutex_init(&multifd_send_state->device_state_mutex);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->batch_pages = page_count;
+    /* Adaptive mode starts with all channels and sheds the idle ones */
+    multifd_send_state->active_channels = thread_count;
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1178,6 +1457,7 @@ bool multifd_send_setup(void)
             p->packet = g_malloc0(p->packet_len);
             p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
             p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+            p->packet_device_state = g_new0(MultiFDPacketDeviceState_t, 1);
 
             /* We need one extra place for the packet header */
             p->iov = g_new0(struct iovec, page_count + 1);
@@ -1294,6 +1574,9 @@ static void multifd_recv_terminate_threads(Error *err)
         }
     }
 
+    /* Don't leave the migration thread waiting for device state */
+    multifd_device_state_recv_abort();
+
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1352,6 +1635,8 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
     g_free(p->iov);
     p->iov = NULL;
     g_free(p->normal);
@@ -1390,6 +1675,7 @@ void multifd_recv_cleanup(void)
     for (i = 0; i < migrate_multifd_channels(); i++) {
         multifd_recv_cleanup_channel(&multifd_recv_state->params[i]);
     }
+    multifd_device_state_recv_cleanup();
     multifd_recv_cleanup_state();
 }
 
@@ -1455,6 +1741,63 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Reads a device state packet whose header is already in p->packet
+ * and hands the state over to the migration thread.
+ */
+static int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    size_t hdr_len = sizeof(MultiFDPacketHdr_t);
+    QIOChannelBuffer *bioc;
+    uint32_t instance_id, section_id, len;
+    char idstr[256];
+
+    memcpy(packet, p->packet, hdr_len);
+    if (qio_channel_read_all(p->c, (char *)packet + hdr_len,
+                             sizeof(*packet) - hdr_len, errp)) {
+        return -1;
+    }
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x, expected %x",
+                   be32_to_cpu(packet->magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(packet->version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %u, expected %u",
+                   be32_to_cpu(packet->version), MULTIFD_VERSION);
+        return -1;
+    }
+    if (!migrate_multifd_device_state()) {
+        error_setg(errp, "multifd: received device state packet but "
+                   "x-multifd-device-state is disabled");
+        return -1;
+    }
+
+    pstrcpy(idstr, sizeof(idstr), packet->idstr);
+    instance_id = be32_to_cpu(packet->instance_id);
+    section_id = be32_to_cpu(packet->section_id);
+    len = be32_to_cpu(packet->next_packet_size);
+
+    bioc = qio_channel_buffer_new(len);
+    if (qio_channel_read_all(p->c, bioc->data, len, errp)) {
+        object_unref(OBJECT(bioc));
+        return -1;
+    }
+    bioc->usage = len;
+
+    trace_multifd_recv_device_state(p->id, idstr, instance_id, len);
+    p->packets_recved++;
+
+    /* The table takes our reference on success */
+    if (!multifd_device_state_recv_buffer(section_id, bioc, errp)) {
+        object_unref(OBJECT(bioc));
+        return -1;
+    }
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1476,11 +1819,30 @@ static void *multifd_recv_thread(void *opaque)
             }
 
             ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
-                                           p->packet_len, &local_err);
+                                           sizeof(MultiFDPacketHdr_t),
+                                           &local_err);
             if (ret == 0 || ret == -1) {   /* 0: EOF  -1: Error */
                 break;
             }
 
+            if (be32_to_cpu(p->packet->flags) & MULTIFD_FLAG_DEVICE_STATE) {
+                ret = multifd_recv_device_state(p, &local_err);
+                if (ret) {
+                    break;
+                }
+                continue;
+            }
+
+            ret = qio_channel_read_all(p->c,
+                                       (char *)p->packet +
+                                       sizeof(MultiFDPacketHdr_t),
+                                       p->packet_len -
+                                       sizeof(MultiFDPacketHdr_t),
+                                       &local_err);
+            if (ret) {
+                break;
+            }
+
             qemu_mutex_lock(&p->mutex);
             ret = multifd_recv_unfill_packet(p, &local_err);
             if (ret) {
@@ -1582,6 +1944,7 @@ int multifd_recv_setup(Error **errp)
     qatomic_set(&multifd_recv_state->exiting, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_device_state_recv_setup();
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1599,6 +1962,7 @@ int multifd_recv_setup(Error **errp)
             p->packet_len = sizeof(MultiFDPacket_t)
                 + sizeof(uint64_t) * page_count;
             p->packet = g_malloc0(p->packet_len);
+            p->packet_device_state = g_new0(MultiFDPacketDeviceState_t, 1);
         }
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
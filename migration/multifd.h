@@ -14,6 +14,7 @@
 #define QEMU_MIGRATION_MULTIFD_H
 
 #include "ram.h"
+#include "io/channel-buffer.h"
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 
@@ -28,6 +29,8 @@ void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 int multifd_send_sync_main(void);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+bool multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                                uint32_t section_id, char *buf, size_t len);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
@@ -41,9 +44,19 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 
+/* The packet carries device state instead of RAM pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 6)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
+/* Common start of all packets, used to tell their kind apart */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+} __attribute__((packed)) MultiFDPacketHdr_t;
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -68,6 +81,28 @@ typedef struct {
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t instance_id;
+    /* section of the main stream that the state belongs to */
+    uint32_t section_id;
+    /* size of the device state buffer that follows */
+    uint32_t next_packet_size;
+    uint64_t unused64[2];    /* Reserved for future use */
+    char idstr[256];
+} __attribute__((packed)) MultiFDPacketDeviceState_t;
+
+/* Saved state of one device, waiting for a channel to send it */
+typedef struct {
+    char *idstr;
+    uint32_t instance_id;
+    uint32_t section_id;
+    char *buf;
+    size_t buf_len;
+} MultiFDDeviceState_t;
+
 typedef struct {
     /* number of used pages */
     uint32_t num;
@@ -135,11 +170,18 @@ typedef struct {
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /*
+     * Device state to send instead of 'pages', owned the same way as
+     * 'pages' is.  NULL for RAM jobs.
+     */
+    MultiFDDeviceState_t *device_state;
 
     /* thread local variables. No locking required */
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
+    /* header of device state packets */
+    MultiFDPacketDeviceState_t *packet_device_state;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     /* packets sent through this channel */
@@ -148,6 +190,12 @@ typedef struct {
     uint64_t total_normal_pages;
     /* zero pages sent through this channel */
     uint64_t total_zero_pages;
+    /*
+     * Moving average of the time needed to prepare and write one page,
+     * in nanoseconds; zero until the first batch has been sent.  Written
+     * by the channel thread, read by the migration thread.
+     */
+    uint32_t page_cost_ns;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
@@ -196,6 +244,8 @@ typedef struct {
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
+    /* header of device state packets */
+    MultiFDPacketDeviceState_t *packet_device_state;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     /* packets received through this channel */
@@ -252,4 +302,13 @@ static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 
+/* multifd-device-state.c */
+void multifd_device_state_recv_setup(void);
+void multifd_device_state_recv_cleanup(void);
+void multifd_device_state_recv_abort(void);
+bool multifd_device_state_recv_buffer(uint32_t section_id,
+                                      QIOChannelBuffer *bioc, Error **errp);
+QIOChannelBuffer *multifd_device_state_recv_wait(uint32_t section_id,
+                                                 Error **errp);
+
 #endif
@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -96,6 +97,27 @@ void postcopy_thread_create(MigrationIncomingState *mis,
     qemu_sem_destroy(&mis->thread_sync_sem);
 }
 
+/*
+ * Fill in the statistics of the postcopy page prefetcher, if enabled.
+ *
+ * @info: pointer to MigrationInfo to populate
+ */
+void populate_postcopy_prefetch(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyPrefetch *pf = &mis->prefetch;
+
+    if (!migrate_postcopy_prefetch()) {
+        return;
+    }
+
+    info->x_postcopy_prefetch = g_malloc0(sizeof(*info->x_postcopy_prefetch));
+    info->x_postcopy_prefetch->streams = stat64_get(&pf->streams);
+    info->x_postcopy_prefetch->requested = stat64_get(&pf->requested);
+    info->x_postcopy_prefetch->hits = stat64_get(&pf->hits);
+    info->x_postcopy_prefetch->late = stat64_get(&pf->late);
+}
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -783,6 +805,146 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
     return migrate_send_rp_req_pages(mis, rb, start, haddr);
 }
 
+/*
+ * Postcopy page prefetch
+ *
+ * Guests that walk memory (zeroing, copying, scanning) fault on one page
+ * after the other, and pay one round trip to the source for each of
+ * them.  Once POSTCOPY_PREFETCH_STREAK faults in a row were the same
+ * small forward stride apart, the next @window pages of that stream are
+ * requested right after the faulting one.  When the guest faults again
+ * at the end of, or inside, the prefetched range the stream is still
+ * going and the window doubles, up to POSTCOPY_PREFETCH_MAX_BYTES; any
+ * other fault ends the stream.
+ *
+ * Prefetched pages are not added to the page_requested tree: nothing
+ * waits for them, and the source silently skips those it already sent.
+ */
+#define POSTCOPY_PREFETCH_STREAK        2
+#define POSTCOPY_PREFETCH_MAX_STRIDE    16      /* host pages */
+#define POSTCOPY_PREFETCH_MIN_PAGES     4
+#define POSTCOPY_PREFETCH_MAX_BYTES     (4 * MiB)
+
+static void postcopy_prefetch_reset(PostcopyPrefetch *pf, RAMBlock *rb,
+                                    ram_addr_t offset)
+{
+    pf->rb = rb;
+    pf->last = offset;
+    pf->stride = 0;
+    pf->streak = 0;
+    pf->start = pf->end = 0;
+}
+
+static unsigned int postcopy_prefetch_max_pages(RAMBlock *rb)
+{
+    return MAX(1, POSTCOPY_PREFETCH_MAX_BYTES / qemu_ram_pagesize(rb));
+}
+
+/*
+ * Update the stream detector with a page fault at @offset of @rb, and
+ * request the pages the guest is expected to touch next.  Must be called
+ * in the fault thread, after the faulting page has been requested.
+ *
+ * Prefetching is best effort: if the return path is broken, the next
+ * page request notices it and pauses the fault thread.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    PostcopyPrefetch *pf = &mis->prefetch;
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t addr, end, run_start = 0, run_len = 0;
+    uint64_t requested = 0;
+
+    if (rb != pf->rb) {
+        postcopy_prefetch_reset(pf, rb, offset);
+        return;
+    }
+
+    /* Several vCPUs faulted on the same page */
+    if (offset == pf->last) {
+        return;
+    }
+
+    if (pf->end > pf->start) {
+        /* A stream is active, did the guest keep following it? */
+        if (offset < pf->start || offset > pf->end ||
+            (offset - pf->start) % pf->stride) {
+            trace_postcopy_prefetch_stream_end(rb->idstr, offset,
+                                               pf->start, pf->end);
+            postcopy_prefetch_reset(pf, rb, offset);
+            return;
+        }
+
+        stat64_add(&pf->hits, (offset - pf->start) / pf->stride);
+        if (offset < pf->end) {
+            /* The guest caught up with pages still in flight */
+            stat64_add(&pf->late, 1);
+        }
+        pf->window = MIN(pf->window * 2, postcopy_prefetch_max_pages(rb));
+    } else {
+        if (offset > pf->last && offset - pf->last == pf->stride) {
+            pf->streak++;
+        } else if (offset > pf->last &&
+                   offset - pf->last <= POSTCOPY_PREFETCH_MAX_STRIDE *
+                                        pagesize) {
+            pf->stride = offset - pf->last;
+            pf->streak = 1;
+        } else {
+            pf->stride = 0;
+            pf->streak = 0;
+        }
+        pf->last = offset;
+
+        if (pf->streak < POSTCOPY_PREFETCH_STREAK) {
+            return;
+        }
+
+        stat64_add(&pf->streams, 1);
+        pf->window = MIN(POSTCOPY_PREFETCH_MIN_PAGES,
+                         postcopy_prefetch_max_pages(rb));
+        pf->end = offset + pf->stride;
+        trace_postcopy_prefetch_stream_start(rb->idstr, offset, pf->stride);
+    }
+
+    pf->last = offset;
+    pf->start = offset + pf->stride;
+    end = offset + (pf->window + 1) * pf->stride;
+
+    /*
+     * Pages of a sequential stream are coalesced into as few requests as
+     * possible; pages already received or discarded are left out.
+     */
+    for (addr = MAX(pf->start, pf->end);
+         addr < end && addr < rb->used_length;
+         addr += pf->stride) {
+        if (ramblock_recv_bitmap_test_byte_offset(rb, addr) ||
+            ramblock_page_is_discarded(rb, addr)) {
+            continue;
+        }
+        if (run_len && run_start + run_len == addr) {
+            run_len += pagesize;
+        } else {
+            if (run_len &&
+                migrate_send_rp_message_req_pages(mis, rb, run_start,
+                                                  run_len)) {
+                run_len = 0;
+                break;
+            }
+            run_start = addr;
+            run_len = pagesize;
+        }
+        requested++;
+    }
+    if (run_len) {
+        migrate_send_rp_message_req_pages(mis, rb, run_start, run_len);
+    }
+    pf->end = addr;
+
+    stat64_add(&pf->requested, requested);
+    trace_postcopy_prefetch(rb->idstr, offset, pf->window, requested);
+}
+
 /*
  * Callback from shared fault handlers to ask for a page,
  * the page must be specified by a RAMBlock and an offset in that rb
@@ -972,6 +1134,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    postcopy_prefetch_reset(&mis->prefetch, NULL, 0);
     qemu_sem_post(&mis->thread_sync_sem);
 
     struct pollfd *pfd;
@@ -1092,6 +1255,10 @@ retry:
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+
+            if (migrate_postcopy_prefetch()) {
+                postcopy_prefetch(mis, rb, rb_offset);
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
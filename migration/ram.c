@@ -65,6 +65,8 @@
 #include "sysemu/kvm.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
+#include "sysemu/hostmem.h"
+#include "qemu/thread-context.h"
 
 #if defined(__linux__)
 #include "qemu/userfaultfd.h"
@@ -350,6 +352,8 @@ struct RAMSrcPageRequest {
 };
 
 /* State of RAM for migration */
+typedef struct BitmapSyncThread BitmapSyncThread;
+
 struct RAMState {
     /*
      * PageSearchStatus structures for the channels when send pages.
@@ -386,6 +390,15 @@ struct RAMState {
     /* Are we on the last stage of migration */
     bool last_stage;
 
+    /* Dirty sync period, bumped at every bitmap sync */
+    uint32_t hot_period;
+    /* Were hot chunks skipped since the last bitmap sync */
+    bool hot_skipped;
+    /* Are hot chunks being sent, as no cold page is left in this period */
+    bool hot_flushing;
+    /* Number of times a hot chunk was skipped */
+    uint64_t hot_deferred;
+
     /* total handled target pages at the beginning of period */
     uint64_t target_page_count_prev;
     /* total handled target pages since start */
@@ -412,6 +425,12 @@ struct RAMState {
      * RAM migration.
      */
     unsigned int postcopy_bmap_sync_requested;
+
+    /* Dirty bitmap sync threads, kept for the whole migration */
+    BitmapSyncThread *bitmap_sync_threads;
+    int nr_bitmap_sync_threads;
+    /* Posted by each sync thread when it is done with its ranges */
+    QemuSemaphore bitmap_sync_done;
 };
 typedef struct RAMState RAMState;
 
@@ -697,6 +716,106 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * Guest memory write frequency is tracked for chunks of
+ * (1 << RAM_HOT_CHUNK_SHIFT) target pages.  A chunk that was sent in
+ * at least RAM_HOT_THRESHOLD consecutive dirty sync periods is hot.
+ */
+#define RAM_HOT_CHUNK_SHIFT 9
+#define RAM_HOT_THRESHOLD   3
+#define RAM_HOT_HISTOGRAM_SIZE 8
+
+static unsigned long ramblock_hot_chunks(RAMBlock *rb)
+{
+    return DIV_ROUND_UP(rb->max_length >> TARGET_PAGE_BITS,
+                        1UL << RAM_HOT_CHUNK_SHIFT);
+}
+
+/*
+ * Returns the number of consecutive periods, up to the current or the
+ * previous one, in which @chunk of @rb was sent.
+ */
+static unsigned int ramblock_hot_level(RAMState *rs, RAMBlock *rb,
+                                       unsigned long chunk)
+{
+    if (rb->hot_period[chunk] + 1 < rs->hot_period) {
+        /* Not resent recently: cooled down */
+        return 0;
+    }
+    return rb->hot_hits[chunk];
+}
+
+/* Called when @page of @rb is about to be sent */
+static void ramblock_hot_page_sent(RAMState *rs, RAMBlock *rb,
+                                   unsigned long page)
+{
+    unsigned long chunk = page >> RAM_HOT_CHUNK_SHIFT;
+
+    if (rb->hot_period[chunk] == rs->hot_period) {
+        return;
+    }
+    if (rb->hot_period[chunk] + 1 == rs->hot_period) {
+        if (rb->hot_hits[chunk] < UINT8_MAX) {
+            rb->hot_hits[chunk]++;
+        }
+    } else {
+        rb->hot_hits[chunk] = 1;
+    }
+    rb->hot_period[chunk] = rs->hot_period;
+}
+
+void populate_hot_pages(MigrationInfo *info)
+{
+    RAMState *rs = ram_state;
+    HotPageStats *stats;
+    uint64_t histogram[RAM_HOT_HISTOGRAM_SIZE] = { 0 };
+    RAMBlock *rb;
+    int i;
+
+    if (!migrate_defer_hot_pages() || !rs) {
+        return;
+    }
+
+    /*
+     * The per-chunk arrays are only freed under the BQL, which we hold;
+     * racing with the migration thread updating them is fine for stats.
+     */
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            unsigned long chunk, chunks;
+
+            if (!rb->hot_hits) {
+                continue;
+            }
+            chunks = DIV_ROUND_UP(rb->used_length >> TARGET_PAGE_BITS,
+                                  1UL << RAM_HOT_CHUNK_SHIFT);
+            for (chunk = 0; chunk < chunks; chunk++) {
+                unsigned int level = ramblock_hot_level(rs, rb, chunk);
+
+                if (level) {
+                    histogram[MIN(level, RAM_HOT_HISTOGRAM_SIZE) - 1]++;
+                }
+            }
+        }
+    }
+    stats = g_new0(HotPageStats, 1);
+    stats->chunk_size = TARGET_PAGE_SIZE << RAM_HOT_CHUNK_SHIFT;
+    stats->hot_threshold = RAM_HOT_THRESHOLD - 1;
+    stats->deferred = rs->hot_deferred;
+
+    for (i = RAM_HOT_HISTOGRAM_SIZE - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(stats->histogram, histogram[i]);
+    }
+    info->x_hot_pages = stats;
+}
+
+/* Should hot chunks be skipped by the dirty page search right now? */
+static bool ram_hot_deferral_active(RAMState *rs, PageSearchStatus *pss)
+{
+    return pss->block->hot_hits && !rs->hot_flushing && !rs->last_stage &&
+           !pss->host_page_sending && !migration_in_postcopy();
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -704,7 +823,8 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
  * within the ramblock to migrate, or the end of ramblock when nothing
  * found.  Note that when pss->host_page_sending==true it means we're
  * during sending a host page, so we won't look for dirty page that is
- * outside the host page boundary.
+ * outside the host page boundary.  With x-defer-hot-pages, hot chunks are
+ * skipped until no other dirty page is left in the current sync period.
  *
  * @pss: the current page search status
  */
@@ -730,6 +850,23 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
+
+    if (!ram_hot_deferral_active(ram_state, pss)) {
+        return;
+    }
+
+    /* Leave hot chunks for the end of the period */
+    while (pss->page < size &&
+           ramblock_hot_level(ram_state, rb,
+                              pss->page >> RAM_HOT_CHUNK_SHIFT) >=
+           RAM_HOT_THRESHOLD) {
+        unsigned long next = QEMU_ALIGN_UP(pss->page + 1,
+                                           1UL << RAM_HOT_CHUNK_SHIFT);
+
+        ram_state->hot_skipped = true;
+        ram_state->hot_deferred++;
+        pss->page = find_next_bit(bitmap, size, next);
+    }
 }
 
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
@@ -831,6 +968,9 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     ret = test_and_clear_bit(page, rb->bmap);
     if (ret) {
         rs->migration_dirty_pages--;
+        if (rb->hot_hits) {
+            ramblock_hot_page_sent(rs, rb, page);
+        }
     }
 
     return ret;
@@ -921,6 +1061,208 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Size of the ranges handed out to dirty bitmap sync threads, in target
+ * pages.  It is a multiple of BITS_PER_LONG so that no two threads ever
+ * update the same word of a RAMBlock's bmap.
+ */
+#define BITMAP_SYNC_RANGE_PAGES (1UL << 18)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncRange;
+
+struct BitmapSyncThread {
+    QemuThread thread;
+    /* Posted to start a sync, or to quit if @quit is set */
+    QemuSemaphore sem;
+    bool quit;
+    QemuSemaphore *done;
+    /* Ranges synced by this thread in the current sync */
+    BitmapSyncRange *ranges;
+    unsigned int num_ranges;
+    /* Output: pages that were newly set in the migration bitmaps */
+    uint64_t new_dirty_pages;
+};
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncThread *t = opaque;
+    unsigned int i;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&t->sem);
+        if (t->quit) {
+            break;
+        }
+
+        t->new_dirty_pages = 0;
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < t->num_ranges; i++) {
+                BitmapSyncRange *r = &t->ranges[i];
+
+                t->new_dirty_pages +=
+                    cpu_physical_memory_sync_dirty_bitmap(r->block, r->start,
+                                                          r->length);
+            }
+        }
+        qemu_sem_post(t->done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* Thread context whose CPUs are close to the memory of @rb, if any */
+static ThreadContext *ramblock_thread_context(RAMBlock *rb)
+{
+    HostMemoryBackend *backend;
+
+    if (!rb->mr || !rb->mr->owner) {
+        return NULL;
+    }
+    backend = (HostMemoryBackend *)object_dynamic_cast(rb->mr->owner,
+                                                       TYPE_MEMORY_BACKEND);
+    return backend ? backend->prealloc_context : NULL;
+}
+
+/*
+ * Split guest RAM into ranges and give each of the @nr_threads threads a
+ * contiguous share of them, so that a thread mostly touches a single
+ * RAMBlock.  Returns the ranges, which the threads point into.
+ *
+ * Called with RCU critical section held.
+ */
+static GArray *bitmap_sync_split(BitmapSyncThread *threads, int nr_threads)
+{
+    GArray *ranges = g_array_new(false, false, sizeof(BitmapSyncRange));
+    ram_addr_t range_size = BITMAP_SYNC_RANGE_PAGES << TARGET_PAGE_BITS;
+    unsigned int per_thread, leftover, next = 0;
+    RAMBlock *block;
+    int i;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += range_size) {
+            BitmapSyncRange r = {
+                .block = block,
+                .start = start,
+                .length = MIN(range_size, block->used_length - start),
+            };
+
+            g_array_append_val(ranges, r);
+        }
+    }
+
+    per_thread = ranges->len / nr_threads;
+    leftover = ranges->len % nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        threads[i].ranges = &g_array_index(ranges, BitmapSyncRange, next);
+        threads[i].num_ranges = per_thread + (i < leftover);
+        next += threads[i].num_ranges;
+    }
+    return ranges;
+}
+
+/*
+ * Start the dirty bitmap sync threads of a migration.  A thread is
+ * created in the thread context of the memory backend that holds its
+ * first range, if any, so that it runs on CPUs close to that memory.
+ *
+ * Called with RCU critical section held.
+ */
+static void bitmap_sync_threads_create(RAMState *rs, int nr_threads)
+{
+    g_autoptr(GArray) ranges = NULL;
+    int i;
+
+    rs->bitmap_sync_threads = g_new0(BitmapSyncThread, nr_threads);
+    rs->nr_bitmap_sync_threads = nr_threads;
+    qemu_sem_init(&rs->bitmap_sync_done, 0);
+
+    ranges = bitmap_sync_split(rs->bitmap_sync_threads, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        BitmapSyncThread *t = &rs->bitmap_sync_threads[i];
+        ThreadContext *tc = NULL;
+
+        qemu_sem_init(&t->sem, 0);
+        t->done = &rs->bitmap_sync_done;
+        if (t->num_ranges) {
+            tc = ramblock_thread_context(t->ranges[0].block);
+        }
+        if (tc) {
+            thread_context_create_thread(tc, &t->thread, "mig/bmap_sync",
+                                         bitmap_sync_thread, t,
+                                         QEMU_THREAD_JOINABLE);
+        } else {
+            qemu_thread_create(&t->thread, "mig/bmap_sync",
+                               bitmap_sync_thread, t, QEMU_THREAD_JOINABLE);
+        }
+        t->ranges = NULL;
+        t->num_ranges = 0;
+    }
+}
+
+static void bitmap_sync_threads_destroy(RAMState *rs)
+{
+    int i;
+
+    if (!rs->bitmap_sync_threads) {
+        return;
+    }
+
+    for (i = 0; i < rs->nr_bitmap_sync_threads; i++) {
+        BitmapSyncThread *t = &rs->bitmap_sync_threads[i];
+
+        t->quit = true;
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+    }
+    qemu_sem_destroy(&rs->bitmap_sync_done);
+    g_free(rs->bitmap_sync_threads);
+    rs->bitmap_sync_threads = NULL;
+    rs->nr_bitmap_sync_threads = 0;
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks using the sync threads.
+ *
+ * Called with RCU critical section and bitmap_mutex held.
+ */
+static void ramblock_sync_dirty_bitmap_parallel(RAMState *rs)
+{
+    BitmapSyncThread *threads = rs->bitmap_sync_threads;
+    int nr_threads = rs->nr_bitmap_sync_threads;
+    g_autoptr(GArray) ranges = NULL;
+    uint64_t new_dirty_pages = 0;
+    int i;
+
+    /* RAMBlocks may have been resized since the last sync */
+    ranges = bitmap_sync_split(threads, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_sem_post(&threads[i].sem);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_sem_wait(&rs->bitmap_sync_done);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        new_dirty_pages += threads[i].new_dirty_pages;
+        threads[i].ranges = NULL;
+        threads[i].num_ranges = 0;
+    }
+
+    trace_ramblock_sync_dirty_bitmap_parallel(nr_threads, ranges->len,
+                                              new_dirty_pages);
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1063,9 +1405,16 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     memory_global_dirty_log_sync(last_stage);
 
     qemu_mutex_lock(&rs->bitmap_mutex);
+    rs->hot_period++;
+    rs->hot_skipped = false;
+    rs->hot_flushing = false;
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+        if (rs->bitmap_sync_threads) {
+            ramblock_sync_dirty_bitmap_parallel(rs);
+        } else {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
         }
         stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
     }
@@ -1352,6 +1701,15 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
 
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        if (rs->hot_skipped && !rs->hot_flushing) {
+            /*
+             * Only hot chunks are left: go around once more, this time
+             * sending them, until the next bitmap sync.
+             */
+            rs->hot_flushing = true;
+            pss->complete_round = false;
+            return PAGE_TRY_AGAIN;
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -2463,10 +2821,17 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->hot_hits);
+        block->hot_hits = NULL;
+        g_free(block->hot_period);
+        block->hot_period = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    if (*rsp) {
+        bitmap_sync_threads_destroy(*rsp);
+    }
     ram_state_cleanup(rsp);
     g_free(migration_ops);
     migration_ops = NULL;
@@ -2835,6 +3200,11 @@ static void ram_list_init_bitmaps(void)
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_defer_hot_pages()) {
+                block->hot_hits = g_new0(uint8_t, ramblock_hot_chunks(block));
+                block->hot_period = g_new0(uint32_t,
+                                           ramblock_hot_chunks(block));
+            }
         }
     }
 }
@@ -2854,12 +3224,17 @@ static void migration_bitmap_clear_discarded_pages(RAMState *rs)
 
 static void ram_init_bitmaps(RAMState *rs)
 {
+    MigrationState *ms = migrate_get_current();
+
     qemu_mutex_lock_ramlist();
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
+            if (ms->bitmap_sync_threads > 1) {
+                bitmap_sync_threads_create(rs, ms->bitmap_sync_threads);
+            }
             memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs, false);
         }
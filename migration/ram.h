@@ -50,6 +50,7 @@ uint64_t ram_bytes_total(void);
 void mig_throttle_counter_reset(void);
 
 uint64_t ram_pagesize_summary(void);
+void populate_hot_pages(MigrationInfo *info);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
                          Error **errp);
 void ram_postcopy_migrated_memory_release(MigrationState *ms);
@@ -69,6 +69,8 @@
 #include "yank_functions.h"
 #include "sysemu/qtest.h"
 #include "options.h"
+#include "multifd.h"
+#include "qemu/rcu.h"
 
 const unsigned int postcopy_ram_discard_version;
 
@@ -217,6 +219,8 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* state is being saved by a worker thread and sent over multifd */
+    bool save_in_thread;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -948,12 +952,59 @@ void vmstate_unregister(VMStateIf *obj, const VMStateDescription *vmsd,
     }
 }
 
+/*
+ * With x-multifd-device-state, sections of devices that support
+ * parallel saving start with one of these, telling where the device
+ * state actually is.
+ */
+#define DEVICE_STATE_INLINE  0
+#define DEVICE_STATE_MULTIFD 1
+
+static bool vmstate_has_device_state_marker(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel_save &&
+           migrate_multifd_device_state();
+}
+
+static int vmstate_load_from_multifd(SaveStateEntry *se)
+{
+    Error *local_err = NULL;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = multifd_device_state_recv_wait(se->load_section_id, &local_err);
+    if (!bioc) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    ret = vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    return ret;
+}
+
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
 {
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
         return se->ops->load_state(f, se->opaque, se->load_version_id);
     }
+    if (vmstate_has_device_state_marker(se)) {
+        uint8_t marker = qemu_get_byte(f);
+
+        if (marker == DEVICE_STATE_MULTIFD) {
+            return vmstate_load_from_multifd(se);
+        }
+        if (marker != DEVICE_STATE_INLINE) {
+            error_report("%s: invalid device state marker %u for '%s'",
+                         __func__, marker, se->idstr);
+            return -EINVAL;
+        }
+    }
     return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
 }
 
@@ -1018,7 +1069,9 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc)
     if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
         return 0;
     }
-    if (se->vmsd && !vmstate_section_needed(se->vmsd, se->opaque)) {
+    /* Entries saved in a thread were already found to be needed */
+    if (se->vmsd && !se->save_in_thread &&
+        !vmstate_section_needed(se->vmsd, se->opaque)) {
         trace_savevm_section_skip(se->idstr, se->section_id);
         return 0;
     }
@@ -1031,8 +1084,15 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, JSONWriter *vmdesc)
         json_writer_int64(vmdesc, "instance_id", se->instance_id);
     }
 
+    if (vmstate_has_device_state_marker(se)) {
+        qemu_put_byte(f, se->save_in_thread ? DEVICE_STATE_MULTIFD :
+                                              DEVICE_STATE_INLINE);
+    }
+
     trace_vmstate_save(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
-    if (!se->vmsd) {
+    if (se->save_in_thread) {
+        /* The state itself travels on a multifd channel */
+    } else if (!se->vmsd) {
         vmstate_save_old_style(f, se, vmdesc);
     } else {
         ret = vmstate_save_state_with_err(f, se->vmsd, se->opaque, vmdesc, &local_err);
@@ -1533,6 +1593,148 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+/* Device state saved by worker threads during the final stage */
+typedef struct {
+    SaveStateEntry **entries;
+    int count;
+    /* index of the next entry to save, updated atomically */
+    int next;
+    /* first error hit by a worker, updated atomically */
+    int ret;
+    QemuThread *threads;
+    int nr_threads;
+} SaveParallelState;
+
+static int vmstate_save_to_multifd(SaveStateEntry *se, Error **errp)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(4096);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    size_t len;
+    char *buf;
+    int ret;
+
+    object_unref(OBJECT(bioc));
+
+    ret = vmstate_save_state_with_err(f, se->vmsd, se->opaque, NULL, errp);
+    if (!ret) {
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            error_setg_errno(errp, -ret, "failed to buffer state of '%s'",
+                             se->idstr);
+        }
+    }
+    if (ret) {
+        qemu_fclose(f);
+        return ret;
+    }
+
+    /* Take the buffer over rather than copying it */
+    len = bioc->usage;
+    buf = (char *)g_steal_pointer(&bioc->data);
+    bioc->usage = bioc->capacity = bioc->offset = 0;
+    qemu_fclose(f);
+
+    trace_vmstate_downtime_save("parallel", se->idstr, se->instance_id,
+                                qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                start_ts);
+
+    if (!multifd_queue_device_state(se->idstr, se->instance_id,
+                                    se->section_id, buf, len)) {
+        error_setg(errp, "failed to queue state of '%s' on multifd",
+                   se->idstr);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    SaveParallelState *ps = opaque;
+    int i;
+
+    rcu_register_thread();
+
+    while (!qatomic_read(&ps->ret) &&
+           (i = qatomic_fetch_inc(&ps->next)) < ps->count) {
+        Error *local_err = NULL;
+        int ret;
+
+        ret = vmstate_save_to_multifd(ps->entries[i], &local_err);
+        if (ret) {
+            qatomic_cmpxchg(&ps->ret, 0, ret);
+            migrate_set_error(migrate_get_current(), local_err);
+            error_report_err(local_err);
+            break;
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Starts saving the state of the devices that support it from worker
+ * threads, one per multifd channel.  Returns NULL if there is nothing
+ * to save this way.
+ */
+static SaveParallelState *savevm_parallel_start(void)
+{
+    SaveParallelState *ps;
+    SaveStateEntry *se;
+    int i;
+
+    ps = g_new0(SaveParallelState, 1);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->save_in_thread = false;
+        if (!se->vmsd || !se->vmsd->parallel_save || se->vmsd->early_setup ||
+            !vmstate_section_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        se->save_in_thread = true;
+        ps->entries = g_renew(SaveStateEntry *, ps->entries, ps->count + 1);
+        ps->entries[ps->count++] = se;
+    }
+
+    if (!ps->count) {
+        g_free(ps);
+        return NULL;
+    }
+
+    ps->nr_threads = MIN(migrate_multifd_channels(), ps->count);
+    ps->threads = g_new0(QemuThread, ps->nr_threads);
+    for (i = 0; i < ps->nr_threads; i++) {
+        qemu_thread_create(&ps->threads[i], "mig/src/devstate",
+                           savevm_parallel_thread, ps, QEMU_THREAD_JOINABLE);
+    }
+    return ps;
+}
+
+static int savevm_parallel_finish(SaveParallelState *ps)
+{
+    int ret;
+    int i;
+
+    for (i = 0; i < ps->nr_threads; i++) {
+        qemu_thread_join(&ps->threads[i]);
+    }
+    for (i = 0; i < ps->count; i++) {
+        ps->entries[i]->save_in_thread = false;
+    }
+    ret = ps->ret;
+
+    g_free(ps->threads);
+    g_free(ps->entries);
+    g_free(ps);
+
+    /* Make sure the state is on the wire before multifd gets shut down */
+    if (!ret && multifd_send_sync_main() < 0) {
+        ret = -EIO;
+    }
+    return ret;
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
@@ -1540,10 +1742,15 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     MigrationState *ms = migrate_get_current();
     int64_t start_ts_each, end_ts_each;
     JSONWriter *vmdesc = ms->vmdesc;
+    SaveParallelState *ps = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    if (migrate_multifd_device_state() && !in_postcopy) {
+        ps = savevm_parallel_start();
+    }
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->vmsd && se->vmsd->early_setup) {
             /* Already saved during qemu_savevm_state_setup(). */
@@ -1555,6 +1762,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
+            if (ps) {
+                qatomic_cmpxchg(&ps->ret, 0, ret);
+                savevm_parallel_finish(ps);
+            }
             return ret;
         }
 
@@ -1563,6 +1774,14 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                     end_ts_each - start_ts_each);
     }
 
+    if (ps) {
+        ret = savevm_parallel_finish(ps);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+    }
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_activate_all() on the other end won't fail. */
@@ -1716,6 +1935,12 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         return -EINVAL;
     }
 
+    if (migrate_multifd_device_state()) {
+        error_setg(errp, "x-multifd-device-state and snapshots are "
+                   "incompatible");
+        return -EINVAL;
+    }
+
     ret = migrate_init(ms, errp);
     if (ret) {
         return ret;
@@ -2221,7 +2446,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -3260,6 +3486,12 @@ bool load_snapshot(const char *name, const char *vmstate,
     int ret;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
+    if (migrate_multifd_device_state()) {
+        error_setg(errp, "x-multifd-device-state and snapshots are "
+                   "incompatible");
+        return false;
+    }
+
     if (!bdrv_all_can_snapshot(has_devices, devices, errp)) {
         return false;
     }
@@ -15,10 +15,141 @@
 #include "qemu/host-utils.h"
 #include "xbzrle.h"
 
-#if defined(CONFIG_AVX512BW_OPT)
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
 #include <immintrin.h>
 #include "host/cpuinfo.h"
+#define XBZRLE_HAS_ACCEL
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include "host/cpuinfo.h"
+#define XBZRLE_HAS_ACCEL
+#endif
+
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+
+#ifdef XBZRLE_HAS_ACCEL
+/*
+ * Generic encoder for the vector implementations.  @find(old, new, i,
+ * slen, same) returns the first index at or after @i where the bytes of
+ * @old_buf and @new_buf are equal (if @same) or differ (if !@same), or
+ * @slen if there is none.  The output is identical to the one of
+ * xbzrle_encode_buffer_int().
+ */
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     int (*find)(const uint8_t *,
+                                                 const uint8_t *,
+                                                 int, int, bool))
+{
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        int nzrun_start, nzrun_end;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_start = find(old_buf, new_buf, i, slen, false);
+        /* skip last zero run, or the whole buffer if unchanged */
+        if (nzrun_start == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, nzrun_start - i);
+
+        nzrun_end = find(old_buf, new_buf, nzrun_start + 1, slen, true);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        d += uleb128_encode_small(dst + d, nzrun_end - nzrun_start);
+        if (d + nzrun_end - nzrun_start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + nzrun_start, nzrun_end - nzrun_start);
+        d += nzrun_end - nzrun_start;
+        i = nzrun_end;
+    }
+
+    return d;
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT)
+static int __attribute__((target("avx2")))
+xbzrle_find_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                 int i, int slen, bool same)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+        uint32_t hit = same ? eq : ~eq;
+
+        if (hit) {
+            return i + ctz32(hit);
+        }
+    }
+    for (; i < slen; i++) {
+        if ((old_buf[i] == new_buf[i]) == same) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int __attribute__((target("avx2")))
+xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                          uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_avx2);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+#if defined(__aarch64__)
+static int xbzrle_find_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen, bool same)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+        /* Narrow to 4 bits per byte to get a scalar mask */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        uint64_t hit = same ? mask : ~mask;
+
+        if (hit) {
+            return i + ctz64(hit) / 4;
+        }
+    }
+    for (; i < slen; i++) {
+        if ((old_buf[i] == new_buf[i]) == same) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_find_neon);
+}
+#endif /* __aarch64__ */
 
+#if defined(CONFIG_AVX512BW_OPT)
 static int __attribute__((target("avx512bw")))
 xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
                             uint8_t *dst, int dlen)
@@ -137,42 +268,10 @@ xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
-static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
-                                    int slen, uint8_t *dst, int dlen);
-
-static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
-
-static void __attribute__((constructor)) init_accel(void)
-{
-    unsigned info = cpuinfo_init();
-    if (info & CPUINFO_AVX512BW) {
-        accel_func = xbzrle_encode_buffer_avx512;
-    } else {
-        accel_func = xbzrle_encode_buffer_int;
-    }
-}
-
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    return accel_func(old_buf, new_buf, slen, dst, dlen);
-}
-
-#define xbzrle_encode_buffer xbzrle_encode_buffer_int
-#endif
+#endif /* CONFIG_AVX512BW_OPT */
 
-/*
-  page = zrun nzrun
-       | zrun nzrun page
-
-  zrun = length
-
-  nzrun = length byte...
-
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -273,6 +372,80 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#ifdef XBZRLE_HAS_ACCEL
+static unsigned used_accel;
+static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+
+static unsigned __attribute__((noinline))
+select_accel_cpuinfo(unsigned info)
+{
+    /* Array is sorted in order of algorithm preference. */
+    static const struct {
+        unsigned bit;
+        int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int);
+    } all[] = {
+#ifdef CONFIG_AVX512BW_OPT
+        { CPUINFO_AVX512BW, xbzrle_encode_buffer_avx512 },
+#endif
+#ifdef CONFIG_AVX2_OPT
+        { CPUINFO_AVX2,     xbzrle_encode_buffer_avx2 },
+#endif
+#ifdef __aarch64__
+        { CPUINFO_ASIMD,    xbzrle_encode_buffer_neon },
+#endif
+        { CPUINFO_ALWAYS,   xbzrle_encode_buffer_int },
+    };
+
+    for (unsigned i = 0; i < ARRAY_SIZE(all); ++i) {
+        if (info & all[i].bit) {
+            accel_func = all[i].fn;
+            return all[i].bit;
+        }
+    }
+    return 0;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    used_accel = select_accel_cpuinfo(cpuinfo_init());
+}
+
+bool xbzrle_encode_next_accel(void)
+{
+    /*
+     * Accumulate the accelerators that we've already tested, and
+     * remove them from the set to test this round.  We'll get back
+     * a zero from select_accel_cpuinfo when there are no more.
+     */
+    unsigned used = select_accel_cpuinfo(cpuinfo & ~used_accel);
+    used_accel |= used;
+    return used;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return accel_func(old_buf, new_buf, slen, dst, dlen);
+}
+#else
+bool xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+}
+#endif /* XBZRLE_HAS_ACCEL */
+
+/*
+ * Decoding is left scalar: zero runs are skipped without touching @dst
+ * and non-zero runs are a plain memcpy(), which the C library already
+ * vectorizes.
+ */
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
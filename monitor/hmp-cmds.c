@@ -227,6 +227,23 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  poll-ns=%" PRId64 "\n", value->poll_ns);
+        monitor_printf(mon, "  poll-hits=%" PRIu64 "\n", value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRIu64 "\n",
+                       value->poll_misses);
+        monitor_printf(mon, "  poll-wasted-ns=%" PRIu64 "\n",
+                       value->poll_wasted_ns);
+        if (value->thread_pool) {
+            ThreadPoolStats *tp = value->thread_pool;
+
+            monitor_printf(mon, "  thread-pool: threads=%" PRId64
+                           " idle=%" PRId64 " shared=%d queue-depth=%" PRId64
+                           " requests=%" PRIu64 " steals=%" PRIu64
+                           " wait-ns=%" PRIu64 " run-ns=%" PRIu64 "\n",
+                           tp->threads, tp->idle_threads, tp->shared,
+                           tp->queue_depth, tp->requests, tp->steals,
+                           tp->wait_ns, tp->run_ns);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
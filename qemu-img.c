@@ -1667,6 +1667,16 @@ enum ImgConvertBlockStatus {
 #define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/* Smallest range of the source that gets its own planning coroutine */
+#define CONVERT_PLAN_MIN_SECTORS (1 * GiB / BDRV_SECTOR_SIZE)
+
+/* A run of sectors with the same allocation status in the source */
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1675,10 +1685,11 @@ typedef struct ImgConvertState {
     int64_t total_sectors;
     int64_t allocated_sectors;
     int64_t allocated_done;
+    /* Extents of the whole source, built before copying starts */
+    GArray *plan;
+    guint plan_idx;
     int64_t sector_num;
     int64_t wr_offs;
-    enum ImgConvertBlockStatus status;
-    int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1697,10 +1708,19 @@ typedef struct ImgConvertState {
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
     int64_t wait_sector_num[MAX_COROUTINES];
-    CoMutex lock;
     int ret;
 } ImgConvertState;
 
+/* Builds the extent map of the sectors [start, end) of the source */
+typedef struct ImgConvertPlanner {
+    ImgConvertState *s;
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    GArray *extents;
+} ImgConvertPlanner;
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1713,17 +1733,18 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int coroutine_mixed_fn GRAPH_RDLOCK
-convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+static int coroutine_fn GRAPH_RDLOCK
+convert_iteration_sectors(ImgConvertPlanner *p, int64_t sector_num)
 {
+    ImgConvertState *s = p->s;
     int64_t src_cur_offset;
     int ret, n, src_cur;
     bool post_backing_zero = false;
 
     convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
-    assert(s->total_sectors > sector_num);
-    n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
+    assert(p->end > sector_num);
+    n = MIN(p->end - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->target_backing_sectors >= 0) {
         if (sector_num >= s->target_backing_sectors) {
@@ -1735,7 +1756,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (p->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1751,8 +1772,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         do {
             count = n * BDRV_SECTOR_SIZE;
 
-            ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
-                                          NULL, NULL);
+            ret = bdrv_co_block_status_above(src_bs, base, offset, count,
+                                             &count, NULL, NULL);
 
             if (ret < 0) {
                 if (s->salvage) {
@@ -1780,7 +1801,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
 
         /*
-         * Avoid that s->sector_next_status becomes unaligned to the source
+         * Avoid that p->sector_next_status becomes unaligned to the source
          * request alignment and/or cluster size to avoid unnecessary read
          * cycles.
          */
@@ -1790,28 +1811,25 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+            p->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
         } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
+            p->status = BLK_DATA;
         } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+            p->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
         }
 
-        s->sector_next_status = sector_num + n;
+        p->sector_next_status = sector_num + n;
     }
 
-    n = MIN(n, s->sector_next_status - sector_num);
-    if (s->status == BLK_DATA) {
-        n = MIN(n, s->buf_sectors);
-    }
+    n = MIN(n, p->sector_next_status - sector_num);
 
     /* We need to write complete clusters for compressed images, so if an
      * unallocated area is shorter than that, we must consider the whole
      * cluster allocated. */
     if (s->compressed) {
         if (n < s->cluster_sectors) {
-            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
-            s->status = BLK_DATA;
+            n = MIN(s->cluster_sectors, p->end - sector_num);
+            p->status = BLK_DATA;
         } else {
             n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
         }
@@ -1820,6 +1838,116 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
+static void convert_plan_add(GArray *plan, int64_t sector_num,
+                             int64_t nb_sectors,
+                             enum ImgConvertBlockStatus status)
+{
+    ImgConvertExtent *last = NULL;
+
+    if (plan->len) {
+        last = &g_array_index(plan, ImgConvertExtent, plan->len - 1);
+        assert(last->sector_num + last->nb_sectors == sector_num);
+    }
+
+    /* Merge with the previous extent so that the copy can use large chunks */
+    if (last && last->status == status) {
+        last->nb_sectors += nb_sectors;
+    } else {
+        ImgConvertExtent extent = {
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .status = status,
+        };
+        g_array_append_val(plan, extent);
+    }
+}
+
+static void coroutine_fn convert_co_plan(void *opaque)
+{
+    ImgConvertPlanner *p = opaque;
+    ImgConvertState *s = p->s;
+    int64_t sector_num = p->start;
+
+    s->running_coroutines++;
+    p->sector_next_status = 0;
+
+    while (sector_num < p->end && s->ret == -EINPROGRESS) {
+        int n;
+
+        WITH_GRAPH_RDLOCK_GUARD() {
+            n = convert_iteration_sectors(p, sector_num);
+        }
+        if (n < 0) {
+            s->ret = n;
+            break;
+        }
+        convert_plan_add(p->extents, sector_num, n, p->status);
+        sector_num += n;
+    }
+
+    s->running_coroutines--;
+}
+
+/*
+ * Query the allocation status of the whole source up front.  The source is
+ * split into ranges that are mapped by parallel coroutines, so that block
+ * status requests for different parts of the image can overlap, and the
+ * result is merged into s->plan.
+ */
+static int convert_build_plan(ImgConvertState *s)
+{
+    g_autofree ImgConvertPlanner *planners = NULL;
+    int64_t step;
+    int i, nb_planners;
+
+    nb_planners = MIN(s->num_coroutines,
+                      DIV_ROUND_UP(s->total_sectors, CONVERT_PLAN_MIN_SECTORS));
+    nb_planners = MAX(nb_planners, 1);
+
+    /*
+     * Ranges start at a multiple of the buffer size, which is the cluster
+     * size for compressed images, so that no cluster spans two ranges.
+     */
+    step = QEMU_ALIGN_UP(DIV_ROUND_UP(s->total_sectors, nb_planners),
+                         s->buf_sectors);
+
+    s->plan = g_array_new(false, false, sizeof(ImgConvertExtent));
+    s->ret = -EINPROGRESS;
+
+    planners = g_new0(ImgConvertPlanner, nb_planners);
+    for (i = 0; i < nb_planners; i++) {
+        planners[i] = (ImgConvertPlanner) {
+            .s = s,
+            .start = MIN(i * step, s->total_sectors),
+            .end = MIN((i + 1) * step, s->total_sectors),
+            .extents = g_array_new(false, false, sizeof(ImgConvertExtent)),
+        };
+        qemu_coroutine_enter(qemu_coroutine_create(convert_co_plan,
+                                                   &planners[i]));
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    for (i = 0; i < nb_planners; i++) {
+        GArray *extents = planners[i].extents;
+
+        for (guint j = 0; j < extents->len; j++) {
+            ImgConvertExtent *e = &g_array_index(extents, ImgConvertExtent, j);
+
+            convert_plan_add(s->plan, e->sector_num, e->nb_sectors, e->status);
+            if (e->status == BLK_DATA ||
+                (!s->min_sparse && e->status == BLK_ZERO)) {
+                s->allocated_sectors += e->nb_sectors;
+            }
+        }
+        g_array_free(extents, true);
+    }
+
+    return s->ret == -EINPROGRESS ? 0 : s->ret;
+}
+
 static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
                                         int nb_sectors, uint8_t *buf)
 {
@@ -1989,33 +2117,31 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     while (1) {
         int n;
-        int64_t sector_num;
+        int64_t sector_num, extent_end;
         enum ImgConvertBlockStatus status;
+        ImgConvertExtent *extent;
         bool copy_range;
 
-        qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
-            qemu_co_mutex_unlock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->plan_idx >= s->plan->len) {
             break;
         }
-        WITH_GRAPH_RDLOCK_GUARD() {
-            n = convert_iteration_sectors(s, s->sector_num);
-        }
-        if (n < 0) {
-            qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
-            break;
-        }
-        /* save current sector and allocation status to local variables */
+
+        /*
+         * Take the next chunk of the current extent.  This doesn't yield, so
+         * the coroutines don't need a lock to share the plan.
+         */
+        extent = &g_array_index(s->plan, ImgConvertExtent, s->plan_idx);
+        extent_end = extent->sector_num + extent->nb_sectors;
         sector_num = s->sector_num;
-        status = s->status;
-        if (!s->min_sparse && s->status == BLK_ZERO) {
+        status = extent->status;
+        n = MIN(extent_end - sector_num, BDRV_REQUEST_MAX_SECTORS);
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             n = MIN(n, s->buf_sectors);
         }
-        /* increment global sector counter so that other coroutines can
-         * already continue reading beyond this request */
         s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
+        if (s->sector_num == extent_end) {
+            s->plan_idx++;
+        }
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
@@ -2024,7 +2150,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2094,8 +2220,7 @@ retry:
 
 static int convert_do_copy(ImgConvertState *s)
 {
-    int ret, i, n;
-    int64_t sector_num = 0;
+    int ret, i;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
@@ -2115,25 +2240,14 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
-    while (sector_num < s->total_sectors) {
-        bdrv_graph_rdlock_main_loop();
-        n = convert_iteration_sectors(s, sector_num);
-        bdrv_graph_rdunlock_main_loop();
-        if (n < 0) {
-            return n;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            s->allocated_sectors += n;
-        }
-        sector_num += n;
+    ret = convert_build_plan(s);
+    if (ret < 0) {
+        return ret;
     }
 
     /* Do the copy */
-    s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
-    qemu_co_mutex_init(&s->lock);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
@@ -2200,7 +2314,7 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst,
                                    true, bdrv_dirty_bitmap_granularity(bm),
                                    true, true,
                                    true, !bdrv_dirty_bitmap_enabled(bm),
-                                   &err);
+                                   false, false, &err);
         if (err) {
             error_reportf_err(err, "Failed to create bitmap %s: ", name);
             return -1;
@@ -2231,6 +2345,51 @@ static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
     blk_set_io_limits(blk, &cfg);
 }
 
+/*
+ * Returns the device of the host filesystem if @bs is a raw image stored in
+ * a regular file, and 0 otherwise.
+ */
+static dev_t GRAPH_RDLOCK convert_raw_file_dev(BlockDriverState *bs)
+{
+    struct stat st;
+
+    if (!strcmp(bs->drv->format_name, "raw")) {
+        if (!bs->file) {
+            return 0;
+        }
+        bs = bs->file->bs;
+    }
+    if (strcmp(bs->drv->format_name, "file") ||
+        stat(bs->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    return st.st_dev;
+}
+
+/*
+ * Raw images on the same host filesystem can be copied by the kernel with
+ * copy_file_range(), which avoids bouncing the data through qemu-img and
+ * lets filesystems that support it share the extents instead.
+ */
+static bool convert_can_offload(ImgConvertState *s)
+{
+    dev_t dev;
+    int i;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    dev = convert_raw_file_dev(blk_bs(s->target));
+    if (!dev) {
+        return false;
+    }
+    for (i = 0; i < s->src_num; i++) {
+        if (convert_raw_file_dev(blk_bs(s->src[i])) != dev) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = BDRV_O_NO_SHARE;
@@ -2779,6 +2938,16 @@ static int img_convert(int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /*
+     * Offload the copy automatically unless the user asked for zero
+     * detection with -S, which needs to read the data, or for a rate limit,
+     * which copy_range requests bypass.
+     */
+    if (!s.copy_range && !s.compressed && !s.salvage && !explict_min_sparse &&
+        !rate_limit && !s.target_has_backing && convert_can_offload(&s)) {
+        s.copy_range = true;
+    }
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
@@ -2807,6 +2976,9 @@ out:
     }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
+    if (s.plan) {
+        g_array_free(s.plan, true);
+    }
 fail_getopt:
     qemu_opts_del(sn_opts);
     g_free(options);
@@ -4932,7 +5104,7 @@ static int img_bitmap(int argc, char **argv)
         case BITMAP_ADD:
             qmp_block_dirty_bitmap_add(bs->node_name, bitmap,
                                        !!granularity, granularity, true, true,
-                                       false, false, &err);
+                                       false, false, false, false, &err);
             op = "add";
             break;
         case BITMAP_REMOVE:
@@ -132,6 +132,10 @@ def bench(args):
                 x_perf['use-copy-range'] = False
             elif opt.startswith('max-workers='):
                 x_perf['max-workers'] = int(opt.split('=')[1])
+            elif opt == 'adaptive=on':
+                x_perf['adaptive'] = True
+            elif opt == 'adaptive=off':
+                x_perf['adaptive'] = False
 
         backup_options = {}
         if x_perf:
@@ -174,12 +178,14 @@ def __call__(self, parser, namespace, values, option_string=None):
     p = argparse.ArgumentParser('Backup benchmark', epilog='''
 ENV format
 
-    (LABEL:PATH|LABEL|PATH)[,max-workers=N][,use-copy-range=(on|off)][,mirror]
+    (LABEL:PATH|LABEL|PATH)[,max-workers=N][,use-copy-range=(on|off)]
+                           [,adaptive=(on|off)][,mirror]
 
     LABEL                short name for the binary
     PATH                 path to the binary
     max-workers          set x-perf.max-workers of backup job
     use-copy-range       set x-perf.use-copy-range of backup job
+    adaptive             set x-perf.adaptive of backup job
     mirror               use mirror job instead of backup''',
                                 formatter_class=argparse.RawTextHelpFormatter)
     p.add_argument('--env', nargs='+', help='''\
@@ -21,7 +21,12 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
     abort();
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(int64_t sqpoll_idle_ms, bool uring_cmd, Error **errp)
+{
+    abort();
+}
+
+LuringState *luring_init_shared(AioContext *ctx)
 {
     abort();
 }
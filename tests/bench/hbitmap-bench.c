@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Compare dense and compressed HBitmaps on the access patterns of dirty
+ * tracking for large disks: a small hot region of random writes, a
+ * full-disk mirror pass, scanning for dirty areas and merging.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+
+#define GRANULARITY     16      /* 64k, the default cluster size */
+#define WRITE_SIZE      (64 * KiB)
+#define NB_WRITES       (256 * 1024)
+
+enum bitmap_op {
+    OP_RANDOM_SET,
+    OP_FULL_SET,
+    OP_COUNT,
+    OP_NEXT_DIRTY_AREA,
+    OP_MERGE,
+    OP_RESET_ALL,
+};
+
+struct benchmark {
+    const char * const name;
+    enum bitmap_op op;
+    /* Fill the whole bitmap rather than the hot region before running */
+    bool fill_full;
+};
+
+static const struct benchmark benchmarks[] = {
+    { .name = "RandomSet",  .op = OP_RANDOM_SET },
+    { .name = "FullSet",    .op = OP_FULL_SET },
+    { .name = "Count",      .op = OP_COUNT },
+    { .name = "DirtyArea",  .op = OP_NEXT_DIRTY_AREA },
+    { .name = "Merge",      .op = OP_MERGE },
+    { .name = "MergeFull",  .op = OP_MERGE,     .fill_full = true },
+    { .name = "ResetAll",   .op = OP_RESET_ALL, .fill_full = true },
+};
+
+static const char * const impls[] = { "dense", "compr" };
+
+static uint64_t disk_sizes[] = {
+    1 * TiB,
+    16 * TiB,
+};
+
+static HBitmap *bitmap_new(uint64_t size, bool compressed)
+{
+    return compressed ? hbitmap_alloc_compressed(size, GRANULARITY) :
+                        hbitmap_alloc(size, GRANULARITY);
+}
+
+/* Writes land in the first 1/64th of the disk, as for a busy log volume */
+static void random_writes(HBitmap *hb, uint64_t size, GRand *rand)
+{
+    uint64_t hot = size / 64 / WRITE_SIZE;
+
+    for (int i = 0; i < NB_WRITES; i++) {
+        uint64_t off = g_rand_int_range(rand, 0, hot) * WRITE_SIZE;
+        hbitmap_set(hb, off, WRITE_SIZE);
+    }
+}
+
+static int64_t run_benchmark(const struct benchmark *bench, bool compressed,
+                             uint64_t size, size_t *mem)
+{
+    g_autoptr(GRand) rand = g_rand_new_with_seed(1);
+    HBitmap *hb = bitmap_new(size, compressed);
+    HBitmap *other = NULL;
+    int64_t offset, count;
+    int64_t start_ns;
+
+    if (bench->op != OP_RANDOM_SET && bench->op != OP_FULL_SET) {
+        if (bench->fill_full) {
+            hbitmap_set(hb, 0, size);
+        } else {
+            random_writes(hb, size, rand);
+        }
+    }
+    if (bench->op == OP_MERGE) {
+        other = bitmap_new(size, compressed);
+        random_writes(other, size, rand);
+    }
+
+    start_ns = get_clock();
+    switch (bench->op) {
+    case OP_RANDOM_SET:
+        random_writes(hb, size, rand);
+        break;
+    case OP_FULL_SET:
+        /* A mirror job marking everything dirty, one request at a time */
+        for (offset = 0; offset < size; offset += 64 * MiB) {
+            hbitmap_set(hb, offset, 64 * MiB);
+        }
+        break;
+    case OP_COUNT:
+        count = hbitmap_count(hb);
+        (void)count;
+        break;
+    case OP_NEXT_DIRTY_AREA:
+        for (offset = 0;
+             hbitmap_next_dirty_area(hb, offset, size, INT64_MAX,
+                                     &offset, &count);
+             offset += count) {
+            /* nothing */
+        }
+        break;
+    case OP_MERGE:
+        hbitmap_merge(hb, other, hb);
+        break;
+    case OP_RESET_ALL:
+        hbitmap_reset_all(hb);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    int64_t ns = get_clock() - start_ns;
+
+    *mem = hbitmap_memory_usage(hb);
+    if (other) {
+        hbitmap_free(other);
+    }
+    hbitmap_free(hb);
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 0; i < ARRAY_SIZE(disk_sizes); i++) {
+        uint64_t size = disk_sizes[i];
+
+        printf("# Disk size %" PRIu64 " TiB, granularity %d KiB. "
+               "Units: ms, memory in KiB\n", size / TiB,
+               (1 << GRANULARITY) / 1024);
+        printf("%10s ", "Op");
+        for (int j = 0; j < ARRAY_SIZE(impls); j++) {
+            printf("%10s %10s ", impls[j], "mem");
+        }
+        printf("\n");
+
+        for (int k = 0; k < ARRAY_SIZE(benchmarks); k++) {
+            const struct benchmark *bench = &benchmarks[k];
+            double ms[ARRAY_SIZE(impls)];
+
+            printf("%10s ", bench->name);
+            for (int j = 0; j < ARRAY_SIZE(impls); j++) {
+                int64_t total_ns = 0;
+                int64_t n_runs = 0;
+                size_t mem;
+
+                while (total_ns < 2e8 || n_runs < 3) {
+                    total_ns += run_benchmark(bench, j, size, &mem);
+                    n_runs++;
+                }
+                ms[j] = (double)total_ns / n_runs / 1e6;
+                printf("%10.3f %10zu ", ms[j], mem / KiB);
+            }
+            if (ms[1] != 0) {
+                printf("(%4.2fx)", ms[0] / ms[1]);
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+    return 0;
+}
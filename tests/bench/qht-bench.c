@@ -390,6 +390,7 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 static void pr_stats(void)
 {
     struct thread_stats s = {};
+    struct qht_counters cnt;
     double tx;
 
     add_stats(&s, rw_info, n_rw_threads);
@@ -418,6 +419,13 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    qht_counters_read(&ht, &cnt);
+    printf(" Table resizes:     %zu%s\n", cnt.resizes,
+           cnt.migrating ? " (last one in progress)" : "");
+    printf(" Final entries:     %zu in %zu head + %zu added buckets\n",
+           cnt.entries, cnt.head_buckets, cnt.added_buckets);
+    printf(" Longest chain:     %zu buckets\n", cnt.max_chain);
 }
 
 static void run_test(void)
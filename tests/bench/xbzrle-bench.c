@@ -0,0 +1,128 @@
+/*
+ * XBZRLE encode/decode throughput benchmark
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE   4096
+#define NR_PAGES    1024
+
+struct pattern {
+    const char * const name;
+    /* number of rewritten byte runs per page */
+    int runs;
+    /* maximum length of each run */
+    int max_len;
+};
+
+/* Typical differences between two versions of a guest page */
+static const struct pattern patterns[] = {
+    { .name = "unchanged",  .runs = 0,   .max_len = 1 },
+    { .name = "1-byte",     .runs = 1,   .max_len = 1 },
+    { .name = "counters",   .runs = 8,   .max_len = 8 },
+    { .name = "64B-runs",   .runs = 4,   .max_len = 64 },
+    { .name = "scattered",  .runs = 64,  .max_len = 4 },
+    { .name = "half-page",  .runs = 1,   .max_len = PAGE_SIZE / 2 },
+};
+
+static void fill_pages(const struct pattern *pat, uint8_t *old, uint8_t *new)
+{
+    for (int i = 0; i < PAGE_SIZE * NR_PAGES; i++) {
+        old[i] = g_random_int();
+    }
+    memcpy(new, old, PAGE_SIZE * NR_PAGES);
+
+    for (int p = 0; p < NR_PAGES; p++) {
+        uint8_t *page = new + p * PAGE_SIZE;
+
+        for (int r = 0; r < pat->runs; r++) {
+            int len = g_random_int_range(1, pat->max_len + 1);
+            int start = g_random_int_range(0, PAGE_SIZE - len + 1);
+
+            for (int j = start; j < start + len; j++) {
+                page[j] = ~page[j];
+            }
+        }
+    }
+}
+
+/* Returns the encode and decode throughput, in MB/s */
+static void run_benchmark(uint8_t *old, uint8_t *new, uint8_t *encoded,
+                          int *encoded_len, double *enc_mbs, double *dec_mbs)
+{
+    int64_t total_ns = 0, n_runs = 0;
+    uint8_t page[PAGE_SIZE];
+
+    while (total_ns < 2e8 || n_runs < 5) {
+        int64_t start_ns = get_clock();
+
+        for (int p = 0; p < NR_PAGES; p++) {
+            encoded_len[p] = xbzrle_encode_buffer(old + p * PAGE_SIZE,
+                                                  new + p * PAGE_SIZE,
+                                                  PAGE_SIZE,
+                                                  encoded + p * PAGE_SIZE,
+                                                  PAGE_SIZE);
+        }
+        total_ns += get_clock() - start_ns;
+        n_runs++;
+    }
+    *enc_mbs = (double)PAGE_SIZE * NR_PAGES * n_runs / total_ns * 1e3;
+
+    total_ns = n_runs = 0;
+    while (total_ns < 2e8 || n_runs < 5) {
+        int64_t start_ns = get_clock();
+
+        for (int p = 0; p < NR_PAGES; p++) {
+            if (encoded_len[p] > 0) {
+                xbzrle_decode_buffer(encoded + p * PAGE_SIZE, encoded_len[p],
+                                     page, PAGE_SIZE);
+            }
+        }
+        total_ns += get_clock() - start_ns;
+        n_runs++;
+    }
+    *dec_mbs = (double)PAGE_SIZE * NR_PAGES * n_runs / total_ns * 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *old = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *new = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *encoded = g_malloc(PAGE_SIZE * NR_PAGES);
+    int *encoded_len = g_new(int, NR_PAGES);
+    int impl = 0;
+
+    printf("# Units: MB/s of guest pages. Impl 0 is the host's preferred "
+           "encoder,\n# the following ones are the fallbacks in order.\n");
+    printf("%4s %10s %10s %10s %10s\n",
+           "Impl", "Pattern", "Encode", "Decode", "Ratio");
+
+    do {
+        for (int i = 0; i < ARRAY_SIZE(patterns); i++) {
+            double enc_mbs, dec_mbs;
+            uint64_t encoded_bytes = 0;
+
+            fill_pages(&patterns[i], old, new);
+            run_benchmark(old, new, encoded, encoded_len, &enc_mbs, &dec_mbs);
+
+            for (int p = 0; p < NR_PAGES; p++) {
+                encoded_bytes += encoded_len[p] > 0 ? encoded_len[p] :
+                                 encoded_len[p] == 0 ? 0 : PAGE_SIZE;
+            }
+            printf("%4d %10s %10.1f %10.1f %9.2f%%\n", impl, patterns[i].name,
+                   enc_mbs, dec_mbs,
+                   100.0 * encoded_bytes / (PAGE_SIZE * NR_PAGES));
+        }
+        impl++;
+    } while (xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(encoded);
+    g_free(encoded_len);
+
+    return 0;
+}
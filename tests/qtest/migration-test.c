@@ -1430,6 +1430,43 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *test_migrate_postcopy_prefetch_start(QTestState *from,
+                                                  QTestState *to)
+{
+    /* Prefetching only happens on the destination */
+    migrate_set_capability(to, "postcopy-ram", true);
+    migrate_set_capability(to, "x-postcopy-prefetch", true);
+
+    return NULL;
+}
+
+static void test_migrate_postcopy_prefetch_finish(QTestState *from,
+                                                  QTestState *to,
+                                                  void *opaque)
+{
+    QDict *rsp_return, *stats;
+
+    rsp_return = migrate_query_not_failed(to);
+    g_assert(qdict_haskey(rsp_return, "x-postcopy-prefetch"));
+    stats = qdict_get_qdict(rsp_return, "x-postcopy-prefetch");
+    g_assert(qdict_haskey(stats, "streams"));
+    g_assert(qdict_haskey(stats, "requested"));
+    g_assert(qdict_haskey(stats, "hits"));
+    g_assert(qdict_haskey(stats, "late"));
+    qobject_unref(rsp_return);
+}
+
+static void test_postcopy_preempt_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .start_hook = test_migrate_postcopy_prefetch_start,
+        .finish_hook = test_migrate_postcopy_prefetch_finish,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -2077,6 +2114,51 @@ static void test_precopy_unix_xbzrle(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_defer_hot_pages_start(QTestState *from,
+                                   QTestState *to)
+{
+    /* Source-only capability */
+    migrate_set_capability(from, "x-defer-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_precopy_unix_defer_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_migrate_defer_hot_pages_start,
+        /*
+         * The guest keeps rewriting all of its test memory, so chunks
+         * turn hot after a few passes and get deferred.
+         */
+        .iterations = 4,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void test_precopy_unix_bitmap_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .opts_source = "-global migration.x-bitmap-sync-threads=4",
+        },
+        .connect_uri = uri,
+        .listen_uri = uri,
+        /* Sync a few times so that the threads are reused */
+        .iterations = 4,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_compress(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2287,6 +2369,34 @@ static void test_multifd_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_multifd_mapped_ram_dio_start(QTestState *from,
+                                                  QTestState *to)
+{
+    migrate_multifd_mapped_ram_start(from, to);
+    migrate_set_parameter_bool(from, "direct-io", true);
+    migrate_set_parameter_bool(to, "direct-io", true);
+
+    return NULL;
+}
+
+static void test_multifd_file_mapped_ram_dio(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_multifd_mapped_ram_dio_start,
+    };
+
+    if (!probe_o_direct_support(tmpfs)) {
+        g_test_skip("Filesystem does not support O_DIRECT");
+        return;
+    }
+
+    test_file_common(&args, true);
+}
+
 
 static void test_precopy_tcp_plain(void)
 {
@@ -2752,6 +2862,26 @@ test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_adaptive_start(QTestState *from,
+                                                QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    /* Source-only capability */
+    migrate_set_capability(from, "x-multifd-adaptive", true);
+    return NULL;
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_device_state_start(QTestState *from,
+                                                    QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_capability(from, "x-multifd-device-state", true);
+    migrate_set_capability(to, "x-multifd-device-state", true);
+    return NULL;
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -2823,6 +2953,42 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_adaptive_start,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_device_state(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_device_state_start,
+    };
+    test_precopy_common(&args);
+}
+
+#define VIRTIO_DEVICE_STATE_OPTS \
+    "-blockdev driver=null-co,node-name=null0 " \
+    "-device virtio-blk-pci,drive=null0 -device virtio-net-pci"
+
+static void test_multifd_tcp_device_state_virtio(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .opts_source = VIRTIO_DEVICE_STATE_OPTS,
+            .opts_target = VIRTIO_DEVICE_STATE_OPTS,
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_device_state_start,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zlib(void)
 {
     MigrateCommon args = {
@@ -3589,6 +3755,8 @@ int main(int argc, char **argv)
                            test_postcopy_preempt);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
+        migration_test_add("/migration/postcopy/preempt/prefetch",
+                           test_postcopy_preempt_prefetch);
         if (getenv("QEMU_TEST_FLAKY_TESTS")) {
             migration_test_add("/migration/postcopy/compress/plain",
                                test_postcopy_compress);
@@ -3615,6 +3783,10 @@ int main(int argc, char **argv)
                        test_precopy_unix_plain);
     migration_test_add("/migration/precopy/unix/xbzrle",
                        test_precopy_unix_xbzrle);
+    migration_test_add("/migration/precopy/unix/defer-hot-pages",
+                       test_precopy_unix_defer_hot_pages);
+    migration_test_add("/migration/precopy/unix/bitmap-sync-threads",
+                       test_precopy_unix_bitmap_sync_threads);
     /*
      * Compression fails from time to time.
      * Put test here but don't enable it until everything is fixed.
@@ -3650,6 +3822,8 @@ int main(int argc, char **argv)
                        test_multifd_file_mapped_ram);
     migration_test_add("/migration/multifd/file/mapped-ram/live",
                        test_multifd_file_mapped_ram_live);
+    migration_test_add("/migration/multifd/file/mapped-ram/dio",
+                       test_multifd_file_mapped_ram_dio);
 
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/precopy/unix/tls/psk",
@@ -3738,6 +3912,15 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/adaptive",
+                       test_multifd_tcp_adaptive);
+    migration_test_add("/migration/multifd/tcp/plain/device-state",
+                       test_multifd_tcp_device_state);
+    if (qtest_has_device("virtio-blk-pci") &&
+        qtest_has_device("virtio-net-pci")) {
+        migration_test_add("/migration/multifd/tcp/plain/device-state/virtio",
+                           test_multifd_tcp_device_state_virtio);
+    }
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
@@ -18,6 +18,9 @@
 #include "qemu/error-report.h"
 #include "qemu/coroutine-core.h"
 #include "qemu/main-loop.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 static AioContext *ctx;
 
@@ -825,6 +828,175 @@ static void test_worker_thread_co_enter(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+#ifdef CONFIG_POSIX
+#define POLL_TEST_MAX_NS 4000000
+
+typedef struct {
+    EventNotifier e;
+    bool ready;
+    int n;
+} PollTestData;
+
+static void poll_test_read(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+
+    event_notifier_test_and_clear(e);
+    qatomic_set(&data->ready, false);
+    data->n++;
+}
+
+static bool poll_test_poll(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+
+    return qatomic_read(&data->ready);
+}
+
+/* Leaves the notifier set, so that the handler is ready in every aio_poll() */
+static void poll_test_busy_read(EventNotifier *e)
+{
+}
+
+static void *poll_test_fire(void *opaque)
+{
+    PollTestData *data = opaque;
+
+    g_usleep(1000);
+    qatomic_set(&data->ready, true);
+    event_notifier_set(&data->e);
+    return NULL;
+}
+
+/* An idle handler shrinks its polling time even if the waits are short */
+static void test_poll_per_handler(void)
+{
+    AioContext *poll_ctx = aio_context_new(&error_abort);
+    PollTestData idle = { .n = 0 };
+    EventNotifier busy;
+    int64_t start;
+    int i;
+
+    aio_context_set_poll_params(poll_ctx, POLL_TEST_MAX_NS, 2, 0,
+                                &error_abort);
+    event_notifier_init(&idle.e, false);
+    aio_set_event_notifier(poll_ctx, &idle.e, poll_test_read, poll_test_poll,
+                           poll_test_read);
+
+    /* Fire 1 ms after each wait starts, so that the polling time grows */
+    for (i = 0; i < 12; i++) {
+        QemuThread thread;
+        int n = idle.n;
+
+        qemu_thread_create(&thread, "poll-test", poll_test_fire, &idle,
+                           QEMU_THREAD_JOINABLE);
+        while (idle.n == n) {
+            aio_poll(poll_ctx, true);
+        }
+        qemu_thread_join(&thread);
+    }
+    g_assert_cmpint(poll_ctx->poll_ns, >=, 500000);
+
+    /* Keep the context busy through another handler, which never waits */
+    event_notifier_init(&busy, true);
+    aio_set_event_notifier(poll_ctx, &busy, poll_test_busy_read, NULL,
+                           NULL);
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start <
+           5 * POLL_TEST_MAX_NS) {
+        g_assert(aio_poll(poll_ctx, false));
+    }
+    g_assert_cmpint(poll_ctx->poll_ns, ==, 0);
+
+    aio_set_event_notifier(poll_ctx, &busy, NULL, NULL, NULL);
+    aio_set_event_notifier(poll_ctx, &idle.e, NULL, NULL, NULL);
+    event_notifier_cleanup(&busy);
+    event_notifier_cleanup(&idle.e);
+    aio_context_unref(poll_ctx);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct {
+    AioUringRequest req;
+    int *completed;
+} UringTestData;
+
+static void uring_test_cb(AioUringRequest *req)
+{
+    UringTestData *data = container_of(req, UringTestData, req);
+
+    g_assert_cmpint(req->res, ==, 0);
+    (*data->completed)++;
+}
+
+static void uring_submit_nops(AioContext *uring_ctx, struct io_uring *ring,
+                              UringTestData *data, int n, int *completed,
+                              bool now)
+{
+    struct io_uring_sqe *sqe;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        data[i] = (UringTestData) {
+            .req.cb = uring_test_cb,
+            .req.res = -EINPROGRESS,
+            .completed = completed,
+        };
+        sqe = io_uring_get_sqe(ring);
+        g_assert(sqe);
+        io_uring_prep_nop(sqe);
+        aio_uring_sqe_set_request(sqe, &data[i].req);
+    }
+    g_assert_cmpint(aio_uring_submit(uring_ctx, now), >=, 0);
+}
+
+static void test_uring_shared_ring(bool g_source)
+{
+    AioContext *uring_ctx = aio_context_new(&error_abort);
+    struct io_uring *ring = aio_uring_attach(uring_ctx);
+    UringTestData data[4];
+    int completed = 0;
+
+    if (!ring) {
+        aio_context_unref(uring_ctx);
+        g_test_skip("file descriptor monitoring does not use io_uring");
+        return;
+    }
+
+    /* The sqes go out with the io_uring_submit_and_wait() in aio_poll() */
+    uring_submit_nops(uring_ctx, ring, data, ARRAY_SIZE(data), &completed,
+                      false);
+    while (completed < ARRAY_SIZE(data)) {
+        aio_poll(uring_ctx, true);
+    }
+
+    if (g_source) {
+        /* The ring stays alive, completions arrive through its fd */
+        aio_context_use_g_source(uring_ctx);
+        completed = 0;
+        uring_submit_nops(uring_ctx, ring, data, ARRAY_SIZE(data), &completed,
+                          true);
+        while (completed < ARRAY_SIZE(data)) {
+            aio_poll(uring_ctx, true);
+        }
+    }
+
+    aio_uring_detach(uring_ctx);
+    aio_context_unref(uring_ctx);
+}
+
+static void test_uring_shared(void)
+{
+    test_uring_shared_ring(false);
+}
+
+static void test_uring_shared_g_source(void)
+{
+    test_uring_shared_ring(true);
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -847,9 +1019,16 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/poll/per-handler",        test_poll_per_handler);
+#endif
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/uring/shared",            test_uring_shared);
+    g_test_add_func("/aio/uring/shared/g-source",   test_uring_shared_g_source);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
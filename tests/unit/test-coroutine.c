@@ -449,6 +449,26 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that a coroutine that terminated without yielding is handed out
+ * again by the next create, so that its stack is still in the cache
+ */
+static void test_reuse(void)
+{
+    Coroutine *co1, *co2;
+    bool done = false;
+
+    co1 = qemu_coroutine_create(set_and_exit, &done);
+    qemu_coroutine_enter(co1);
+    g_assert(done);
+
+    done = false;
+    co2 = qemu_coroutine_create(set_and_exit, &done);
+    g_assert(co2 == co1);
+    qemu_coroutine_enter(co2);
+    g_assert(done);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -647,6 +667,7 @@ int main(int argc, char **argv)
      */
     if (IS_ENABLED(CONFIG_COROUTINE_POOL)) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+        g_test_add_func("/basic/reuse", test_reuse);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
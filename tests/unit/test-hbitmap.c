@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
 #include "block/block.h"
@@ -1042,6 +1043,85 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void test_hbitmap_compressed_set_reset(TestHBitmapData *data,
+                                              const void *unused)
+{
+    size_t empty_usage;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_set_compressed(data->hb, true);
+    g_assert_true(hbitmap_is_compressed(data->hb));
+    empty_usage = hbitmap_memory_usage(data->hb);
+
+    /* Whole chunks share storage whether they are clear or set */
+    hbitmap_test_set(data, 0, L3 * 2);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty_usage);
+
+    hbitmap_test_reset(data, L3 / 2 + 7, L3);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), >, empty_usage);
+    hbitmap_test_set(data, L3 / 2 + 100, 3);
+    hbitmap_test_reset(data, 0, L3 * 2);
+    hbitmap_test_set(data, L3 - 1, 2);
+    hbitmap_test_check_get(data);
+
+    hbitmap_test_reset_all(data);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty_usage);
+}
+
+/* A compressed bitmap must behave exactly like a dense one */
+static void test_hbitmap_compressed_equiv(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint64_t size = L3 * 2 + 123;
+    HBitmap *dense = hbitmap_alloc(size, 0);
+    HBitmap *compr = hbitmap_alloc_compressed(size, 0);
+    HBitmap *other = hbitmap_alloc_compressed(size, 0);
+    uint64_t ssize = hbitmap_serialization_size(dense, 0, size);
+    g_autofree uint8_t *buf1 = g_malloc(ssize);
+    g_autofree uint8_t *buf2 = g_malloc(ssize);
+    char *hash1, *hash2;
+
+    hbitmap_set(dense, 0, size);
+    hbitmap_set(compr, 0, size);
+    hbitmap_reset(dense, L2 + 5, L3);
+    hbitmap_reset(compr, L2 + 5, L3);
+    hbitmap_set(other, L3 + 1, L2);
+    hbitmap_merge(dense, other, dense);
+    hbitmap_merge(compr, other, compr);
+    g_assert_cmpint(hbitmap_count(dense), ==, hbitmap_count(compr));
+
+    hbitmap_serialize_part(dense, buf1, 0, size);
+    hbitmap_serialize_part(compr, buf2, 0, size);
+    g_assert_cmpmem(buf1, ssize, buf2, ssize);
+
+    hash1 = hbitmap_sha256(dense, &error_abort);
+    hash2 = hbitmap_sha256(compr, &error_abort);
+    g_assert_cmpstr(hash1, ==, hash2);
+    g_free(hash1);
+    g_free(hash2);
+
+    /* Round trip through deserialization and truncation */
+    hbitmap_deserialize_zeroes(compr, 0, size, true);
+    g_assert_cmpint(hbitmap_count(compr), ==, 0);
+    hbitmap_deserialize_part(compr, buf1, 0, size, true);
+    g_assert_cmpint(hbitmap_count(dense), ==, hbitmap_count(compr));
+
+    hbitmap_truncate(dense, L3 + 3);
+    hbitmap_truncate(compr, L3 + 3);
+    hbitmap_truncate(dense, size);
+    hbitmap_truncate(compr, size);
+    hbitmap_set_compressed(compr, false);
+    g_assert_false(hbitmap_is_compressed(compr));
+    hbitmap_serialize_part(dense, buf1, 0, size);
+    hbitmap_serialize_part(compr, buf2, 0, size);
+    g_assert_cmpmem(buf1, ssize, buf2, ssize);
+    g_assert_cmpint(hbitmap_count(dense), ==, hbitmap_count(compr));
+
+    hbitmap_free(other);
+    hbitmap_free(compr);
+    hbitmap_free(dense);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1193,11 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/compressed/set_reset",
+                     test_hbitmap_compressed_set_reset);
+    hbitmap_test_add("/hbitmap/compressed/equiv",
+                     test_hbitmap_compressed_equiv);
+
     g_test_run();
 
     return 0;
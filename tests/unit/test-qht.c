@@ -7,12 +7,18 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #define N 5000
 
 static struct qht ht;
 static int32_t arr[N * 2];
 
+#define N_LOOKUP_THREADS 4
+
+static bool lookup_stop;
+static unsigned int lookup_passes;
+
 static bool is_equal(const void *ap, const void *bp)
 {
     const int32_t *a = ap;
@@ -107,10 +113,14 @@ static void count_func(void *p, uint32_t hash, void *userp)
 
 static void check_n(size_t expected)
 {
+    struct qht_counters counters;
     struct qht_stats stats;
 
     qht_statistics_init(&ht, &stats);
     g_assert_cmpuint(stats.entries, ==, expected);
+    qht_counters_read(&ht, &counters);
+    g_assert_cmpuint(counters.entries, ==, expected);
+    g_assert_cmpuint(counters.head_buckets, ==, stats.head_buckets);
     qht_statistics_destroy(&stats);
 }
 
@@ -251,10 +261,109 @@ static void test_resize(void)
     qht_test(QHT_MODE_AUTO_RESIZE);
 }
 
+/* Lookups, insertions and removals while an automatic resize is half done */
+static void test_resize_incremental(void)
+{
+    struct qht_counters counters;
+    int i;
+
+    qht_init(&ht, is_equal, 0, QHT_MODE_AUTO_RESIZE);
+    for (i = 0; i < N; i++) {
+        insert(i, i + 1);
+        qht_counters_read(&ht, &counters);
+        if (counters.migrating) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, N);
+    g_assert_cmpuint(counters.resizes, >, 0);
+
+    check(0, i + 1, true);
+    check(i + 1, N, false);
+    check_n(i + 1);
+    rm(0, i / 2);
+    check(0, i / 2, false);
+    check(i / 2, i + 1, true);
+    check_n(i + 1 - i / 2);
+
+    /* removals help the migration along, so it has finished by now */
+    qht_counters_read(&ht, &counters);
+    g_assert_cmpuint(counters.migrating, ==, 0);
+    insert(0, i / 2);
+    insert(i + 1, N);
+    check(0, N, true);
+    check_n(N);
+    iter_check(N);
+
+    qht_destroy(&ht);
+}
+
+/*
+ * Threads that keep looking up the entries below N / 4, which are never
+ * removed, while the table grows under them.
+ */
+static void *lookup_thread(void *opaque)
+{
+    rcu_register_thread();
+    while (!qatomic_read(&lookup_stop)) {
+        int i;
+
+        rcu_read_lock();
+        for (i = 0; i < N / 4; i++) {
+            int32_t val = i;
+
+            g_assert_nonnull(qht_lookup(&ht, &val, i));
+        }
+        rcu_read_unlock();
+        qatomic_inc(&lookup_passes);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_resize_concurrent_lookup(void)
+{
+    QemuThread threads[N_LOOKUP_THREADS];
+    struct qht_counters counters;
+    int i;
+
+    qht_init(&ht, is_equal, 0, QHT_MODE_AUTO_RESIZE);
+    insert(0, N / 4);
+    qht_counters_read(&ht, &counters);
+    g_assert_cmpuint(counters.migrating, ==, 0);
+
+    qatomic_set(&lookup_stop, false);
+    qatomic_set(&lookup_passes, 0);
+    for (i = 0; i < N_LOOKUP_THREADS; i++) {
+        qemu_thread_create(&threads[i], "qht-lookup", lookup_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (qatomic_read(&lookup_passes) < N_LOOKUP_THREADS) {
+        g_usleep(1000);
+    }
+
+    /* grow the table a few times while the lookups run */
+    insert(N / 4, N * 2);
+
+    qatomic_set(&lookup_stop, true);
+    for (i = 0; i < N_LOOKUP_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    qht_counters_read(&ht, &counters);
+    g_assert_cmpuint(counters.resizes, >, 0);
+    check(0, N * 2, true);
+    check_n(N * 2);
+
+    qht_destroy(&ht);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/qht/mode/default", test_default);
     g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/resize/incremental", test_resize_incremental);
+    g_test_add_func("/qht/resize/concurrent-lookup",
+                    test_resize_concurrent_lookup);
     return g_test_run();
 }
@@ -134,6 +134,23 @@ static void test_submit_many(void)
     }
 }
 
+static void test_stats(void)
+{
+    ThreadPool *pool = aio_get_thread_pool(ctx);
+    ThreadPoolStats before, after;
+
+    thread_pool_get_stats(pool, &before);
+    test_submit_many();
+    thread_pool_get_stats(pool, &after);
+
+    g_assert_cmpuint(after.requests, ==, before.requests + 100);
+    g_assert_cmpint(after.queue_depth, ==, 0);
+    g_assert_cmpint(after.threads, >, 0);
+    g_assert_cmpint(after.threads, <=, THREAD_POOL_MAX_THREADS_DEFAULT);
+    g_assert_cmpuint(after.steals, <=, after.requests);
+    g_assert(!after.shared);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -240,6 +257,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -22,6 +22,10 @@
 #include "qemu/module.h"
 #include "block/throttle-groups.h"
 #include "sysemu/block-backend.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
+#include "qom/qom-qobject.h"
 
 static AioContext     *ctx;
 static LeakyBucket    bkt;
@@ -801,6 +805,151 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+static void coroutine_fn write_entry(void *opaque)
+{
+    ThrottleGroupMember *member = opaque;
+
+    throttle_group_co_io_limits_intercept(member, 4096, THROTTLE_WRITE);
+}
+
+static QDict *get_member_stats(Object *group, const char *name)
+{
+    QObject *obj = object_property_get_qobject(group, "stats", &error_abort);
+    QList *members = qdict_get_qlist(qobject_to(QDict, obj), "members");
+    QListEntry *entry;
+    QDict *found = NULL;
+
+    QLIST_FOREACH_ENTRY(members, entry) {
+        QDict *stats = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(stats, "name"), name)) {
+            found = qobject_ref(stats);
+        }
+    }
+    qobject_unref(obj);
+
+    g_assert(found);
+    return found;
+}
+
+static uint64_t get_wait_count(QDict *stats, const char *direction)
+{
+    QList *bins = qdict_get_qlist(qdict_get_qdict(stats, direction), "bins");
+    QListEntry *entry;
+    uint64_t count = 0;
+
+    QLIST_FOREACH_ENTRY(bins, entry) {
+        count += qnum_get_uint(qobject_to(QNum, qlist_entry_obj(entry)));
+    }
+    return count;
+}
+
+static void test_groups_nested(void)
+{
+    ThrottleGroupMember member = { 0 };
+    Object *parent, *child;
+    QDict *stats;
+
+    parent = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                   object_get_objects_root(), "parent0",
+                                   &error_abort,
+                                   "scheduler", "weighted-fair",
+                                   NULL);
+    child = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                  object_get_objects_root(), "child0",
+                                  &error_abort,
+                                  "parent", "parent0",
+                                  "weight", "300",
+                                  "reservation", "1048576",
+                                  NULL);
+
+    throttle_group_register_tgm(&member, "child0", ctx);
+    throttle_group_set_member_params(&member, "disk0", 50, 0);
+
+    /* No limits are set, so the request passes both groups immediately */
+    qemu_coroutine_enter(qemu_coroutine_create(write_entry, &member));
+
+    stats = get_member_stats(child, "disk0");
+    g_assert_cmpint(qdict_get_int(stats, "weight"), ==, 50);
+    g_assert_cmpint(get_wait_count(stats, "write-wait"), ==, 1);
+    g_assert_cmpint(get_wait_count(stats, "read-wait"), ==, 0);
+    qobject_unref(stats);
+
+    /* The child group is a member of the parent group */
+    stats = get_member_stats(parent, "child0");
+    g_assert_cmpint(qdict_get_int(stats, "weight"), ==, 300);
+    g_assert_cmpint(qdict_get_int(stats, "reservation"), ==, 1048576);
+    g_assert_cmpint(get_wait_count(stats, "write-wait"), ==, 1);
+    qobject_unref(stats);
+
+    throttle_group_unregister_tgm(&member);
+    object_unparent(child);
+    object_unparent(parent);
+}
+
+typedef struct {
+    ThrottleGroupMember *member;
+    bool done;
+} DrainWriteData;
+
+static void coroutine_fn drain_write_entry(void *opaque)
+{
+    DrainWriteData *data = opaque;
+
+    throttle_group_co_io_limits_intercept(data->member, 4096, THROTTLE_WRITE);
+    data->done = true;
+}
+
+static void test_groups_nested_drain(void)
+{
+    ThrottleGroupMember member = { 0 };
+    DrainWriteData data[3];
+    Object *parent, *child;
+    int i;
+
+    /* Only the parent has a limit: one write per second */
+    parent = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                   object_get_objects_root(), "parent1",
+                                   &error_abort,
+                                   "x-iops-write", "1",
+                                   NULL);
+    child = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                  object_get_objects_root(), "child1",
+                                  &error_abort,
+                                  "parent", "parent1",
+                                  NULL);
+    throttle_group_register_tgm(&member, "child1", ctx);
+
+    /* The first write passes, the others wait in the parent group */
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = (DrainWriteData) { .member = &member };
+        qemu_coroutine_enter(qemu_coroutine_create(drain_write_entry,
+                                                   &data[i]));
+    }
+    g_assert_true(data[0].done);
+    g_assert_false(data[1].done);
+    g_assert_false(data[2].done);
+
+    /* Draining the member releases them without waiting for the timer */
+    qatomic_inc(&member.io_limits_disabled);
+    throttle_group_restart_tgm(&member);
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_true(data[1].done);
+    g_assert_true(data[2].done);
+
+    /* New requests of the drained member don't wait in the parent either */
+    data[0] = (DrainWriteData) { .member = &member };
+    qemu_coroutine_enter(qemu_coroutine_create(drain_write_entry, &data[0]));
+    g_assert_true(data[0].done);
+    qatomic_dec(&member.io_limits_disabled);
+
+    throttle_group_unregister_tgm(&member);
+    object_unparent(child);
+    object_unparent(parent);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -830,6 +979,9 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/nested",      test_groups_nested);
+    g_test_add_func("/throttle/groups/nested/drain",
+                    test_groups_nested_drain);
     return g_test_run();
 }
 
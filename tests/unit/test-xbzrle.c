@@ -173,6 +173,81 @@ static void test_encode_decode(void)
     }
 }
 
+/* Rewrite @runs random byte ranges of @buf, up to @max_len bytes each */
+static void dirty_random_runs(uint8_t *buf, int runs, int max_len)
+{
+    int i, j;
+
+    for (i = 0; i < runs; i++) {
+        int len = g_test_rand_int_range(1, max_len + 1);
+        int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE - len + 1);
+
+        for (j = start; j < start + len; j++) {
+            buf[j] = ~buf[j];
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    const int npages = 256;
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE * npages);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE * npages);
+    /* Large enough for any encoding, so that no implementation gives up */
+    const int max_dlen = 2 * XBZRLE_PAGE_SIZE;
+    uint8_t *ref = g_malloc(max_dlen * npages);
+    int *ref_len = g_new(int, npages);
+    uint8_t *compressed = g_malloc(max_dlen);
+    uint8_t *decoded = g_malloc(XBZRLE_PAGE_SIZE);
+    bool first = true;
+    int i;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE * npages; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_PAGE_SIZE * npages);
+    for (i = 0; i < npages; i++) {
+        /* from a few short runs to pages rewritten almost entirely */
+        dirty_random_runs(new + i * XBZRLE_PAGE_SIZE, i % 64, 1 + i % 200);
+    }
+
+    /* Every implementation must produce the very same stream */
+    do {
+        for (i = 0; i < npages; i++) {
+            uint8_t *o = old + i * XBZRLE_PAGE_SIZE;
+            uint8_t *n = new + i * XBZRLE_PAGE_SIZE;
+            int dlen = xbzrle_encode_buffer(o, n, XBZRLE_PAGE_SIZE,
+                                            compressed, max_dlen);
+
+            g_assert_cmpint(dlen, >=, 0);
+            if (first) {
+                ref_len[i] = dlen;
+                memcpy(ref + i * max_dlen, compressed, dlen);
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                g_assert(memcmp(ref + i * max_dlen, compressed, dlen) == 0);
+            }
+
+            if (dlen > 0) {
+                memcpy(decoded, o, XBZRLE_PAGE_SIZE);
+                g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen,
+                                                     decoded,
+                                                     XBZRLE_PAGE_SIZE),
+                                <=, XBZRLE_PAGE_SIZE);
+                g_assert(memcmp(decoded, n, XBZRLE_PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(ref_len);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +260,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Keep last: it leaves the least preferred implementation selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -431,6 +431,7 @@ void aio_dispatch(AioContext *ctx)
 static bool run_poll_handlers_once(AioContext *ctx,
                                    AioHandlerList *ready_list,
                                    int64_t now,
+                                   int64_t elapsed_time,
                                    int64_t *timeout)
 {
     bool progress = false;
@@ -438,6 +439,16 @@ static bool run_poll_handlers_once(AioContext *ctx,
     AioHandler *tmp;
 
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
+        /*
+         * After the first round, only poll handlers whose polling time has
+         * not run out yet.  Polling everything once per run makes sure that
+         * a busy handler does not starve the others while poll mode stays
+         * enabled.
+         */
+        if (elapsed_time && elapsed_time >= node->poll_ns) {
+            continue;
+        }
+
         if (node->io_poll(node->opaque)) {
             aio_add_poll_ready_handler(ready_list, node);
 
@@ -540,14 +551,23 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
     RCU_READ_LOCK_GUARD();
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed_time = 0;
     do {
-        progress = run_poll_handlers_once(ctx, ready_list,
-                                          start_time, timeout);
+        progress = run_poll_handlers_once(ctx, ready_list, start_time,
+                                          elapsed_time, timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    /* Polling ends early when it found an event */
+    if (*timeout == 0 || elapsed_time < max_ns) {
+        stat64_inc(&ctx->poll_hits);
+    } else {
+        stat64_inc(&ctx->poll_misses);
+        stat64_add(&ctx->poll_wasted_ns, elapsed_time);
+    }
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -584,7 +604,8 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
         return false;
     }
 
-    max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    max_ns = qemu_soonest_timeout(*timeout,
+                                  MIN(ctx->poll_ns, ctx->poll_max_ns));
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         /*
          * Enable poll mode. It pairs with the poll_set_started() in
@@ -599,6 +620,82 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
     return false;
 }
 
+static void adjust_polling_time(AioContext *ctx, AioHandler *node,
+                                int64_t block_ns)
+{
+    int64_t old = node->poll_ns;
+
+    if (block_ns <= node->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            node->poll_ns /= ctx->poll_shrink;
+        } else {
+            node->poll_ns = 0;
+        }
+
+        trace_poll_shrink(ctx, node, old, node->poll_ns);
+    } else if (node->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (node->poll_ns) {
+            node->poll_ns *= grow;
+        } else {
+            node->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        trace_poll_grow(ctx, node, old, node->poll_ns);
+    }
+
+    /* poll_max_ns may have been lowered since the last adjustment */
+    node->poll_ns = MIN(node->poll_ns, ctx->poll_max_ns);
+}
+
+/*
+ * Learn how soon each handler fires after aio_poll() starts waiting.  Handlers
+ * that fired adjust their polling time to the time it took.  Handlers that
+ * did not fire for longer than the maximum polling time are unlikely to do so
+ * soon and shrink theirs, once per such period.  This is measured from when
+ * they last fired rather than from the start of this wait, because a busy
+ * handler keeps each wait short, so that idle handlers stop costing CPU time
+ * while handlers with frequent events keep being polled.
+ */
+static void adjust_polling_times(AioContext *ctx, AioHandlerList *ready_list,
+                                 int64_t now, int64_t block_ns)
+{
+    AioHandler *node;
+    int64_t poll_ns = 0;
+
+    QLIST_FOREACH(node, ready_list, node_ready) {
+        if (node->io_poll) {
+            adjust_polling_time(ctx, node, block_ns);
+            node->poll_last_ns = now;
+        }
+    }
+
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        if (!QLIST_IS_INSERTED(node, node_ready)) {
+            int64_t idle_ns = now - node->poll_last_ns;
+
+            if (!node->poll_last_ns) {
+                node->poll_last_ns = now;
+            } else if (idle_ns > ctx->poll_max_ns) {
+                adjust_polling_time(ctx, node, idle_ns);
+                node->poll_last_ns = now;
+            }
+        }
+        poll_ns = MAX(poll_ns, node->poll_ns);
+    }
+
+    ctx->poll_ns = poll_ns;
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
@@ -680,43 +777,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* Adjust polling time */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
-
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
+        adjust_polling_times(ctx, &ready_list, now, now - start);
     }
 
     progress |= aio_bh_poll(ctx);
@@ -777,13 +840,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     aio_notify(ctx);
 }
 
-void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
+void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
+                                int64_t sqpoll_idle_ms, bool unified_ring)
 {
     /*
      * No thread synchronization here, it doesn't matter if an incorrect value
      * is used once.
      */
     ctx->aio_max_batch = max_batch;
+    ctx->aio_sqpoll_idle_ms = sqpoll_idle_ms;
+    ctx->aio_unified_ring = unified_ring;
 
     aio_notify(ctx);
 }
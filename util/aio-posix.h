@@ -37,6 +37,8 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_ns; /* how long to poll this handler for */
+    int64_t poll_last_ns; /* when poll_ns was last adjusted, 0 if never */
     bool poll_ready; /* has polling detected an event? */
 };
 
@@ -384,6 +384,13 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+#ifdef HAVE_NVME_URING_CMD
+    if (ctx->linux_io_uring_cmd) {
+        luring_detach_aio_context(ctx->linux_io_uring_cmd, ctx);
+        luring_cleanup(ctx->linux_io_uring_cmd);
+        ctx->linux_io_uring_cmd = NULL;
+    }
+#endif
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
@@ -437,7 +444,8 @@ GSource *aio_get_g_source(AioContext *ctx)
 ThreadPool *aio_get_thread_pool(AioContext *ctx)
 {
     if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_new(ctx);
+        /* Other threads may look at its statistics */
+        qatomic_store_release(&ctx->thread_pool, thread_pool_new(ctx));
     }
     return ctx->thread_pool;
 }
@@ -468,9 +476,15 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    /* A submission queue polling thread needs a ring of its own */
+    if (ctx->aio_unified_ring && !ctx->aio_sqpoll_idle_ms) {
+        ctx->linux_io_uring = luring_init_shared(ctx);
+    }
     if (!ctx->linux_io_uring) {
-        return NULL;
+        ctx->linux_io_uring = luring_init(ctx->aio_sqpoll_idle_ms, false, errp);
+        if (!ctx->linux_io_uring) {
+            return NULL;
+        }
     }
 
     luring_attach_aio_context(ctx->linux_io_uring, ctx);
@@ -482,6 +496,29 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
     assert(ctx->linux_io_uring);
     return ctx->linux_io_uring;
 }
+
+#ifdef HAVE_NVME_URING_CMD
+LuringState *aio_setup_linux_io_uring_cmd(AioContext *ctx, Error **errp)
+{
+    if (ctx->linux_io_uring_cmd) {
+        return ctx->linux_io_uring_cmd;
+    }
+
+    ctx->linux_io_uring_cmd = luring_init(ctx->aio_sqpoll_idle_ms, true, errp);
+    if (!ctx->linux_io_uring_cmd) {
+        return NULL;
+    }
+
+    luring_attach_aio_context(ctx->linux_io_uring_cmd, ctx);
+    return ctx->linux_io_uring_cmd;
+}
+
+LuringState *aio_get_linux_io_uring_cmd(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring_cmd);
+    return ctx->linux_io_uring_cmd;
+}
+#endif
 #endif
 
 void aio_notify(AioContext *ctx)
@@ -602,6 +639,9 @@ AioContext *aio_context_new(Error **errp)
 
 #ifdef CONFIG_LINUX_IO_URING
     ctx->linux_io_uring = NULL;
+#ifdef HAVE_NVME_URING_CMD
+    ctx->linux_io_uring_cmd = NULL;
+#endif
 #endif
 
     ctx->thread_pool = NULL;
@@ -614,9 +654,13 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_shrink = 0;
 
     ctx->aio_max_batch = 0;
+    ctx->aio_sqpoll_idle_ms = 0;
+    ctx->aio_unified_ring = false;
 
     ctx->thread_pool_min = 0;
     ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    ctx->thread_pool_shared = false;
+    ctx->thread_pool_context = NULL;
 
     register_aiocontext(ctx);
 
@@ -743,7 +787,9 @@ void qemu_set_current_aio_context(AioContext *ctx)
 }
 
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
-                                        int64_t max, Error **errp)
+                                        int64_t max, bool shared,
+                                        struct ThreadContext *tc,
+                                        Error **errp)
 {
 
     if (min > max || !max || min > INT_MAX || max > INT_MAX) {
@@ -753,6 +799,8 @@ void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
 
     ctx->thread_pool_min = min;
     ctx->thread_pool_max = max;
+    ctx->thread_pool_shared = shared;
+    ctx->thread_pool_context = tc;
 
     if (ctx->thread_pool) {
         thread_pool_update_params(ctx->thread_pool, ctx);
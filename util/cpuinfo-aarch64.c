@@ -53,7 +53,7 @@ unsigned __attribute__((constructor)) cpuinfo_init(void)
         return info;
     }
 
-    info = CPUINFO_ALWAYS;
+    info = CPUINFO_ALWAYS | CPUINFO_ASIMD;
 
 #ifdef CONFIG_LINUX
     unsigned long hwcap = qemu_getauxval(AT_HWCAP);
@@ -20,8 +20,12 @@
  *    epoll(7).
  *
  * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * I/O itself.  However, other code in the AioContext's home thread can submit
+ * requests on the same ring with aio_uring_attach().  Their sqes are then
+ * submitted by the io_uring_submit_and_wait() call that waits for events, and
+ * their completions are dispatched from aio_poll() through ctx->uring_node.
+ * Their user_data is tagged with FDMON_IO_URING_REQUEST so that they can be
+ * told apart from AioHandlers.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -37,14 +41,20 @@
  * io_uring calls the submission queue the "sq ring" and the completion queue
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
- * The code is structured so that sq/cq rings are only modified within
- * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
- * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
- * and/or IORING_OP_POLL_REMOVE sqes for them.
+ * The code is structured so that sq/cq rings are only modified in the home
+ * thread, and the cq ring only within fdmon_io_uring_wait().  Changes to
+ * AioHandlers are made by enqueuing them on ctx->submit_list so that
+ * fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD and/or
+ * IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * If the AioContext switches to glib, the ring stays alive for as long as
+ * there are attached users.  Its fd is then monitored like any other and only
+ * request completions are processed.
  */
 
 #include "qemu/osdep.h"
 #include <poll.h>
+#include "qemu/defer-call.h"
 #include "qemu/rcu_queue.h"
 #include "aio-posix.h"
 
@@ -55,6 +65,9 @@ enum {
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+
+    /* Tag in the user_data of AioUringRequests, which are aligned */
+    FDMON_IO_URING_REQUEST  = 1,
 };
 
 static inline int poll_events_from_pfd(int pfd_events)
@@ -221,6 +234,40 @@ static void fill_sq_ring(AioContext *ctx)
     }
 }
 
+/* Queue the completion of an AioUringRequest, returns false for other cqes */
+static bool process_request_cqe(AioContext *ctx, struct io_uring_cqe *cqe)
+{
+    uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    AioUringRequest *req;
+
+    if (!(data & FDMON_IO_URING_REQUEST)) {
+        return false;
+    }
+
+    req = (AioUringRequest *)(data & ~(uintptr_t)FDMON_IO_URING_REQUEST);
+    req->res = cqe->res;
+    QSIMPLEQ_INSERT_TAIL(&ctx->uring_completed, req, next);
+    return true;
+}
+
+/* ctx->uring_node's io_read callback */
+static void complete_requests(void *opaque)
+{
+    AioContext *ctx = opaque;
+    AioUringRequest *req;
+
+    /* Batch the requests that completion callbacks submit */
+    defer_call_begin();
+
+    /* Callbacks may run a nested event loop, which then takes over */
+    while ((req = QSIMPLEQ_FIRST(&ctx->uring_completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->uring_completed, next);
+        req->cb(req);
+    }
+
+    defer_call_end();
+}
+
 /* Returns true if a handler became ready */
 static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
@@ -234,6 +281,10 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    if (process_request_cqe(ctx, cqe)) {
+        return false;
+    }
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -269,6 +320,11 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     }
 
     io_uring_cq_advance(ring, num_cqes);
+
+    if (!QSIMPLEQ_EMPTY(&ctx->uring_completed)) {
+        aio_add_ready_handler(ready_list, ctx->uring_node, G_IO_IN);
+        num_ready++;
+    }
     return num_ready;
 }
 
@@ -321,6 +377,85 @@ static const FDMonOps fdmon_io_uring_ops = {
     .need_wait = fdmon_io_uring_need_wait,
 };
 
+struct io_uring *aio_uring_attach(AioContext *ctx)
+{
+    if (ctx->fdmon_ops != &fdmon_io_uring_ops) {
+        return NULL;
+    }
+
+    ctx->uring_users++;
+    return &ctx->fdmon_io_uring;
+}
+
+void aio_uring_sqe_set_request(struct io_uring_sqe *sqe, AioUringRequest *req)
+{
+    uintptr_t data = (uintptr_t)req;
+
+    assert(!(data & FDMON_IO_URING_REQUEST));
+    io_uring_sqe_set_data(sqe, (void *)(data | FDMON_IO_URING_REQUEST));
+}
+
+int aio_uring_submit(AioContext *ctx, bool now)
+{
+    int ret;
+
+    /* aio_poll() will submit the sqes in fdmon_io_uring_wait() */
+    if (!now && ctx->fdmon_ops == &fdmon_io_uring_ops) {
+        return 0;
+    }
+
+    do {
+        ret = io_uring_submit(&ctx->fdmon_io_uring);
+    } while (ret == -EINTR);
+    return ret;
+}
+
+/* Processes request completions after switching to glib */
+static void fdmon_io_uring_shared_read(void *opaque)
+{
+    AioContext *ctx = opaque;
+    struct io_uring *ring = &ctx->fdmon_io_uring;
+    struct io_uring_cqe *cqe;
+    unsigned num_cqes = 0;
+    unsigned head;
+
+    /* Ignore AioHandlers, their poll requests were all cancelled */
+    io_uring_for_each_cqe(ring, head, cqe) {
+        process_request_cqe(ctx, cqe);
+        num_cqes++;
+    }
+    io_uring_cq_advance(ring, num_cqes);
+
+    complete_requests(ctx);
+}
+
+static bool fdmon_io_uring_shared_poll(void *opaque)
+{
+    AioContext *ctx = opaque;
+
+    return io_uring_cq_ready(&ctx->fdmon_io_uring);
+}
+
+static void fdmon_io_uring_exit(AioContext *ctx)
+{
+    io_uring_queue_exit(&ctx->fdmon_io_uring);
+    g_free(ctx->uring_node);
+    ctx->uring_node = NULL;
+}
+
+void aio_uring_detach(AioContext *ctx)
+{
+    assert(ctx->uring_users > 0);
+    assert(QSIMPLEQ_EMPTY(&ctx->uring_completed));
+
+    if (--ctx->uring_users == 0 && ctx->fdmon_ops != &fdmon_io_uring_ops) {
+        /* Last user after fdmon_io_uring_destroy() kept the ring alive */
+        aio_set_fd_handler(ctx, ctx->fdmon_io_uring.ring_fd,
+                           NULL, NULL, NULL, NULL, NULL);
+        fdmon_io_uring_exit(ctx);
+    }
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -331,6 +466,16 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    QSIMPLEQ_INIT(&ctx->uring_completed);
+    ctx->uring_users = 0;
+
+    /* Not a real fd handler, only ever dispatched from process_cq_ring() */
+    ctx->uring_node = g_new0(AioHandler, 1);
+    ctx->uring_node->pfd.fd = -1;
+    ctx->uring_node->pfd.events = G_IO_IN;
+    ctx->uring_node->io_read = complete_requests;
+    ctx->uring_node->opaque = ctx;
+
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -339,8 +484,11 @@ void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
+        bool keep = ctx->uring_users > 0;
 
-        io_uring_queue_exit(&ctx->fdmon_io_uring);
+        if (!keep) {
+            fdmon_io_uring_exit(ctx);
+        }
 
         /* Move handlers due to be removed onto the deleted list */
         while ((node = QSLIST_FIRST_RCU(&ctx->submit_list))) {
@@ -350,6 +498,9 @@ void fdmon_io_uring_destroy(AioContext *ctx)
                       FDMON_IO_URING_REMOVE));
 
             if (flags & FDMON_IO_URING_REMOVE) {
+                if (keep) {
+                    add_poll_remove_sqe(ctx, node);
+                }
                 QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node, node_deleted);
             }
 
@@ -357,5 +508,23 @@ void fdmon_io_uring_destroy(AioContext *ctx)
         }
 
         ctx->fdmon_ops = &fdmon_poll_ops;
+
+        if (keep) {
+            /*
+             * Block I/O keeps using the ring.  Cancel fd monitoring, whose
+             * cqes fdmon_io_uring_shared_read() ignores, and let the ring fd
+             * report completions from now on.
+             */
+            QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+                if (!QLIST_IS_INSERTED(node, node_deleted)) {
+                    add_poll_remove_sqe(ctx, node);
+                }
+            }
+            aio_uring_submit(ctx, true);
+            aio_set_fd_handler(ctx, ctx->fdmon_io_uring.ring_fd,
+                               fdmon_io_uring_shared_read, NULL,
+                               fdmon_io_uring_shared_poll,
+                               fdmon_io_uring_shared_read, ctx);
+        }
     }
 }
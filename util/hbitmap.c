@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/cutils.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -50,8 +51,31 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which takes up almost all of the memory, is split into
+ * chunks of HB_CHUNK_WORDS words.  In a compressed bitmap, chunks whose bits
+ * are all clear or all set have no storage of their own but point to one of
+ * two shared, read-only chunks, so a bitmap of a huge disk costs memory only
+ * for the regions that are partially dirty.  Operations on whole chunks (set,
+ * reset, merge, count, searching for a zero bit) then take constant time.
+ * A dense bitmap uses private storage for all chunks and never shares them.
+ *
+ * Shared chunks are given private storage when a bit in them changes.
+ * Private chunks go back to being shared when a set or reset covers the
+ * whole chunk, and when the bitmap is rebuilt by hbitmap_reset_all,
+ * hbitmap_merge or deserialization; other operations leave them private.
+ * Iterators only remember word indices, so this is invisible to them.
  */
 
+#define HB_CHUNK_SHIFT  9
+#define HB_CHUNK_WORDS  (1ULL << HB_CHUNK_SHIFT)
+#define HB_CHUNK_BITS   (HB_CHUNK_WORDS << BITS_PER_LEVEL)
+
+static const unsigned long hb_zero_chunk[HB_CHUNK_WORDS];
+static const unsigned long hb_ones_chunk[HB_CHUNK_WORDS] = {
+    [0 ... HB_CHUNK_WORDS - 1] = ~0UL,
+};
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -94,13 +118,141 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * The last level is not stored here but in @chunks.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* The last level, HB_CHUNK_WORDS words per chunk (the last chunk may
+     * be shorter).  Entries point either to private storage or, for
+     * compressed bitmaps, to hb_zero_chunk or hb_ones_chunk.
+     */
+    unsigned long **chunks;
+    uint64_t nb_chunks;
+    bool compressed;
 };
 
+static inline bool hb_chunk_is_shared(const unsigned long *chunk)
+{
+    return chunk == hb_zero_chunk || chunk == hb_ones_chunk;
+}
+
+/* Number of words in chunk @c of the last level */
+static inline size_t hb_chunk_len(const HBitmap *hb, uint64_t c)
+{
+    return MIN(HB_CHUNK_WORDS,
+               hb->sizes[HBITMAP_LEVELS - 1] - (c << HB_CHUNK_SHIFT));
+}
+
+/* Whether all bits of chunk @c are within the bitmap, so that it may
+ * share hb_ones_chunk.
+ */
+static inline bool hb_chunk_is_whole(const HBitmap *hb, uint64_t c)
+{
+    return (c + 1) * HB_CHUNK_BITS <= hb->size;
+}
+
+/* Read word @pos of the last level */
+static inline unsigned long hb_word(const HBitmap *hb, uint64_t pos)
+{
+    return hb->chunks[pos >> HB_CHUNK_SHIFT][pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Read word @pos of @level */
+static inline unsigned long hb_level_word(const HBitmap *hb, int level,
+                                          uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Return chunk @c of the last level, giving it private storage first */
+static unsigned long *hb_chunk_writable(HBitmap *hb, uint64_t c)
+{
+    unsigned long *chunk = hb->chunks[c];
+
+    if (hb_chunk_is_shared(chunk)) {
+        chunk = g_memdup2(chunk, hb_chunk_len(hb, c) * sizeof(unsigned long));
+        hb->chunks[c] = chunk;
+    }
+    return chunk;
+}
+
+/* Return a pointer through which word @pos of the last level can be
+ * modified.
+ */
+static inline unsigned long *hb_word_ptr(HBitmap *hb, uint64_t pos)
+{
+    return &hb_chunk_writable(hb, pos >> HB_CHUNK_SHIFT)
+                [pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Make chunk @c all zeroes or (if @ones) all ones.  Compressed bitmaps
+ * drop the chunk's private storage.
+ */
+static void hb_chunk_fill(HBitmap *hb, uint64_t c, bool ones)
+{
+    unsigned long *chunk = hb->chunks[c];
+
+    if (hb->compressed && (!ones || hb_chunk_is_whole(hb, c))) {
+        if (!hb_chunk_is_shared(chunk)) {
+            g_free(chunk);
+        }
+        hb->chunks[c] = (unsigned long *)(ones ? hb_ones_chunk : hb_zero_chunk);
+        return;
+    }
+
+    chunk = hb_chunk_writable(hb, c);
+    memset(chunk, ones ? 0xff : 0, hb_chunk_len(hb, c) * sizeof(unsigned long));
+}
+
+static bool hb_words_all_ones(const unsigned long *words, size_t n)
+{
+    unsigned long acc = ~0UL;
+    size_t i;
+
+    /* No early exit, so that the compiler can vectorize this */
+    for (i = 0; i < n; i++) {
+        acc &= words[i];
+    }
+    return acc == ~0UL;
+}
+
+/* Let chunk @c of a compressed bitmap share storage if its bits are all
+ * equal.
+ */
+static void hb_chunk_compact(HBitmap *hb, uint64_t c)
+{
+    unsigned long *chunk = hb->chunks[c];
+    size_t len = hb_chunk_len(hb, c);
+
+    if (!hb->compressed || hb_chunk_is_shared(chunk)) {
+        return;
+    }
+
+    if (buffer_is_zero(chunk, len * sizeof(unsigned long))) {
+        hb_chunk_fill(hb, c, false);
+    } else if (hb_chunk_is_whole(hb, c) && hb_words_all_ones(chunk, len)) {
+        hb_chunk_fill(hb, c, true);
+    }
+}
+
+static uint64_t hb_count_words(const unsigned long *words, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(words[i]);
+    }
+    return count;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +288,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_level_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +301,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +334,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_level_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -219,9 +371,8 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
-    size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    uint64_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +383,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -247,13 +400,18 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            /* Skip whole chunks that are known to be full */
+            while (pos < sz && !(pos & (HB_CHUNK_WORDS - 1)) &&
+                   hb->chunks[pos >> HB_CHUNK_SHIFT] == hb_ones_chunk) {
+                pos += HB_CHUNK_WORDS;
+            }
+        } while (pos < sz && hb_word(hb, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -349,60 +507,38 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/**
- * hbitmap_iter_next_word:
- * @hbi: HBitmapIter to operate on.
- * @p_cur: Location where to store the next non-zero word.
- *
- * Return the index of the next nonzero word that is set in @hbi's
- * associated HBitmap, and set *p_cur to the content of that word
- * (bits before the index that was passed to hbitmap_iter_init are
- * trimmed on the first call).  Return -1, and set *p_cur to zero,
- * if all remaining words are zero.
+/* Count the number of set bits between start and last (inclusive), not
+ * accounting for the granularity.
  */
-static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
+static uint64_t hb_count_between(const HBitmap *hb, uint64_t start,
+                                 uint64_t last)
 {
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = ~0UL << (start & (BITS_PER_LONG - 1));
+    unsigned long last_mask =
+        ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
+    uint64_t count;
 
-    if (cur == 0) {
-        cur = hbitmap_iter_skip_words(hbi);
-        if (cur == 0) {
-            *p_cur = 0;
-            return -1;
-        }
+    if (pos == lastpos) {
+        return ctpopl(hb_word(hb, pos) & first_mask & last_mask);
     }
 
-    /* The next call will resume work from the next word.  */
-    hbi->cur[HBITMAP_LEVELS - 1] = 0;
-    *p_cur = cur;
-    return hbi->pos;
-}
+    count = ctpopl(hb_word(hb, pos) & first_mask) +
+            ctpopl(hb_word(hb, lastpos) & last_mask);
 
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
- */
-static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
-{
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
+    /* The whole words in between, a chunk at a time */
+    for (pos++; pos < lastpos; ) {
+        const unsigned long *chunk = hb->chunks[pos >> HB_CHUNK_SHIFT];
+        size_t off = pos & (HB_CHUNK_WORDS - 1);
+        size_t n = MIN(HB_CHUNK_WORDS - off, lastpos - pos);
 
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
+        if (chunk == hb_ones_chunk) {
+            count += (uint64_t)n << BITS_PER_LEVEL;
+        } else if (chunk != hb_zero_chunk) {
+            count += hb_count_words(chunk + off, n);
         }
-        count += ctpopl(cur);
-    }
-
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
+        pos += n;
     }
 
     return count;
@@ -461,6 +597,56 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     return changed;
 }
 
+/* Set bits start..last of the last level, which may cover whole chunks.
+ * Returns true if at least one bit is changed.
+ */
+static bool hb_set_last_level(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    bool changed = false;
+
+    if (pos < lastpos) {
+        uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
+
+        if (~hb_word(hb, pos) >> (start & (BITS_PER_LONG - 1))) {
+            changed |= hb_set_elem(hb_word_ptr(hb, pos), start, next - 1);
+        }
+
+        for (pos++; pos < lastpos; ) {
+            uint64_t c = pos >> HB_CHUNK_SHIFT;
+            size_t off = pos & (HB_CHUNK_WORDS - 1);
+            size_t n = MIN(HB_CHUNK_WORDS - off, lastpos - pos);
+            unsigned long *chunk = hb->chunks[c];
+            size_t i;
+
+            pos += n;
+            if (chunk == hb_ones_chunk) {
+                continue;
+            }
+            if (n == HB_CHUNK_WORDS && hb->compressed) {
+                hb_chunk_fill(hb, c, true);
+                changed = true;
+                continue;
+            }
+
+            chunk = hb_chunk_writable(hb, c);
+            for (i = off; i < off + n; i++) {
+                changed |= chunk[i] != ~0UL;
+                chunk[i] = ~0UL;
+            }
+        }
+        start = lastpos << BITS_PER_LEVEL;
+    }
+
+    if (~hb_word(hb, pos) & ((2UL << (last & (BITS_PER_LONG - 1))) -
+                             (1UL << (start & (BITS_PER_LONG - 1))))) {
+        changed |= hb_set_elem(hb_word_ptr(hb, pos), start, last);
+    }
+
+    return changed;
+}
+
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -480,9 +666,12 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     n = last - first + 1;
 
     hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_set_last_level(hb, first, last)) {
+        hb_set_between(hb, HBITMAP_LEVELS - 2, first >> BITS_PER_LEVEL,
+                       last >> BITS_PER_LEVEL);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
@@ -555,10 +744,87 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
 }
 
+/* Clear bits in word @pos of the last level, without giving a shared
+ * chunk private storage if nothing changes.  Returns true if the word
+ * became zero.
+ */
+static bool hb_reset_word(HBitmap *hb, uint64_t pos, uint64_t start,
+                          uint64_t last)
+{
+    unsigned long mask = (2UL << (last & (BITS_PER_LONG - 1))) -
+                         (1UL << (start & (BITS_PER_LONG - 1)));
+
+    if (!(hb_word(hb, pos) & mask)) {
+        return false;
+    }
+    return hb_reset_elem(hb_word_ptr(hb, pos), start, last);
+}
+
+/* Clear bits start..last of the last level, which may cover whole chunks.
+ * Returns true if a word became zero; [*upper_first, *upper_last] is then
+ * the range of bits to clear in the level above.
+ */
+static bool hb_reset_last_level(HBitmap *hb, uint64_t start, uint64_t last,
+                                uint64_t *upper_first, uint64_t *upper_last)
+{
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    bool changed = false;
+
+    *upper_first = pos;
+    *upper_last = lastpos;
+
+    if (pos < lastpos) {
+        uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
+
+        /* As in hb_reset_between(), only blank the upper-level bit of a
+         * partially cleared word if the word became entirely zero.
+         */
+        if (hb_reset_word(hb, pos, start, next - 1)) {
+            changed = true;
+        } else {
+            (*upper_first)++;
+        }
+
+        for (pos++; pos < lastpos; ) {
+            uint64_t c = pos >> HB_CHUNK_SHIFT;
+            size_t off = pos & (HB_CHUNK_WORDS - 1);
+            size_t n = MIN(HB_CHUNK_WORDS - off, lastpos - pos);
+            unsigned long *chunk = hb->chunks[c];
+            size_t i;
+
+            pos += n;
+            if (chunk == hb_zero_chunk) {
+                continue;
+            }
+            if (n == HB_CHUNK_WORDS && hb->compressed) {
+                hb_chunk_fill(hb, c, false);
+                changed = true;
+                continue;
+            }
+
+            chunk = hb_chunk_writable(hb, c);
+            for (i = off; i < off + n; i++) {
+                changed |= chunk[i] != 0;
+                chunk[i] = 0;
+            }
+        }
+        start = lastpos << BITS_PER_LEVEL;
+    }
+
+    if (hb_reset_word(hb, lastpos, start, last)) {
+        changed = true;
+    } else {
+        (*upper_last)--;
+    }
+
+    return changed;
+}
+
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
-    uint64_t first;
+    uint64_t first, upper_first, upper_last;
     uint64_t last = start + count - 1;
     uint64_t gran = 1ULL << hb->granularity;
 
@@ -577,18 +843,25 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_last_level(hb, first, last, &upper_first, &upper_last)) {
+        assert(upper_first <= upper_last);
+        hb_reset_between(hb, HBITMAP_LEVELS - 2, upper_first, upper_last);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    uint64_t c;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (c = 0; c < hb->nb_chunks; c++) {
+        hb_chunk_fill(hb, c, false);
+    }
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -621,7 +894,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +911,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,7 +925,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -660,12 +933,12 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -674,7 +947,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -683,9 +956,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -697,7 +970,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -706,12 +979,19 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
+        }
+
+        /* Keep shared chunks shared where possible */
+        if (el != hb_word(hb, cur)) {
+            *hb_word_ptr(hb, cur) = el;
         }
 
         buf += sizeof(unsigned long);
@@ -722,18 +1002,39 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     }
 }
 
+/* Fill @count words of the last level starting at @pos with zeroes or ones */
+static void hb_fill_words(HBitmap *hb, uint64_t pos, uint64_t count,
+                          bool ones)
+{
+    uint64_t end = pos + count;
+
+    while (pos < end) {
+        uint64_t c = pos >> HB_CHUNK_SHIFT;
+        size_t off = pos & (HB_CHUNK_WORDS - 1);
+        size_t n = MIN(hb_chunk_len(hb, c) - off, end - pos);
+
+        if (n == hb_chunk_len(hb, c)) {
+            hb_chunk_fill(hb, c, ones);
+        } else {
+            memset(hb_chunk_writable(hb, c) + off, ones ? 0xff : 0,
+                   n * sizeof(unsigned long));
+        }
+        pos += n;
+    }
+}
+
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, false);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -743,14 +1044,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, true);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -759,8 +1060,13 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
+    uint64_t c;
     int lev;
 
+    for (c = 0; c < bitmap->nb_chunks; c++) {
+        hb_chunk_compact(bitmap, c);
+    }
+
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
     size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
@@ -770,7 +1076,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_level_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -784,14 +1090,67 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t c;
+
     assert(!hb->meta);
+    for (c = 0; c < hb->nb_chunks; c++) {
+        if (!hb_chunk_is_shared(hb->chunks[c])) {
+            g_free(hb->chunks[c]);
+        }
+    }
+    g_free(hb->chunks);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+/* Give the last level @words words, @old_words before.  Bits beyond the
+ * new end must have been cleared already.
+ */
+static void hb_resize_last_level(HBitmap *hb, uint64_t old_words,
+                                 uint64_t words)
+{
+    uint64_t old_nb = hb->nb_chunks;
+    uint64_t nb = DIV_ROUND_UP(words, HB_CHUNK_WORDS);
+    uint64_t c;
+
+    for (c = nb; c < old_nb; c++) {
+        if (!hb_chunk_is_shared(hb->chunks[c])) {
+            g_free(hb->chunks[c]);
+        }
+    }
+    hb->chunks = g_renew(unsigned long *, hb->chunks, nb);
+    hb->nb_chunks = nb;
+    hb->sizes[HBITMAP_LEVELS - 1] = words;
+
+    /* Only the old and the new last chunk can change their length */
+    for (c = MIN(old_nb, nb) ? MIN(old_nb, nb) - 1 : 0; c < nb; c++) {
+        size_t len = hb_chunk_len(hb, c);
+        size_t old_len = c < old_nb ?
+            MIN(HB_CHUNK_WORDS, old_words - (c << HB_CHUNK_SHIFT)) : 0;
+
+        if (c < old_nb && hb_chunk_is_shared(hb->chunks[c])) {
+            /* A partial chunk never shares hb_ones_chunk */
+            assert(hb->chunks[c] == hb_zero_chunk || len == HB_CHUNK_WORDS);
+            continue;
+        }
+
+        if (c >= old_nb && hb->compressed) {
+            hb->chunks[c] = (unsigned long *)hb_zero_chunk;
+        } else {
+            hb->chunks[c] = g_renew(unsigned long,
+                                    c < old_nb ? hb->chunks[c] : NULL, len);
+            if (len > old_len) {
+                memset(&hb->chunks[c][old_len], 0,
+                       (len - old_len) * sizeof(unsigned long));
+            }
+        }
+    }
+}
+
+static HBitmap *hbitmap_do_alloc(uint64_t size, int granularity,
+                                 bool compressed)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
@@ -805,8 +1164,13 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 
     hb->size = size;
     hb->granularity = granularity;
+    hb->compressed = compressed;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_last_level(hb, 0, size);
+            continue;
+        }
         hb->sizes[i] = size;
         hb->levels[i] = g_new0(unsigned long, size);
     }
@@ -820,6 +1184,52 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, false);
+}
+
+HBitmap *hbitmap_alloc_compressed(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, true);
+}
+
+bool hbitmap_is_compressed(const HBitmap *hb)
+{
+    return hb->compressed;
+}
+
+void hbitmap_set_compressed(HBitmap *hb, bool compressed)
+{
+    uint64_t c;
+
+    hb->compressed = compressed;
+    for (c = 0; c < hb->nb_chunks; c++) {
+        if (compressed) {
+            hb_chunk_compact(hb, c);
+        } else {
+            hb_chunk_writable(hb, c);
+        }
+    }
+}
+
+size_t hbitmap_memory_usage(const HBitmap *hb)
+{
+    size_t usage = sizeof(*hb) + hb->nb_chunks * sizeof(hb->chunks[0]);
+    uint64_t c;
+    unsigned i;
+
+    for (i = 0; i < HBITMAP_LEVELS - 1; i++) {
+        usage += hb->sizes[i] * sizeof(unsigned long);
+    }
+    for (c = 0; c < hb->nb_chunks; c++) {
+        if (!hb_chunk_is_shared(hb->chunks[c])) {
+            usage += hb_chunk_len(hb, c) * sizeof(unsigned long);
+        }
+    }
+    return usage;
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -861,6 +1271,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
             break;
         }
         old = hb->sizes[i];
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_last_level(hb, old, size);
+            continue;
+        }
         hb->sizes[i] = size;
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
@@ -934,22 +1348,60 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
+    for (j = 0; j < a->nb_chunks; j++) {
+        const unsigned long *ca = a->chunks[j];
+        const unsigned long *cb = b->chunks[j];
+        unsigned long *cr;
+        size_t k, len;
+
+        if (result->compressed) {
+            if (ca == hb_ones_chunk || cb == hb_ones_chunk) {
+                hb_chunk_fill(result, j, true);
+                continue;
+            }
+            if (ca == hb_zero_chunk && cb == hb_zero_chunk) {
+                hb_chunk_fill(result, j, false);
+                continue;
+            }
+        }
+
+        /* hb_chunk_writable() may replace the chunk of an aliased input */
+        cr = hb_chunk_writable(result, j);
+        if (result == a) {
+            ca = cr;
+        } else if (result == b) {
+            cb = cr;
+        }
+        len = hb_chunk_len(result, j);
+        for (k = 0; k < len; k++) {
+            cr[k] = ca[k] | cb[k];
+        }
+        hb_chunk_compact(result, j);
+    }
+
     /* Recompute the dirty count */
     result->count = hb_count_between(result, 0, result->size - 1);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    g_autofree struct iovec *iov = g_new(struct iovec, bitmap->nb_chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t c;
+
+    /* Hash the same bytes as a flat last level would have */
+    for (c = 0; c < bitmap->nb_chunks; c++) {
+        iov[c].iov_base = bitmap->chunks[c];
+        iov[c].iov_len = hb_chunk_len(bitmap, c) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nb_chunks,
+                         &hash, errp);
 
     return hash;
 }
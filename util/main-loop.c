@@ -192,10 +192,14 @@ static void main_loop_update_params(EventLoopBase *base, Error **errp)
         return;
     }
 
-    aio_context_set_aio_params(qemu_aio_context, base->aio_max_batch);
+    aio_context_set_aio_params(qemu_aio_context, base->aio_max_batch,
+                               base->aio_sqpoll_idle_ms,
+                               base->aio_unified_ring);
 
     aio_context_set_thread_pool_params(qemu_aio_context, base->thread_pool_min,
-                                       base->thread_pool_max, errp);
+                                       base->thread_pool_max,
+                                       base->thread_pool_shared,
+                                       base->thread_pool_context, errp);
 }
 
 MainLoop *mloop;
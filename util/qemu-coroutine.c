@@ -44,6 +44,12 @@ enum {
  * .-------------------.
  * | Batch 1 | Batch 2 | per-thread local_pool (maximum 2 batches)
  * `-------------------'
+ *
+ * In front of the local pool each thread keeps one terminated coroutine in
+ * local_hot_co.  Block layer requests that complete without yielding create
+ * and terminate one coroutine at a time, so they keep cycling through this
+ * slot: the stack is still warm in the cache and no batch is allocated or
+ * freed on the way.
  */
 typedef struct CoroutinePoolBatch {
     /* Batches are kept in a list */
@@ -65,6 +71,7 @@ static unsigned int global_pool_size;
 static unsigned int global_pool_max_size = COROUTINE_POOL_BATCH_MAX_SIZE;
 
 QEMU_DEFINE_STATIC_CO_TLS(CoroutinePool, local_pool);
+QEMU_DEFINE_STATIC_CO_TLS(Coroutine *, local_hot_co);
 QEMU_DEFINE_STATIC_CO_TLS(Notifier, local_pool_cleanup_notifier);
 
 static CoroutinePoolBatch *coroutine_pool_batch_new(void)
@@ -93,6 +100,12 @@ static void local_pool_cleanup(Notifier *n, void *value)
     CoroutinePool *local_pool = get_ptr_local_pool();
     CoroutinePoolBatch *batch;
     CoroutinePoolBatch *tmp;
+    Coroutine *co = get_local_hot_co();
+
+    if (co) {
+        set_local_hot_co(NULL);
+        qemu_coroutine_delete(co);
+    }
 
     QSLIST_FOREACH_SAFE(batch, local_pool, next, tmp) {
         QSLIST_REMOVE_HEAD(local_pool, next);
@@ -176,7 +189,12 @@ static void coroutine_pool_put_global(CoroutinePoolBatch *batch)
 /* Get the next unused coroutine from the pool or return NULL */
 static Coroutine *coroutine_pool_get(void)
 {
-    Coroutine *co;
+    Coroutine *co = get_local_hot_co();
+
+    if (likely(co)) {
+        set_local_hot_co(NULL);
+        return co;
+    }
 
     co = coroutine_pool_get_local();
     if (!co) {
@@ -189,8 +207,15 @@ static Coroutine *coroutine_pool_get(void)
 static void coroutine_pool_put(Coroutine *co)
 {
     CoroutinePool *local_pool = get_ptr_local_pool();
-    CoroutinePoolBatch *batch = QSLIST_FIRST(local_pool);
+    CoroutinePoolBatch *batch;
+
+    if (likely(!get_local_hot_co())) {
+        set_local_hot_co(co);
+        local_pool_cleanup_init_once();
+        return;
+    }
 
+    batch = QSLIST_FIRST(local_pool);
     if (unlikely(!batch)) {
         batch = coroutine_pool_batch_new();
         QSLIST_INSERT_HEAD(local_pool, batch, next);
@@ -21,9 +21,10 @@
  *   concurrent with lookups and are serialized wrt writers.
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
- * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ * - Optional auto-resizing: the hash table grows if the load surpasses
+ *   a certain threshold. Growing is done incrementally, concurrently with
+ *   both readers and writers; explicit resizes are done concurrently with
+ *   readers, and writes are serialized with them.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,15 +44,38 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Explicit resizing (qht_resize(), qht_reset_size()) is done by taking all
+ * bucket spinlocks (so that no other writers can race with us) and then copying
+ * all entries into a new hash map. Then, the ht->map pointer is set, and the
+ * old map is freed once no RCU readers can see it anymore.
+ *
+ * Auto-resizing instead publishes the new, empty map right away with
+ * map->old pointing to the current one, and then migrates the old head
+ * buckets in order, a few at a time, from the writers that come along. A head
+ * bucket is migrated by copying its entries to the new map and only then
+ * clearing them, all under the old bucket's lock; old->n_migrated then moves
+ * past it. Lookups consult the old bucket first (unless it has already been
+ * migrated) and the new one second, so an entry that is being moved is always
+ * found in one of the two. A lookup that read ht->map before the new map was
+ * published only looks at the old map, and may find its bucket already
+ * emptied; the new map is published before any bucket is emptied, so such a
+ * lookup sees a different ht->map after missing, and retries on the new map.
+ * Writers use the old bucket until it has been
+ * migrated, which they check while holding its lock. Once all buckets have
+ * been migrated, map->old is cleared and the old map is freed after a grace
+ * period. Lookups never wait for a migration, and writers wait at most for
+ * the migration of the one bucket they need, so vCPUs looking up or adding
+ * TBs are not stalled while the table grows.
  *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occurred
  * while the bucket spinlock was being acquired.
  *
+ * Each map also keeps a few running counters (see qht_counters_read()) that
+ * writers update while they hold their bucket lock. The entry count is split
+ * in cacheline-sized stripes so that writers to different buckets rarely
+ * touch the same line.
+ *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
  *   David, Guerraoui & Trigonakis, "Asynchronized Concurrency:
@@ -167,15 +191,32 @@ struct qht_tsan_lock {
     QemuSpin lock;
 } QEMU_ALIGNED(QHT_BUCKET_ALIGN);
 
+/* Note: this number must be a power of two for easy index computation. */
+#define QHT_ENTRIES_STRIPES 16
+
+struct qht_entries_stripe {
+    size_t n;
+} QEMU_ALIGNED(QHT_BUCKET_ALIGN);
+
+/* number of head buckets migrated at a time by auto-resizing */
+#define QHT_MIGRATE_BATCH 64
+
 /**
  * struct qht_map - structure to track an array of buckets
  * @rcu: used by RCU. Keep it as the top field in the struct to help valgrind
  *       find the whole struct.
  * @buckets: array of head buckets. It is constant once the map is created.
  * @n_buckets: number of head buckets. It is constant once the map is created.
+ * @old: map whose entries are being migrated into this one, or NULL.
+ * @n_migrated: number of head buckets of this map that have been migrated to
+ *              a newer map. Only written with both ht->lock and the lock of
+ *              the bucket being migrated held.
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @max_chain: number of buckets in the longest chain.
+ * @n_resizes: number of maps that ht->map has pointed to before this one.
+ * @entries: number of entries, striped by head bucket index.
  * @tsan_bucket_locks: Array of striped locks to be used only under TSAN.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
@@ -184,8 +225,13 @@ struct qht_map {
     struct rcu_head rcu;
     struct qht_bucket *buckets;
     size_t n_buckets;
+    struct qht_map *old;
+    size_t n_migrated;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    size_t max_chain;
+    size_t n_resizes;
+    struct qht_entries_stripe entries[QHT_ENTRIES_STRIPES];
 #ifdef CONFIG_TSAN
     struct qht_tsan_lock tsan_bucket_locks[QHT_TSAN_BUCKET_LOCKS];
 #endif
@@ -197,6 +243,8 @@ struct qht_map {
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
 static void qht_grow_maybe(struct qht *ht);
+static void qht_map_migrate__htlocked(const struct qht *ht, struct qht_map *map,
+                                      size_t n);
 
 #ifdef QHT_DEBUG
 
@@ -308,6 +356,63 @@ struct qht_bucket *qht_map_to_bucket(const struct qht_map *map, uint32_t hash)
     return &map->buckets[hash & (map->n_buckets - 1)];
 }
 
+/*
+ * Whether head bucket @b of @old, a map that is being migrated, has already
+ * been moved to the new map. Once true, this cannot become false again.
+ */
+static inline bool qht_bucket_is_migrated(const struct qht_map *old,
+                                          const struct qht_bucket *b)
+{
+    return (size_t)(b - old->buckets) < qatomic_load_acquire(&old->n_migrated);
+}
+
+static inline struct qht_entries_stripe *
+qht_map_entries_stripe(struct qht_map *map, const struct qht_bucket *head)
+{
+    size_t idx = (head - map->buckets) & (QHT_ENTRIES_STRIPES - 1);
+
+    return &map->entries[idx];
+}
+
+/* call with head->lock held */
+static inline void qht_map_entries_add(struct qht_map *map,
+                                       const struct qht_bucket *head, size_t n)
+{
+    qatomic_add(&qht_map_entries_stripe(map, head)->n, n);
+}
+
+/* call with head->lock held */
+static inline void qht_map_entries_sub(struct qht_map *map,
+                                       const struct qht_bucket *head, size_t n)
+{
+    qatomic_sub(&qht_map_entries_stripe(map, head)->n, n);
+}
+
+static size_t qht_map_entries(const struct qht_map *map)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < QHT_ENTRIES_STRIPES; i++) {
+        n += qatomic_read(&map->entries[i].n);
+    }
+    return n;
+}
+
+static void qht_map_update_max_chain(struct qht_map *map, size_t len)
+{
+    size_t max = qatomic_read(&map->max_chain);
+
+    while (len > max) {
+        size_t prev = qatomic_cmpxchg(&map->max_chain, max, len);
+
+        if (prev == max) {
+            break;
+        }
+        max = prev;
+    }
+}
+
 /* acquire all bucket locks from a map */
 static void qht_map_lock_buckets(struct qht_map *map)
 {
@@ -343,6 +448,7 @@ static inline bool qht_map_is_stale__locked(const struct qht *ht,
 
 /*
  * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
+ * If the map is being migrated, the migration is completed first.
  *
  * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
  *
@@ -354,22 +460,56 @@ void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
     struct qht_map *map;
 
     map = qatomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
+    if (likely(!qatomic_read(&map->old))) {
+        qht_map_lock_buckets(map);
+        if (likely(!qht_map_is_stale__locked(ht, map))) {
+            *pmap = map;
+            return;
+        }
+        qht_map_unlock_buckets(map);
     }
-    qht_map_unlock_buckets(map);
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
+    /*
+     * We raced with a resize, or a migration is in progress; acquire ht->lock
+     * to see the updated ht->map and to finish the migration.
+     */
     qht_lock(ht);
     map = ht->map;
+    qht_map_migrate__htlocked(ht, map, SIZE_MAX);
     qht_map_lock_buckets(map);
     qht_unlock(ht);
     *pmap = map;
     return;
 }
 
+/*
+ * Lock the head bucket that @hash belongs to in @map. While @map is being
+ * filled from map->old, this is the old map's bucket until it is migrated.
+ * @pmap is filled with a pointer to the locked bucket's parent map.
+ */
+static inline
+struct qht_bucket *qht_map_bucket_lock(struct qht_map *map, uint32_t hash,
+                                       struct qht_map **pmap)
+{
+    struct qht_map *old = qatomic_rcu_read(&map->old);
+    struct qht_bucket *b;
+
+    if (unlikely(old)) {
+        b = qht_map_to_bucket(old, hash);
+        qht_bucket_lock(old, b);
+        if (!qht_bucket_is_migrated(old, b)) {
+            *pmap = old;
+            return b;
+        }
+        qht_bucket_unlock(old, b);
+    }
+
+    b = qht_map_to_bucket(map, hash);
+    qht_bucket_lock(map, b);
+    *pmap = map;
+    return b;
+}
+
 /*
  * Get a head bucket and lock it, making sure its parent map is not stale.
  * @pmap is filled with a pointer to the bucket's parent map.
@@ -385,23 +525,23 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
     struct qht_bucket *b;
     struct qht_map *map;
 
+    /*
+     * If the bucket is in the old map of an ongoing migration, the migration
+     * cannot complete while we hold the lock, so ht->map cannot change
+     * either; checking @map for staleness therefore covers both cases.
+     */
     map = qatomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
-
-    qht_bucket_lock(map, b);
+    b = qht_map_bucket_lock(map, hash, pmap);
     if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
         return b;
     }
-    qht_bucket_unlock(map, b);
+    qht_bucket_unlock(*pmap, b);
 
     /* we raced with a resize; acquire ht->lock to see the updated ht->map */
     qht_lock(ht);
     map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qht_bucket_lock(map, b);
+    b = qht_map_bucket_lock(map, hash, pmap);
     qht_unlock(ht);
-    *pmap = map;
     return b;
 }
 
@@ -434,7 +574,7 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(map, &map->buckets[i]);
     }
     qemu_vfree(map->buckets);
-    g_free(map);
+    qemu_vfree(map);
 }
 
 static struct qht_map *qht_map_create(size_t n_buckets)
@@ -442,8 +582,11 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     struct qht_map *map;
     size_t i;
 
-    map = g_malloc(sizeof(*map));
+    /* the entries stripes must not share cache lines with anything else */
+    map = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*map));
+    memset(map, 0, sizeof(*map));
     map->n_buckets = n_buckets;
+    map->max_chain = 1;
 
     map->n_added_buckets = 0;
     map->n_added_buckets_threshold = n_buckets /
@@ -479,13 +622,18 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->old) {
+        qht_map_destroy(ht->map->old);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
 
-static void qht_bucket_reset__locked(struct qht_bucket *head)
+static void qht_bucket_reset__locked(struct qht_map *map,
+                                     struct qht_bucket *head)
 {
     struct qht_bucket *b = head;
+    size_t n = 0;
     int i;
 
     seqlock_write_begin(&head->sequence);
@@ -496,11 +644,13 @@ static void qht_bucket_reset__locked(struct qht_bucket *head)
             }
             qatomic_set(&b->hashes[i], 0);
             qatomic_set(&b->pointers[i], NULL);
+            n++;
         }
         b = b->next;
     } while (b);
  done:
     seqlock_write_end(&head->sequence);
+    qht_map_entries_sub(map, head, n);
 }
 
 /* call with all bucket locks held */
@@ -509,7 +659,7 @@ static void qht_map_reset__all_locked(struct qht_map *map)
     size_t i;
 
     for (i = 0; i < map->n_buckets; i++) {
-        qht_bucket_reset__locked(&map->buckets[i]);
+        qht_bucket_reset__locked(map, &map->buckets[i]);
     }
     qht_map_debug__all_locked(map);
 }
@@ -593,6 +743,50 @@ void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
+/*
+ * Look up in @map and in the map it is being filled from, if any. If that
+ * misses and ht->map has changed meanwhile, the buckets we looked at may have
+ * been emptied by a migration to the new map, so look again there.
+ */
+static __attribute__((noinline))
+void *qht_lookup__migrating(const struct qht *ht, const struct qht_map *map,
+                            qht_lookup_func_t func, const void *userp,
+                            uint32_t hash)
+{
+    const struct qht_map *prev;
+    void *ret;
+
+    do {
+        const struct qht_map *old = qatomic_rcu_read(&map->old);
+
+        /*
+         * Entries are added to the new map before they are removed from the
+         * old one, and the old bucket is marked as migrated only after that,
+         * so looking in the old map first cannot miss an entry that is being
+         * moved. The seqlock read barriers order the two lookups, as well as
+         * the lookups and the re-read of ht->map below.
+         */
+        if (old) {
+            const struct qht_bucket *b = qht_map_to_bucket(old, hash);
+
+            if (!qht_bucket_is_migrated(old, b)) {
+                ret = qht_lookup__slowpath(b, func, userp, hash);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+        ret = qht_lookup__slowpath(qht_map_to_bucket(map, hash), func, userp,
+                                   hash);
+        if (ret) {
+            return ret;
+        }
+        prev = map;
+        map = qatomic_rcu_read(&ht->map);
+    } while (map != prev);
+    return NULL;
+}
+
 void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
                         qht_lookup_func_t func)
 {
@@ -602,18 +796,29 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     void *ret;
 
     map = qatomic_rcu_read(&ht->map);
+    if (unlikely(qatomic_read(&map->old))) {
+        return qht_lookup__migrating(ht, map, func, userp, hash);
+    }
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
     ret = qht_do_lookup(b, func, userp, hash);
     if (likely(!seqlock_read_retry(&b->sequence, version))) {
-        return ret;
+        /* a miss may be due to a grow that started after reading ht->map */
+        if (likely(ret || qatomic_rcu_read(&ht->map) == map)) {
+            return ret;
+        }
+        return qht_lookup__migrating(ht, map, func, userp, hash);
     }
     /*
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    ret = qht_lookup__slowpath(b, func, userp, hash);
+    if (likely(ret || qatomic_rcu_read(&ht->map) == map)) {
+        return ret;
+    }
+    return qht_lookup__migrating(ht, map, func, userp, hash);
 }
 
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
@@ -632,6 +837,7 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     struct qht_bucket *b = head;
     struct qht_bucket *prev = NULL;
     struct qht_bucket *new = NULL;
+    size_t chain = 0;
     int i;
 
     do {
@@ -647,6 +853,7 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
         }
         prev = b;
         b = b->next;
+        chain++;
     } while (b);
 
     b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
@@ -654,6 +861,7 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     new = b;
     i = 0;
     qatomic_inc(&map->n_added_buckets);
+    qht_map_update_max_chain(map, chain + 1);
     if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
         *needs_resize = true;
     }
@@ -668,9 +876,93 @@ static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
     qatomic_set(&b->hashes[i], hash);
     qatomic_set(&b->pointers[i], p);
     seqlock_write_end(&head->sequence);
+    qht_map_entries_add(map, head, 1);
     return NULL;
 }
 
+/*
+ * Move the entries of the next head bucket of map->old to @map.
+ * Call with ht->lock held.
+ */
+static void qht_map_migrate_bucket__htlocked(const struct qht *ht,
+                                             struct qht_map *map,
+                                             struct qht_map *old)
+{
+    size_t idx = old->n_migrated;
+    struct qht_bucket *head = &old->buckets[idx];
+    struct qht_bucket *b = head;
+    int i;
+
+    qht_bucket_lock(old, head);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            uint32_t hash = b->hashes[i];
+            void *p = b->pointers[i];
+            struct qht_bucket *dst;
+
+            if (p == NULL) {
+                goto done;
+            }
+            /*
+             * Writers do not use @dst until @head has been migrated; lock it
+             * anyway so that insertions always happen under the bucket lock.
+             */
+            dst = qht_map_to_bucket(map, hash);
+            qht_bucket_lock(map, dst);
+            qht_insert__locked(ht, map, dst, p, hash, NULL);
+            qht_bucket_debug__locked(dst);
+            qht_bucket_unlock(map, dst);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    /*
+     * Lookups that find the entries gone will look at the new map next, even
+     * if they read ht->map before it was published.
+     */
+    qht_bucket_reset__locked(old, head);
+    qatomic_store_release(&old->n_migrated, idx + 1);
+    qht_bucket_unlock(old, head);
+}
+
+/*
+ * Migrate up to @n head buckets from map->old to @map, and retire map->old
+ * once it is empty. Call with ht->lock held.
+ */
+static void qht_map_migrate__htlocked(const struct qht *ht, struct qht_map *map,
+                                      size_t n)
+{
+    struct qht_map *old = map->old;
+
+    if (old == NULL) {
+        return;
+    }
+    while (n-- && old->n_migrated < old->n_buckets) {
+        qht_map_migrate_bucket__htlocked(ht, map, old);
+    }
+    if (old->n_migrated == old->n_buckets) {
+        qatomic_rcu_set(&map->old, NULL);
+        call_rcu(old, qht_map_destroy, rcu);
+    }
+}
+
+/* help an ongoing migration along, unless somebody else already is */
+static __attribute__((noinline)) void qht_migrate_maybe(struct qht *ht)
+{
+    if (qht_trylock(ht)) {
+        return;
+    }
+    qht_map_migrate__htlocked(ht, ht->map, QHT_MIGRATE_BATCH);
+    qht_unlock(ht);
+}
+
+static inline bool qht_is_migrating(const struct qht *ht)
+{
+    const struct qht_map *map = qatomic_rcu_read(&ht->map);
+
+    return qatomic_read(&map->old) != NULL;
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
@@ -683,12 +975,19 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
         return;
     }
     map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
+    /*
+     * Another thread might have just performed the resize we were after.
+     * A map that is still being filled is not grown until it is complete.
+     */
+    if (map->old == NULL && qht_map_needs_resize(map)) {
         struct qht_map *new = qht_map_create(map->n_buckets * 2);
 
-        qht_do_resize(ht, new);
+        new->old = map;
+        new->n_resizes = map->n_resizes + 1;
+        qatomic_rcu_set(&ht->map, new);
+        map = new;
     }
+    qht_map_migrate__htlocked(ht, map, QHT_MIGRATE_BATCH);
     qht_unlock(ht);
 }
 
@@ -709,6 +1008,8 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
 
     if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
+    } else if (unlikely(qht_is_migrating(ht))) {
+        qht_migrate_maybe(ht);
     }
     if (likely(prev == NULL)) {
         return true;
@@ -779,7 +1080,8 @@ static inline void qht_bucket_remove_entry(struct qht_bucket *orig, int pos)
 
 /* call with b->lock held */
 static inline
-bool qht_remove__locked(struct qht_bucket *head, const void *p, uint32_t hash)
+bool qht_remove__locked(struct qht_map *map, struct qht_bucket *head,
+                        const void *p, uint32_t hash)
 {
     struct qht_bucket *b = head;
     int i;
@@ -796,6 +1098,7 @@ bool qht_remove__locked(struct qht_bucket *head, const void *p, uint32_t hash)
                 seqlock_write_begin(&head->sequence);
                 qht_bucket_remove_entry(b, i);
                 seqlock_write_end(&head->sequence);
+                qht_map_entries_sub(map, head, 1);
                 return true;
             }
         }
@@ -814,13 +1117,17 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
     qht_debug_assert(p);
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
-    ret = qht_remove__locked(b, p, hash);
+    ret = qht_remove__locked(map, b, p, hash);
     qht_bucket_debug__locked(b);
     qht_bucket_unlock(map, b);
+
+    if (unlikely(qht_is_migrating(ht))) {
+        qht_migrate_maybe(ht);
+    }
     return ret;
 }
 
-static inline void qht_bucket_iter(struct qht_bucket *head,
+static inline void qht_bucket_iter(struct qht_map *map, struct qht_bucket *head,
                                    const struct qht_iter *iter, void *userp)
 {
     struct qht_bucket *b = head;
@@ -841,6 +1148,7 @@ static inline void qht_bucket_iter(struct qht_bucket *head,
                     seqlock_write_begin(&head->sequence);
                     qht_bucket_remove_entry(b, i);
                     seqlock_write_end(&head->sequence);
+                    qht_map_entries_sub(map, head, 1);
                     qht_bucket_debug__locked(b);
                     /* reevaluate i, since it just got replaced */
                     i--;
@@ -863,7 +1171,7 @@ static inline void qht_map_iter__all_locked(struct qht_map *map,
     size_t i;
 
     for (i = 0; i < map->n_buckets; i++) {
-        qht_bucket_iter(&map->buckets[i], iter, userp);
+        qht_bucket_iter(map, &map->buckets[i], iter, userp);
     }
 }
 
@@ -872,8 +1180,7 @@ do_qht_iter(struct qht *ht, const struct qht_iter *iter, void *userp)
 {
     struct qht_map *map;
 
-    map = qatomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
+    qht_map_lock_buckets__no_stale(ht, &map);
     qht_map_iter__all_locked(map, iter, userp);
     qht_map_unlock_buckets(map);
 }
@@ -927,6 +1234,9 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     };
     struct qht_map_copy_data data;
 
+    /* the map is only ever swapped once it is complete */
+    qht_map_migrate__htlocked(ht, ht->map, SIZE_MAX);
+
     old = ht->map;
     qht_map_lock_buckets(old);
 
@@ -940,6 +1250,7 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     }
 
     g_assert(new->n_buckets != old->n_buckets);
+    new->n_resizes = old->n_resizes + 1;
     data.ht = ht;
     data.new = new;
     qht_map_iter__all_locked(old, &iter, &data);
@@ -968,26 +1279,12 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
-/* pass @stats to qht_statistics_destroy() when done */
-void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
+static void qht_map_statistics(const struct qht_map *map, size_t first,
+                                struct qht_stats *stats)
 {
-    const struct qht_map *map;
-    int i;
-
-    map = qatomic_rcu_read(&ht->map);
-
-    stats->used_head_buckets = 0;
-    stats->entries = 0;
-    qdist_init(&stats->chain);
-    qdist_init(&stats->occupancy);
-    /* bail out if the qht has not yet been initialized */
-    if (unlikely(map == NULL)) {
-        stats->head_buckets = 0;
-        return;
-    }
-    stats->head_buckets = map->n_buckets;
+    size_t i;
 
-    for (i = 0; i < map->n_buckets; i++) {
+    for (i = first; i < map->n_buckets; i++) {
         const struct qht_bucket *head = &map->buckets[i];
         const struct qht_bucket *b;
         unsigned int version;
@@ -1024,6 +1321,64 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
     }
 }
 
+/* pass @stats to qht_statistics_destroy() when done */
+void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
+{
+    const struct qht_map *map;
+    const struct qht_map *old;
+
+    RCU_READ_LOCK_GUARD();
+    map = qatomic_rcu_read(&ht->map);
+
+    stats->used_head_buckets = 0;
+    stats->entries = 0;
+    qdist_init(&stats->chain);
+    qdist_init(&stats->occupancy);
+    /* bail out if the qht has not yet been initialized */
+    if (unlikely(map == NULL)) {
+        stats->head_buckets = 0;
+        return;
+    }
+    stats->head_buckets = map->n_buckets;
+
+    /* during a migration, account for the entries that are still behind */
+    old = qatomic_rcu_read(&map->old);
+    if (old) {
+        qht_map_statistics(old, qatomic_load_acquire(&old->n_migrated), stats);
+    }
+    qht_map_statistics(map, 0, stats);
+}
+
+void qht_counters_read(const struct qht *ht, struct qht_counters *counters)
+{
+    const struct qht_map *map;
+    const struct qht_map *old;
+
+    memset(counters, 0, sizeof(*counters));
+
+    RCU_READ_LOCK_GUARD();
+    map = qatomic_rcu_read(&ht->map);
+    /* bail out if the qht has not yet been initialized */
+    if (unlikely(map == NULL)) {
+        return;
+    }
+    counters->head_buckets = map->n_buckets;
+    counters->added_buckets = qatomic_read(&map->n_added_buckets);
+    counters->entries = qht_map_entries(map);
+    counters->max_chain = qatomic_read(&map->max_chain);
+    counters->resizes = map->n_resizes;
+
+    old = qatomic_rcu_read(&map->old);
+    if (old) {
+        counters->added_buckets += qatomic_read(&old->n_added_buckets);
+        counters->entries += qht_map_entries(old);
+        counters->max_chain = MAX(counters->max_chain,
+                                  qatomic_read(&old->max_chain));
+        counters->migrating = old->n_buckets -
+                              qatomic_load_acquire(&old->n_migrated);
+    }
+}
+
 void qht_statistics_destroy(struct qht_stats *stats)
 {
     qdist_destroy(&stats->occupancy);
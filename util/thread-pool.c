@@ -16,14 +16,27 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/defer-call.h"
+#include "qemu/processor.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
+#include "qemu/thread-context.h"
+#include "qemu/timer.h"
 #include "qemu/coroutine.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
-static void do_spawn_thread(ThreadPool *pool);
+/*
+ * Requests are spread over several queues so that submitting them and
+ * picking them up does not contend on a single lock.  Each worker thread has
+ * a home queue and steals requests from the other queues when its own one is
+ * empty.
+ */
+#define THREAD_POOL_QUEUES 8
+
+typedef struct ThreadPoolWorkers ThreadPoolWorkers;
+
+static void do_spawn_thread(ThreadPoolWorkers *workers);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
 
@@ -33,132 +46,265 @@ enum ThreadState {
     THREAD_DONE,
 };
 
+typedef struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int depth; /* written with lock held, may be read without */
+} ThreadPoolQueue;
+
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.  After
      * that, only the worker thread can write to it.  Reads and writes
      * of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    int64_t submit_ns;
+    ThreadPoolQueue *queue;
+
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* This list is only written by the thread pool's mother thread.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
-struct ThreadPool {
-    AioContext *ctx;
-    QEMUBH *completion_bh;
+/*
+ * The worker threads and their queues.  Each ThreadPool has its own, unless
+ * its AioContext uses the ones that are shared by all AioContexts with
+ * thread-pool-shared set.
+ */
+struct ThreadPoolWorkers {
+    ThreadPoolQueue queues[THREAD_POOL_QUEUES];
+
+    AioContext *ctx; /* runs new_thread_bh */
+    QEMUBH *new_thread_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuCond request_cond;
-    QEMUBH *new_thread_bh;
-
-    /* The following variables are only accessed from one AioContext. */
-    QLIST_HEAD(, ThreadPoolElement) head;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
-    int cur_threads;
-    int idle_threads;
+    QLIST_HEAD(, ThreadPool) pools;
+    ThreadContext *thread_context;
+    unsigned next_home;  /* home queue of the next worker */
+    int cur_threads;     /* may be read without lock */
+    int idle_threads;    /* may be read without lock */
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
+    int max_threads;     /* may be read without lock */
+
+    /* Protected by shared_workers_lock */
+    int refcnt;
+};
+
+struct ThreadPool {
+    AioContext *ctx;
+    QEMUBH *completion_bh;
+    ThreadPoolWorkers *workers;
+    bool shared;
+
+    /* The following variables are only accessed from one AioContext. */
+    QLIST_HEAD(, ThreadPoolElement) head;
+    unsigned next_queue;
+
+    /* The following variables are protected by workers->lock.  */
+    int min_threads;
     int max_threads;
+    ThreadContext *thread_context;
+    QLIST_ENTRY(ThreadPool) next;
+
+    /* Statistics, updated by the worker threads */
+    int queue_depth;
+    int busy; /* workers between completing a request and scheduling the BH */
+    Stat64 requests;
+    Stat64 steals;
+    Stat64 wait_ns;
+    Stat64 run_ns;
 };
 
-static void *worker_thread(void *opaque)
+static QemuMutex shared_workers_lock;
+static ThreadPoolWorkers *shared_workers;
+
+static void __attribute__((constructor)) thread_pool_init_shared(void)
 {
-    ThreadPool *pool = opaque;
+    qemu_mutex_init(&shared_workers_lock);
+}
 
-    qemu_mutex_lock(&pool->lock);
-    pool->pending_threads--;
-    do_spawn_thread(pool);
+static bool thread_pool_queues_empty(ThreadPoolWorkers *workers)
+{
+    for (int i = 0; i < THREAD_POOL_QUEUES; i++) {
+        if (qatomic_read(&workers->queues[i].depth)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    while (pool->cur_threads <= pool->max_threads) {
+/* Take a request from the home queue, or steal one from another queue */
+static ThreadPoolElement *thread_pool_take(ThreadPoolWorkers *workers,
+                                           unsigned home, bool *stolen)
+{
+    for (int i = 0; i < THREAD_POOL_QUEUES; i++) {
+        ThreadPoolQueue *q = &workers->queues[(home + i) % THREAD_POOL_QUEUES];
         ThreadPoolElement *req;
-        int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
-                break;
-            }
-            /*
-             * Even if there was some work to do, check if there aren't
-             * too many worker threads before picking it up.
-             */
+        if (!qatomic_read(&q->depth)) {
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        qemu_mutex_lock(&q->lock);
+        req = QTAILQ_FIRST(&q->request_list);
+        if (req) {
+            QTAILQ_REMOVE(&q->request_list, req, reqs);
+            qatomic_set(&q->depth, q->depth - 1);
+            req->state = THREAD_ACTIVE;
+        }
+        qemu_mutex_unlock(&q->lock);
+
+        if (req) {
+            *stolen = i != 0;
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void thread_pool_run(ThreadPoolElement *req, bool stolen)
+{
+    ThreadPool *pool = req->pool;
+    int64_t start_ns = get_clock();
+    int ret;
+
+    qatomic_dec(&pool->queue_depth);
+    stat64_add(&pool->wait_ns, start_ns - req->submit_ns);
+    if (stolen) {
+        stat64_inc(&pool->steals);
+    }
 
-        ret = req->func(req->arg);
+    ret = req->func(req->arg);
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+    stat64_add(&pool->run_ns, get_clock() - start_ns);
+    stat64_inc(&pool->requests);
 
-        qemu_bh_schedule(pool->completion_bh);
-        qemu_mutex_lock(&pool->lock);
+    /* Keep thread_pool_free() from deleting completion_bh under our feet */
+    qatomic_inc(&pool->busy);
+
+    req->ret = ret;
+    /* Write ret before state.  */
+    smp_wmb();
+    req->state = THREAD_DONE;
+
+    qemu_bh_schedule(pool->completion_bh);
+    qatomic_dec(&pool->busy);
+}
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPoolWorkers *workers = opaque;
+    unsigned home;
+
+    qemu_mutex_lock(&workers->lock);
+    workers->pending_threads--;
+    home = workers->next_home++ % THREAD_POOL_QUEUES;
+    do_spawn_thread(workers);
+    qemu_mutex_unlock(&workers->lock);
+
+    while (true) {
+        ThreadPoolElement *req;
+        bool stolen;
+        int ret;
+
+        if (qatomic_read(&workers->cur_threads) <=
+            qatomic_read(&workers->max_threads)) {
+            req = thread_pool_take(workers, home, &stolen);
+            if (req) {
+                thread_pool_run(req, stolen);
+                continue;
+            }
+        }
+
+        qemu_mutex_lock(&workers->lock);
+        if (workers->cur_threads > workers->max_threads) {
+            break;
+        }
+
+        qatomic_set(&workers->idle_threads, workers->idle_threads + 1);
+        /* Read the queues after idle_threads, pairs with submission */
+        smp_mb();
+        ret = 1;
+        if (thread_pool_queues_empty(workers)) {
+            ret = qemu_cond_timedwait(&workers->request_cond, &workers->lock,
+                                      10000);
+        }
+        qatomic_set(&workers->idle_threads, workers->idle_threads - 1);
+        if (ret == 0 &&
+            thread_pool_queues_empty(workers) &&
+            workers->cur_threads > workers->min_threads) {
+            /* Timed out + no work to do + no need for warm threads = exit.  */
+            break;
+        }
+        /*
+         * Even if there was some work to do, check if there aren't
+         * too many worker threads before picking it up.
+         */
+        qemu_mutex_unlock(&workers->lock);
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
+    qatomic_set(&workers->cur_threads, workers->cur_threads - 1);
+    qemu_cond_signal(&workers->worker_stopped);
 
     /*
      * Wake up another thread, in case we got a wakeup but decided
-     * to exit due to pool->cur_threads > pool->max_threads.
+     * to exit due to workers->cur_threads > workers->max_threads.
      */
-    qemu_cond_signal(&pool->request_cond);
-    qemu_mutex_unlock(&pool->lock);
+    qemu_cond_signal(&workers->request_cond);
+    qemu_mutex_unlock(&workers->lock);
     return NULL;
 }
 
-static void do_spawn_thread(ThreadPool *pool)
+static void do_spawn_thread(ThreadPoolWorkers *workers)
 {
     QemuThread t;
 
     /* Runs with lock taken.  */
-    if (!pool->new_threads) {
+    if (!workers->new_threads) {
         return;
     }
 
-    pool->new_threads--;
-    pool->pending_threads++;
-
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    workers->new_threads--;
+    workers->pending_threads++;
+
+    if (workers->thread_context) {
+        /* Place the thread, e.g. on the NUMA node of the AioContext */
+        thread_context_create_thread(workers->thread_context, &t, "worker",
+                                     worker_thread, workers,
+                                     QEMU_THREAD_DETACHED);
+    } else {
+        qemu_thread_create(&t, "worker", worker_thread, workers,
+                           QEMU_THREAD_DETACHED);
+    }
 }
 
 static void spawn_thread_bh_fn(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorkers *workers = opaque;
 
-    qemu_mutex_lock(&pool->lock);
-    do_spawn_thread(pool);
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_lock(&workers->lock);
+    do_spawn_thread(workers);
+    qemu_mutex_unlock(&workers->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+static void spawn_thread(ThreadPoolWorkers *workers)
 {
-    pool->cur_threads++;
-    pool->new_threads++;
+    qatomic_set(&workers->cur_threads, workers->cur_threads + 1);
+    workers->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -166,8 +312,8 @@ static void spawn_thread(ThreadPool *pool)
      * If there are no idle threads, ask the main thread to create one, so we
      * inherit the correct affinity instead of the vcpu affinity.
      */
-    if (!pool->pending_threads) {
-        qemu_bh_schedule(pool->new_thread_bh);
+    if (!workers->pending_threads) {
+        qemu_bh_schedule(workers->new_thread_bh);
     }
 }
 
@@ -219,12 +365,15 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
+    QEMU_LOCK_GUARD(&q->lock);
     if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&q->request_list, elem, reqs);
+        qatomic_set(&q->depth, q->depth - 1);
+        qatomic_dec(&pool->queue_depth);
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -244,6 +393,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
     ThreadPoolElement *req;
     AioContext *ctx = qemu_get_current_aio_context();
     ThreadPool *pool = aio_get_thread_pool(ctx);
+    ThreadPoolWorkers *workers = pool->workers;
+    ThreadPoolQueue *q;
 
     /* Assert that the thread submitting work is the same running the pool */
     assert(pool->ctx == qemu_get_current_aio_context());
@@ -253,18 +404,42 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    q = &workers->queues[pool->next_queue++ % THREAD_POOL_QUEUES];
+    req->queue = q;
+    qatomic_inc(&pool->queue_depth);
+
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->request_list, req, reqs);
+    qatomic_set(&q->depth, q->depth + 1);
+    qemu_mutex_unlock(&q->lock);
+
+    /*
+     * Write the queue before reading idle_threads, so that either an idle
+     * worker sees the request or we see the worker.  Pairs with
+     * worker_thread().
+     */
+    smp_mb();
+
+    /* All workers are busy, one of them will pick the request up */
+    if (qatomic_read(&workers->idle_threads) == 0 &&
+        qatomic_read(&workers->cur_threads) >=
+        qatomic_read(&workers->max_threads)) {
+        return &req->common;
+    }
+
+    qemu_mutex_lock(&workers->lock);
+    if (workers->idle_threads == 0 &&
+        workers->cur_threads < workers->max_threads) {
+        spawn_thread(workers);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_cond_signal(&pool->request_cond);
+    qemu_mutex_unlock(&workers->lock);
+    qemu_cond_signal(&workers->request_cond);
     return &req->common;
 }
 
@@ -295,12 +470,33 @@ void thread_pool_submit(ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(func, arg, NULL, NULL);
 }
 
-void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+
+/* Called with workers->lock held */
+static void thread_pool_workers_update(ThreadPoolWorkers *workers)
 {
-    qemu_mutex_lock(&pool->lock);
+    ThreadContext *tc = NULL;
+    ThreadPool *pool;
+    int min = 0, max = 0;
 
-    pool->min_threads = ctx->thread_pool_min;
-    pool->max_threads = ctx->thread_pool_max;
+    /* Shared workers satisfy the most demanding AioContext */
+    QLIST_FOREACH(pool, &workers->pools, next) {
+        min = MAX(min, pool->min_threads);
+        max = MAX(max, pool->max_threads);
+        tc = tc ?: pool->thread_context;
+    }
+
+    workers->min_threads = min;
+    qatomic_set(&workers->max_threads, max);
+
+    if (tc != workers->thread_context) {
+        if (tc) {
+            object_ref(OBJECT(tc));
+        }
+        if (workers->thread_context) {
+            object_unref(OBJECT(workers->thread_context));
+        }
+        workers->thread_context = tc;
+    }
 
     /*
      * We either have to:
@@ -311,15 +507,104 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
      *  - Do nothing. The current number of threads fall in between the min and
      *    max thresholds. We'll let the pool manage itself.
      */
-    for (int i = pool->cur_threads; i < pool->min_threads; i++) {
-        spawn_thread(pool);
+    for (int i = workers->cur_threads; i < workers->min_threads; i++) {
+        spawn_thread(workers);
     }
 
-    for (int i = pool->cur_threads; i > pool->max_threads; i--) {
-        qemu_cond_signal(&pool->request_cond);
+    for (int i = workers->cur_threads; i > workers->max_threads; i--) {
+        qemu_cond_signal(&workers->request_cond);
+    }
+}
+
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    ThreadPoolWorkers *workers = pool->workers;
+
+    qemu_mutex_lock(&workers->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+    pool->thread_context = ctx->thread_pool_context;
+    thread_pool_workers_update(workers);
+
+    qemu_mutex_unlock(&workers->lock);
+}
+
+static ThreadPoolWorkers *thread_pool_workers_new(AioContext *ctx)
+{
+    ThreadPoolWorkers *workers = g_new0(ThreadPoolWorkers, 1);
+
+    for (int i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_init(&workers->queues[i].lock);
+        QTAILQ_INIT(&workers->queues[i].request_list);
     }
 
-    qemu_mutex_unlock(&pool->lock);
+    workers->ctx = ctx;
+    qemu_mutex_init(&workers->lock);
+    qemu_cond_init(&workers->worker_stopped);
+    qemu_cond_init(&workers->request_cond);
+    workers->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, workers);
+    QLIST_INIT(&workers->pools);
+    return workers;
+}
+
+static void thread_pool_workers_free(ThreadPoolWorkers *workers)
+{
+    qemu_mutex_lock(&workers->lock);
+
+    assert(QLIST_EMPTY(&workers->pools));
+    assert(thread_pool_queues_empty(workers));
+
+    /* Stop new threads from spawning */
+    qemu_bh_delete(workers->new_thread_bh);
+    workers->cur_threads -= workers->new_threads;
+    workers->new_threads = 0;
+
+    /* Wait for worker threads to terminate */
+    qatomic_set(&workers->max_threads, 0);
+    qemu_cond_broadcast(&workers->request_cond);
+    while (workers->cur_threads > 0) {
+        qemu_cond_wait(&workers->worker_stopped, &workers->lock);
+    }
+
+    qemu_mutex_unlock(&workers->lock);
+
+    if (workers->thread_context) {
+        object_unref(OBJECT(workers->thread_context));
+    }
+    for (int i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_destroy(&workers->queues[i].lock);
+    }
+    qemu_cond_destroy(&workers->request_cond);
+    qemu_cond_destroy(&workers->worker_stopped);
+    qemu_mutex_destroy(&workers->lock);
+    g_free(workers);
+}
+
+static ThreadPoolWorkers *thread_pool_get_shared_workers(void)
+{
+    QEMU_LOCK_GUARD(&shared_workers_lock);
+
+    if (!shared_workers) {
+        /* Threads are created from the main loop, like for its own pool */
+        shared_workers = thread_pool_workers_new(qemu_get_aio_context());
+    }
+    shared_workers->refcnt++;
+    return shared_workers;
+}
+
+static void thread_pool_put_shared_workers(void)
+{
+    ThreadPoolWorkers *workers;
+
+    WITH_QEMU_LOCK_GUARD(&shared_workers_lock) {
+        if (--shared_workers->refcnt > 0) {
+            return;
+        }
+        workers = shared_workers;
+        shared_workers = NULL;
+    }
+    thread_pool_workers_free(workers);
 }
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
@@ -331,14 +616,22 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     memset(pool, 0, sizeof(*pool));
     pool->ctx = ctx;
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
-    qemu_mutex_init(&pool->lock);
-    qemu_cond_init(&pool->worker_stopped);
-    qemu_cond_init(&pool->request_cond);
-    pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 
+    pool->shared = ctx->thread_pool_shared;
+    if (pool->shared) {
+        pool->workers = thread_pool_get_shared_workers();
+    } else {
+        pool->workers = thread_pool_workers_new(ctx);
+    }
+
+    /* Start at a different queue than the other users of shared workers */
+    pool->next_queue = g_random_int();
+
+    WITH_QEMU_LOCK_GUARD(&pool->workers->lock) {
+        QLIST_INSERT_HEAD(&pool->workers->pools, pool, next);
+    }
     thread_pool_update_params(pool, ctx);
 }
 
@@ -351,31 +644,44 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    ThreadPoolWorkers *workers;
+
     if (!pool) {
         return;
     }
 
     assert(QLIST_EMPTY(&pool->head));
 
-    qemu_mutex_lock(&pool->lock);
-
-    /* Stop new threads from spawning */
-    qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
-    pool->new_threads = 0;
-
-    /* Wait for worker threads to terminate */
-    pool->max_threads = 0;
-    qemu_cond_broadcast(&pool->request_cond);
-    while (pool->cur_threads > 0) {
-        qemu_cond_wait(&pool->worker_stopped, &pool->lock);
+    workers = pool->workers;
+    WITH_QEMU_LOCK_GUARD(&workers->lock) {
+        QLIST_REMOVE(pool, next);
+        thread_pool_workers_update(workers);
     }
 
-    qemu_mutex_unlock(&pool->lock);
+    if (pool->shared) {
+        /* Wait for workers that completed our last requests to let go */
+        while (qatomic_read(&pool->busy)) {
+            cpu_relax();
+        }
+        thread_pool_put_shared_workers();
+    } else {
+        thread_pool_workers_free(workers);
+    }
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_cond_destroy(&pool->request_cond);
-    qemu_cond_destroy(&pool->worker_stopped);
-    qemu_mutex_destroy(&pool->lock);
     g_free(pool);
 }
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    ThreadPoolWorkers *workers = pool->workers;
+
+    stats->threads = qatomic_read(&workers->cur_threads);
+    stats->idle_threads = qatomic_read(&workers->idle_threads);
+    stats->shared = pool->shared;
+    stats->queue_depth = qatomic_read(&pool->queue_depth);
+    stats->requests = stat64_get(&pool->requests);
+    stats->steals = stat64_get(&pool->steals);
+    stats->wait_ns = stat64_get(&pool->wait_ns);
+    stats->run_ns = stat64_get(&pool->run_ns);
+}